@@ -243,6 +243,7 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
 
     jpegli_set_output_format(&cinfo, ConvertDataType(dparams.output_data_type),
                              ConvertEndianness(dparams.output_endianness));
+    jpegli_set_decode_speed(&cinfo, dparams.decode_speed);
 
     if (dparams.num_colors > 0) {
       cinfo.quantize_colors = TRUE;
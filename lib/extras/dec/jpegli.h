@@ -30,6 +30,8 @@ struct JpegDecompressParams {
   bool two_pass_quant = true;
   // 0 = none, 1 = ordered, 2 = Floyd-Steinberg
   int dither_mode = 2;
+  // See jpegli_set_decode_speed().
+  int decode_speed = 0;
 };
 
 Status DecodeJpeg(const std::vector<uint8_t>& compressed,
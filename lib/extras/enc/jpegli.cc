@@ -16,6 +16,7 @@
 #include <cstring>
 #include <hwy/aligned_allocator.h>
 #include <limits>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -27,9 +28,15 @@
 #include "lib/base/types.h"
 #include "lib/cms/cms.h"
 #include "lib/cms/color_encoding_internal.h"
+#include "lib/extras/butteraugli.h"
 #include "lib/extras/codestream_header.h"
+#include "lib/extras/dec/jpegli.h"
 #include "lib/extras/enc/encode.h"
+#include "lib/extras/image.h"
+#include "lib/extras/image_color_transform.h"
+#include "lib/extras/memory_manager_internal.h"
 #include "lib/extras/packed_image.h"
+#include "lib/extras/packed_image_convert.h"
 #include "lib/extras/simd_util.h"
 #include "lib/extras/xyb_transform.h"
 #include "lib/jpegli/common.h"
@@ -74,8 +81,8 @@ Status VerifyInput(const PackedPixelFile& ppf) {
   return true;
 }
 
-Status GetColorEncoding(const PackedPixelFile& ppf,
-                        ColorEncoding* color_encoding) {
+Status GetInputColorEncoding(const PackedPixelFile& ppf,
+                             ColorEncoding* color_encoding) {
   if (ppf.primary_color_representation == PackedPixelFile::kIccIsPrimary) {
     IccBytes icc = ppf.icc;
     JXL_RETURN_IF_ERROR(
@@ -344,6 +351,109 @@ Status EncodeJpegToTargetSize(const PackedPixelFile& ppf,
   return true;
 }
 
+// Converts the color channels of the image to linear sRGB in an Image3F, which
+// is the input format of the butteraugli comparator. Uses the same conversion
+// as the butteraugli metric of the tools, so that scores are comparable.
+Status ToLinearSRGB(JxlMemoryManager* memory_manager,
+                    const PackedPixelFile& ppf, ThreadPool* pool,
+                    Image3F* linear) {
+  ColorEncoding color_encoding;
+  JXL_RETURN_IF_ERROR(GetInputColorEncoding(ppf, &color_encoding));
+  const bool is_gray = ppf.info.num_color_channels == 1;
+  const ColorEncoding c_desired = ColorEncoding::LinearSRGB(is_gray);
+  JXL_ASSIGN_OR_RETURN(
+      *linear, Image3F::Create(memory_manager, ppf.xsize(), ppf.ysize()));
+  JXL_RETURN_IF_ERROR(ConvertPackedPixelFileToImage3F(ppf, linear, pool));
+  if (!color_encoding.SameColorEncoding(c_desired)) {
+    const float intensity = GetIntensityTarget(ppf, color_encoding);
+    JXL_RETURN_IF_ERROR(ApplyColorTransform(
+        color_encoding, intensity, *linear, nullptr, Rect(*linear), c_desired,
+        *JxlGetDefaultCms(), pool, linear));
+  }
+  return true;
+}
+
+// Searches for the largest distance whose output has a butteraugli score of at
+// most the target. The reference image is converted and its psycho-visual
+// decomposition is computed only once, every candidate is then encoded,
+// decoded and compared against the cached comparator.
+Status EncodeJpegToButteraugliTarget(const PackedPixelFile& ppf,
+                                     const JpegSettings& jpeg_settings,
+                                     ThreadPool* pool,
+                                     std::vector<uint8_t>* output) {
+  constexpr int kMaxIters = 10;
+  // Relative width of the distance interval at which the search stops.
+  constexpr float kDistanceResolution = 1.05f;
+  JXL_RETURN_IF_ERROR(VerifyInput(ppf));
+  JxlMemoryManager memory_manager;
+  JXL_RETURN_IF_ERROR(MemoryManagerInit(&memory_manager, nullptr));
+  Image3F reference;
+  JXL_RETURN_IF_ERROR(ToLinearSRGB(&memory_manager, ppf, pool, &reference));
+  ButteraugliParams params;
+  std::unique_ptr<ButteraugliComparator> comparator;
+  JXL_ASSIGN_OR_RETURN(comparator,
+                       ButteraugliComparator::Make(reference, params));
+  JXL_ASSIGN_OR_RETURN(
+      ImageF diffmap,
+      ImageF::Create(&memory_manager, reference.xsize(), reference.ysize()));
+  const float target = jpeg_settings.butteraugli_target;
+  const float min_dist = jpeg_settings.min_distance;
+  const float max_dist = jpeg_settings.max_distance;
+  const auto clamp = [&](float d) {
+    return std::max(min_dist, std::min(max_dist, d));
+  };
+  // The butteraugli score of the output is close to the distance parameter.
+  float distance = clamp(target);
+  float dmin = -1.0f;  // Largest distance that meets the target.
+  float dmax = -1.0f;  // Smallest distance that does not meet the target.
+  float best_score = std::numeric_limits<float>::max();
+  output->clear();
+  for (int i = 0; i < kMaxIters; ++i) {
+    JpegSettings settings = jpeg_settings;
+    settings.butteraugli_target = 0.0f;
+    settings.libjpeg_quality = 0;
+    settings.target_size = 0;
+    settings.psnr_target = 0.0f;
+    settings.quality = 0.0f;
+    settings.distance = distance;
+    std::vector<uint8_t> compressed;
+    JXL_RETURN_IF_ERROR(EncodeJpeg(ppf, settings, pool, &compressed));
+    PackedPixelFile decoded;
+    JXL_RETURN_IF_ERROR(
+        DecodeJpeg(compressed, JpegDecompressParams(), pool, &decoded));
+    Image3F candidate;
+    JXL_RETURN_IF_ERROR(
+        ToLinearSRGB(&memory_manager, decoded, pool, &candidate));
+    JXL_RETURN_IF_ERROR(comparator->Diffmap(candidate, diffmap));
+    float score = ButteraugliScoreFromDiffmap(diffmap, &params);
+    if (score <= target) {
+      // Larger distances are only tried if they may still meet the target.
+      if (dmin < distance) {
+        dmin = distance;
+        std::swap(*output, compressed);
+      }
+    } else {
+      dmax = distance;
+      // Keep the closest output in case no distance meets the target.
+      if (dmin < 0 && score < best_score) {
+        best_score = score;
+        std::swap(*output, compressed);
+      }
+    }
+    if (dmin < 0) {
+      if (distance == min_dist) break;
+      distance = clamp(distance * target / score);
+    } else if (dmax < 0) {
+      if (distance == max_dist) break;
+      distance = clamp(distance * target / score);
+    } else {
+      if (dmax < dmin * kDistanceResolution) break;
+      distance = std::sqrt(dmin * dmax);
+    }
+  }
+  return true;
+}
+
 }  // namespace
 
 Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
@@ -361,6 +471,9 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     return EncodeJpegToTargetSize(ppf, jpeg_settings, target_size, pool,
                                   compressed);
   }
+  if (jpeg_settings.butteraugli_target > 0.0f) {
+    return EncodeJpegToButteraugliTarget(ppf, jpeg_settings, pool, compressed);
+  }
   if (jpeg_settings.target_size > 0) {
     return EncodeJpegToTargetSize(ppf, jpeg_settings, jpeg_settings.target_size,
                                   pool, compressed);
@@ -368,7 +481,7 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
   JXL_RETURN_IF_ERROR(VerifyInput(ppf));
 
   ColorEncoding color_encoding;
-  JXL_RETURN_IF_ERROR(GetColorEncoding(ppf, &color_encoding));
+  JXL_RETURN_IF_ERROR(GetInputColorEncoding(ppf, &color_encoding));
 
   ColorSpaceTransform c_transform(*JxlGetDefaultCms());
   ColorEncoding xyb_encoding;
@@ -473,6 +586,9 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     jpegli_set_progressive_level(&cinfo, jpeg_settings.progressive_level);
     cinfo.optimize_coding = TO_JXL_BOOL(jpeg_settings.optimize_coding);
+    if (jpeg_settings.effort > 0) {
+      jpegli_set_effort(&cinfo, jpeg_settings.effort);
+    }
     if (!jpeg_settings.app_data.empty()) {
       // Make sure jpegli_start_compress() does not write any APP markers.
       cinfo.write_JFIF_header = JXL_FALSE;
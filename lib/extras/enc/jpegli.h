@@ -31,11 +31,17 @@ struct JpegSettings {
   bool use_std_quant_tables = false;
   int progressive_level = 2;
   bool optimize_coding = true;
+  // If positive, overrides use_adaptive_quantization, progressive_level and
+  // optimize_coding with one of the presets of jpegli_set_effort().
+  int effort = 0;
   std::string chroma_subsampling;
   int libjpeg_quality = 0;
   std::string libjpeg_chroma_subsampling;
   // Parameters for selecting distance based on PSNR target.
   float psnr_target = 0.0f;
+  // If positive, selects the largest distance whose decoded output has at most
+  // this butteraugli score. Uses min_distance and max_distance as well.
+  float butteraugli_target = 0.0f;
   float search_tolerance = 0.01;
   float min_distance = 0.1f;
   float max_distance = 25.0f;
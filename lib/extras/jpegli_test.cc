@@ -271,6 +271,25 @@ TEST(JpegliTest, JpegliYUVEncodeTestNoAq) {
                         1.25f);
 }
 
+TEST(JpegliTest, JpegliButteraugliTargetEncodeTest) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  std::string testimage = "jxl/flower/flower_small.rgb.depth8.ppm";
+  PackedPixelFile ppf_in;
+  ASSERT_TRUE(ReadTestImage(testimage, &ppf_in));
+
+  for (float target : {1.0f, 2.5f}) {
+    std::vector<uint8_t> compressed;
+    JpegSettings settings;
+    settings.butteraugli_target = target;
+    ASSERT_TRUE(EncodeJpeg(ppf_in, settings, nullptr, &compressed));
+
+    PackedPixelFile ppf_out;
+    ASSERT_TRUE(DecodeJpeg(compressed, JpegDecompressParams(), nullptr,
+                           &ppf_out));
+    EXPECT_LE(ButteraugliDistance(memory_manager, ppf_in, ppf_out), target);
+  }
+}
+
 TEST(JpegliTest, JpegliHDRRoundtripTest) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   std::string testimage = "jxl/hdr_room.png";
@@ -32,11 +32,18 @@ void JpegBitWriterInit(j_compress_ptr cinfo) {
 }
 
 bool EmptyBitWriterBuffer(JpegBitWriter* bw) {
+  j_compress_ptr cinfo = bw->cinfo;
+  jpeg_comp_master* m = cinfo->master;
   while (bw->output_pos < bw->pos) {
-    j_compress_ptr cinfo = bw->cinfo;
-    if (cinfo->dest->free_in_buffer == 0 &&
-        !(*cinfo->dest->empty_output_buffer)(cinfo)) {
-      return false;
+    if (m->pending_output_len > 0 ||
+        (cinfo->dest->free_in_buffer == 0 &&
+         !(*cinfo->dest->empty_output_buffer)(cinfo))) {
+      if (!m->output_suspension) {
+        return false;
+      }
+      AppendPendingOutput(cinfo, bw->data + bw->output_pos,
+                          bw->pos - bw->output_pos);
+      break;
     }
     size_t buflen = bw->pos - bw->output_pos;
     size_t copylen = std::min<size_t>(cinfo->dest->free_in_buffer, buflen);
@@ -49,6 +56,61 @@ bool EmptyBitWriterBuffer(JpegBitWriter* bw) {
   return true;
 }
 
+// The pending output is kept in chunks of this size, which are not copied when
+// more output is appended and are freed together with the image memory.
+constexpr size_t kOutputChunkSize = 1 << 16;
+
+void AppendPendingOutput(j_compress_ptr cinfo, const uint8_t* data,
+                         size_t len) {
+  jpeg_comp_master* m = cinfo->master;
+  m->pending_output_len += len;
+  while (len > 0) {
+    OutputChunk* chunk = m->pending_output_tail;
+    if (chunk == nullptr || chunk->len == kOutputChunkSize) {
+      chunk = Allocate<OutputChunk>(cinfo, 1, JPOOL_IMAGE);
+      chunk->data = Allocate<uint8_t>(cinfo, kOutputChunkSize, JPOOL_IMAGE);
+      chunk->len = 0;
+      chunk->next = nullptr;
+      if (m->pending_output_tail == nullptr) {
+        m->pending_output = chunk;
+      } else {
+        m->pending_output_tail->next = chunk;
+      }
+      m->pending_output_tail = chunk;
+    }
+    size_t copylen = std::min(len, kOutputChunkSize - chunk->len);
+    memcpy(chunk->data + chunk->len, data, copylen);
+    chunk->len += copylen;
+    data += copylen;
+    len -= copylen;
+  }
+}
+
+bool FlushPendingOutput(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  while (m->pending_output != nullptr) {
+    const OutputChunk* chunk = m->pending_output;
+    while (m->pending_output_pos < chunk->len) {
+      if (cinfo->dest->free_in_buffer == 0 &&
+          !(*cinfo->dest->empty_output_buffer)(cinfo)) {
+        return false;
+      }
+      size_t pending = chunk->len - m->pending_output_pos;
+      size_t len = std::min<size_t>(cinfo->dest->free_in_buffer, pending);
+      memcpy(cinfo->dest->next_output_byte,
+             chunk->data + m->pending_output_pos, len);
+      m->pending_output_pos += len;
+      cinfo->dest->free_in_buffer -= len;
+      cinfo->dest->next_output_byte += len;
+    }
+    m->pending_output = chunk->next;
+    m->pending_output_pos = 0;
+  }
+  m->pending_output_tail = nullptr;
+  m->pending_output_len = 0;
+  return true;
+}
+
 void JumpToByteBoundary(JpegBitWriter* bw) {
   size_t n_bits = bw->free_bits & 7u;
   if (n_bits > 0) {
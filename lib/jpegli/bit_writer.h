@@ -32,6 +32,13 @@ void JpegBitWriterInit(j_compress_ptr cinfo);
 
 bool EmptyBitWriterBuffer(JpegBitWriter* bw);
 
+// Appends len bytes to the output that is written by FlushPendingOutput().
+void AppendPendingOutput(j_compress_ptr cinfo, const uint8_t* data, size_t len);
+
+// Writes as much of the pending output to the destination as it accepts,
+// returns true if all of it was written.
+bool FlushPendingOutput(j_compress_ptr cinfo);
+
 void JumpToByteBoundary(JpegBitWriter* bw);
 
 // Returns non-zero if and only if x has a zero byte, i.e. one of
@@ -57,16 +64,15 @@ static JXL_INLINE void DischargeBitBuffer(JpegBitWriter* bw) {
   // coded section, there is a zero byte, therefore we first check if any of
   // the bytes of put_buffer is 0xFF.
   if (HasZeroByte(~bw->put_buffer)) {
-    // We have a 0xFF byte somewhere, examine each byte and append a zero
-    // byte if necessary.
-    EmitByte(bw, (bw->put_buffer >> 56) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 48) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 40) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 32) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 24) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 16) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 8) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 0) & 0xFF);
+    // We have a 0xFF byte somewhere. Each byte is written followed by a zero
+    // byte, which is kept only after 0xFF bytes, so that there are no
+    // unpredictable branches.
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      const uint8_t byte = (bw->put_buffer >> shift) & 0xFF;
+      bw->data[bw->pos] = byte;
+      bw->data[bw->pos + 1] = 0;
+      bw->pos += 1 + (byte == 0xFF);
+    }
   } else {
     // We don't have any 0xFF bytes, output all 8 bytes without checking.
     StoreBE64(bw->put_buffer, bw->data + bw->pos);
@@ -95,5 +101,38 @@ static JXL_INLINE void WriteBits(JpegBitWriter* bw, int nbits, uint64_t bits) {
   bw->put_buffer |= bits;
 }
 
+// Writes two codes of at most 32 bits each with one update of the bit buffer.
+static JXL_INLINE void WriteTwoCodes(JpegBitWriter* bw, int nbits1,
+                                     uint64_t bits1, int nbits2,
+                                     uint64_t bits2) {
+  if (nbits1 == 0 || nbits2 == 0) {
+    bw->healthy = false;
+    return;
+  }
+  WriteBits(bw, nbits1 + nbits2, (bits1 << nbits2) | bits2);
+}
+
+// Writes the given number of bits, each stored in its own byte, packed into
+// as few WriteBits() calls as possible.
+static JXL_INLINE void WriteBitArray(JpegBitWriter* bw, const uint8_t* bits,
+                                     size_t num_bits) {
+  while (num_bits > 0) {
+    size_t n = num_bits < 32 ? num_bits : 32;
+    uint64_t packed = 0;
+    for (size_t i = 0; i < n; ++i) {
+      packed = (packed << 1) | bits[i];
+    }
+    WriteBits(bw, n, packed);
+    bits += n;
+    num_bits -= n;
+  }
+}
+
+// Writes a marker to the output, the bit writer must be at a byte boundary.
+static JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
+  bw->data[bw->pos++] = 0xFF;
+  bw->data[bw->pos++] = marker;
+}
+
 }  // namespace jpegli
 #endif  // LIB_JPEGLI_BIT_WRITER_H_
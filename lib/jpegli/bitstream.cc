@@ -23,11 +23,18 @@
 namespace jpegli {
 
 void WriteOutput(j_compress_ptr cinfo, const uint8_t* buf, size_t bufsize) {
+  jpeg_comp_master* m = cinfo->master;
+  m->marker_bytes += bufsize;
   size_t pos = 0;
   while (pos < bufsize) {
-    if (cinfo->dest->free_in_buffer == 0 &&
-        !(*cinfo->dest->empty_output_buffer)(cinfo)) {
-      JPEGLI_ERROR("Destination suspension is not supported in markers.");
+    if (m->pending_output_len > 0 ||
+        (cinfo->dest->free_in_buffer == 0 &&
+         !(*cinfo->dest->empty_output_buffer)(cinfo))) {
+      if (!m->output_suspension) {
+        JPEGLI_ERROR("Destination suspension is not supported in markers.");
+      }
+      AppendPendingOutput(cinfo, buf + pos, bufsize - pos);
+      return;
     }
     size_t len = std::min<size_t>(cinfo->dest->free_in_buffer, bufsize - pos);
     memcpy(cinfo->dest->next_output_byte, buf + pos, len);
@@ -310,11 +317,6 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
 
 namespace {
 
-JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
-  bw->data[bw->pos++] = 0xFF;
-  bw->data[bw->pos++] = marker;
-}
-
 void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
   HuffmanCodeTable* coding_tables = &m->coding_tables[0];
@@ -326,6 +328,12 @@ void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
   size_t next_restart = sti.restarts[restart_idx];
   uint8_t* context_map = m->context_map;
   for (size_t ta = 0; ta < num_token_arrays; ++ta) {
+    // The token arrays of spooled scans hold the tokens of one scan each, and
+    // the token offsets of the scans count only their own tokens.
+    if (m->scan_spools != nullptr &&
+        m->token_arrays[ta].scan_index != scan_index) {
+      continue;
+    }
     Token* tokens = m->token_arrays[ta].tokens;
     size_t num_tokens = m->token_arrays[ta].num_tokens;
     if (sti.token_offset < total_tokens + num_tokens &&
@@ -334,7 +342,8 @@ void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
           total_tokens < sti.token_offset ? sti.token_offset - total_tokens : 0;
       size_t end_ix = std::min(sti.token_offset + sti.num_tokens - total_tokens,
                                num_tokens);
-      size_t cycle_len = bw->len / 8;
+      // Up to two tokens are written per iteration.
+      size_t cycle_len = bw->len / 16;
       size_t next_cycle = cycle_len;
       for (size_t i = start_ix; i < end_ix; ++i) {
         if (total_tokens + i == next_restart) {
@@ -346,7 +355,16 @@ void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
         }
         Token t = tokens[i];
         const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
-        WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
+        if (i + 1 < end_ix && total_tokens + i + 1 != next_restart) {
+          Token t2 = tokens[++i];
+          const HuffmanCodeTable* code2 =
+              &coding_tables[context_map[t2.context]];
+          WriteTwoCodes(bw, code->depth[t.symbol],
+                        code->code[t.symbol] | t.bits, code2->depth[t2.symbol],
+                        code2->code[t2.symbol] | t2.bits);
+        } else {
+          WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
+        }
         if (--next_cycle == 0) {
           if (!EmptyBitWriterBuffer(bw)) {
             JPEGLI_ERROR(
@@ -369,39 +387,43 @@ void WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
   const HuffmanCodeTable* code = &m->coding_tables[m->context_map[context]];
   size_t cycle_len = bw->len / 64;
   size_t next_cycle = cycle_len;
-  size_t refbit_idx = 0;
-  size_t eobrun_idx = 0;
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
   int next_restart_marker = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
-    if (i == next_restart) {
-      JumpToByteBoundary(bw);
-      EmitMarker(bw, 0xD0 + next_restart_marker);
-      next_restart_marker += 1;
-      next_restart_marker &= 0x7;
-      next_restart = sti.restarts[++restart_idx];
-    }
-    RefToken t = sti.tokens[i];
-    int symbol = t.symbol & 253;
-    uint16_t bits = 0;
-    if ((symbol & 1) == 0) {
-      int r = symbol >> 4;
-      if (r > 0 && r < 15) {
-        bits = sti.eobruns[eobrun_idx++];
+  size_t i = 0;
+  for (size_t a = 0; a < sti.num_ref_token_arrays; ++a) {
+    const RefTokenArray& rta = sti.ref_token_arrays[a];
+    size_t refbit_idx = 0;
+    size_t eobrun_idx = 0;
+    for (size_t j = 0; j < rta.num_tokens; ++j, ++i) {
+      if (i == next_restart) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + next_restart_marker);
+        next_restart_marker += 1;
+        next_restart_marker &= 0x7;
+        next_restart = sti.restarts[++restart_idx];
       }
-    } else {
-      bits = (t.symbol >> 1) & 1;
-    }
-    WriteBits(bw, code->depth[symbol], code->code[symbol] | bits);
-    for (int j = 0; j < t.refbits; ++j) {
-      WriteBits(bw, 1, sti.refbits[refbit_idx++]);
-    }
-    if (--next_cycle == 0) {
-      if (!EmptyBitWriterBuffer(bw)) {
-        JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+      RefToken t = rta.tokens[j];
+      int symbol = t.symbol & 253;
+      uint16_t bits = 0;
+      if ((symbol & 1) == 0) {
+        int r = symbol >> 4;
+        if (r > 0 && r < 15) {
+          bits = rta.eobruns[eobrun_idx++];
+        }
+      } else {
+        bits = (t.symbol >> 1) & 1;
+      }
+      WriteBits(bw, code->depth[symbol], code->code[symbol] | bits);
+      WriteBitArray(bw, &rta.refbits[refbit_idx], t.refbits);
+      refbit_idx += t.refbits;
+      if (--next_cycle == 0) {
+        if (!EmptyBitWriterBuffer(bw)) {
+          JPEGLI_ERROR(
+              "Output suspension is not supported in finish_compress");
+        }
+        next_cycle = cycle_len;
       }
-      next_cycle = cycle_len;
     }
   }
 }
@@ -413,10 +435,11 @@ void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
   int next_restart_marker = 0;
-  size_t cycle_len = bw->len * 4;
+  // The refinement bits are written in groups of up to 32 bits per iteration,
+  // which never produce more than 8 bytes of output.
+  size_t cycle_len = bw->len / 8;
   size_t next_cycle = cycle_len;
-  size_t refbit_idx = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
+  for (size_t i = 0; i < sti.num_tokens;) {
     if (i == next_restart) {
       JumpToByteBoundary(bw);
       EmitMarker(bw, 0xD0 + next_restart_marker);
@@ -424,7 +447,12 @@ void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
       next_restart_marker &= 0x7;
       next_restart = sti.restarts[++restart_idx];
     }
-    WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+    size_t n = std::min<size_t>(32, sti.num_tokens - i);
+    if (next_restart > i) {
+      n = std::min(n, next_restart - i);
+    }
+    WriteBitArray(bw, &sti.refbits[i], n);
+    i += n;
     if (--next_cycle == 0) {
       if (!EmptyBitWriterBuffer(bw)) {
         JPEGLI_ERROR(
@@ -457,4 +485,37 @@ void WriteScanData(j_compress_ptr cinfo, int scan_index) {
   }
 }
 
+size_t FrameAndScanHeadersSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  // SOF and EOI markers.
+  size_t size = 10 + 3 * cinfo->num_components + 2;
+  bool send_table[NUM_QUANT_TBLS] = {};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    send_table[cinfo->comp_info[c].quant_tbl_no] = true;
+  }
+  size_t dqt_len = 0;
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    const JQUANT_TBL* quant_table = cinfo->quant_tbl_ptrs[i];
+    if (!send_table[i] || !quant_table || quant_table->sent_table) continue;
+    int precision = 0;
+    for (UINT16 q : quant_table->quantval) {
+      if (q > 255) precision = 1;
+    }
+    dqt_len += 1 + (1 + precision) * DCTSIZE2;
+  }
+  if (dqt_len > 0) {
+    size += 4 + dqt_len;
+  }
+  size_t last_restart_interval = m->last_restart_interval;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    size += 8 + 2 * cinfo->scan_info[i].comps_in_scan;
+    size_t restart_interval = m->scan_token_info[i].restart_interval;
+    if (restart_interval != last_restart_interval) {
+      size += 6;  // DRI
+      last_restart_interval = restart_interval;
+    }
+  }
+  return size;
+}
+
 }  // namespace jpegli
@@ -44,6 +44,11 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 JpegBitWriter* JXL_RESTRICT bw);
 void WriteScanData(j_compress_ptr cinfo, int scan_index);
 
+// Returns the size of the markers that are not yet written, from the frame
+// header until the EOI marker, except the DHT markers and the entropy coded
+// data, whose sizes depend on the symbol histograms.
+size_t FrameAndScanHeadersSize(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_BITSTREAM_H_
@@ -37,6 +37,18 @@ void jpegli_destroy(j_common_ptr cinfo) {
   }
 }
 
+void jpegli_set_retained_image_memory(j_common_ptr cinfo, size_t max_bytes) {
+  if (cinfo->mem == nullptr) return;
+  jpegli::SetMaxRetainedImageMemory(cinfo, max_bytes);
+}
+
+void jpegli_set_memory_block_allocator(
+    j_common_ptr cinfo, void* (*alloc_func)(void* opaque, size_t size),
+    void (*free_func)(void* opaque, void* address), void* opaque) {
+  if (cinfo->mem == nullptr) return;
+  jpegli::SetBlockAllocator(cinfo, alloc_func, free_func, opaque);
+}
+
 JQUANT_TBL* jpegli_alloc_quant_table(j_common_ptr cinfo) {
   JQUANT_TBL* table = jpegli::Allocate<JQUANT_TBL>(cinfo, 1);
   table->sent_table = FALSE;
@@ -37,6 +37,28 @@ JQUANT_TBL* jpegli_alloc_quant_table(j_common_ptr cinfo);
 
 JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo);
 
+//
+// New API functions that are not available in libjpeg
+//
+// NOTE: This part of the API is still experimental and will probably change in
+// the future.
+//
+
+// Keeps up to max_bytes of image lifetime memory allocated when the image is
+// finished or aborted, so that the next image of similar size processed with
+// the same object can reuse it without further allocations. The default is 0,
+// i.e. all image memory is released.
+void jpegli_set_retained_image_memory(j_common_ptr cinfo, size_t max_bytes);
+
+// Sets the functions that the memory manager uses to allocate and free its
+// memory blocks, i.e. the slabs from which the small allocations are carved
+// and the allocations that are too large to be carved. Both are called with
+// opaque as their first argument. Blocks that were already allocated are freed
+// with the free function that was set when they were allocated.
+void jpegli_set_memory_block_allocator(
+    j_common_ptr cinfo, void* (*alloc_func)(void* opaque, size_t size),
+    void (*free_func)(void* opaque, void* address), void* opaque);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -14,6 +14,9 @@
 #include <hwy/aligned_allocator.h>
 
 #include "lib/base/compiler_specific.h"  // for ssize_t
+#include "lib/base/data_parallel.h"
+#include "lib/base/parallel_runner.h"
+#include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/simd.h"
 
@@ -31,6 +34,7 @@ enum State {
   kEncHeader,
   kEncReadImage,
   kEncWriteCoeffs,
+  kEncFlushOutput,
 };
 
 template <typename T1, typename T2>
@@ -144,6 +148,20 @@ class RowBuffer {
   T* data_;
 };
 
+// Runs init_func(num_threads) followed by data_func(task, thread) for every
+// task in [begin, end) on the given parallel runner, or on the calling thread
+// if runner is nullptr. The data functions must not call JPEGLI_ERROR, since
+// the error handler might long-jump out of a worker thread.
+template <typename CInfoType, class InitFunc, class DataFunc>
+void RunOnPool(CInfoType cinfo, JxlParallelRunner runner, void* runner_opaque,
+               uint32_t begin, uint32_t end, const InitFunc& init_func,
+               const DataFunc& data_func, const char* caller) {
+  jxl::ThreadPool pool(runner, runner_opaque);
+  if (!pool.Run(begin, end, init_func, data_func, caller)) {
+    JPEGLI_ERROR("Parallel runner failed in %s", caller);
+  }
+}
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_COMMON_INTERNAL_H_
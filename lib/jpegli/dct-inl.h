@@ -238,26 +238,47 @@ void QuantizeBlock(const float* dct, const float* qmc, float aq_strength,
   }
 }
 
+// Computes the DCT of the block and quantizes its AC coefficients. The value
+// of block[0] is undefined on return, instead the scaled but not yet rounded
+// DC value and its zero-bias threshold are returned in *dc and *dc_threshold.
+// The final DC coefficient depends on the DC coefficient of the previous block
+// and can be computed with QuantizeDC().
 template <typename T>
-void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
-                             const float* JXL_RESTRICT qmc,
-                             int16_t last_dc_coeff, float aq_strength,
-                             const float* zero_bias_offset,
-                             const float* zero_bias_mul,
-                             float* JXL_RESTRICT tmp, T* block) {
+void ComputeACCoefficients(const float* JXL_RESTRICT pixels, size_t stride,
+                           const float* JXL_RESTRICT qmc, float aq_strength,
+                           const float* zero_bias_offset,
+                           const float* zero_bias_mul, float* JXL_RESTRICT tmp,
+                           T* block, float* dc, float* dc_threshold) {
   float* JXL_RESTRICT dct = tmp;
   float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
   TransformFromPixels(pixels, stride, dct, scratch_space);
   QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
   // Center DC values around zero.
   static constexpr float kDCBias = 128.0f;
-  const float dc = (dct[0] - kDCBias) * qmc[0];
-  float dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+  *dc = (dct[0] - kDCBias) * qmc[0];
+  *dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+}
+
+JXL_INLINE JXL_MAYBE_UNUSED int32_t QuantizeDC(float dc, float dc_threshold,
+                                               int16_t last_dc_coeff) {
   if (std::abs(dc - last_dc_coeff) < dc_threshold) {
-    block[0] = last_dc_coeff;
-  } else {
-    block[0] = std::round(dc);
+    return last_dc_coeff;
   }
+  return std::round(dc);
+}
+
+template <typename T>
+void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
+                             const float* JXL_RESTRICT qmc,
+                             int16_t last_dc_coeff, float aq_strength,
+                             const float* zero_bias_offset,
+                             const float* zero_bias_mul,
+                             float* JXL_RESTRICT tmp, T* block) {
+  float dc;
+  float dc_threshold;
+  ComputeACCoefficients(pixels, stride, qmc, aq_strength, zero_bias_offset,
+                        zero_bias_mul, tmp, block, &dc, &dc_threshold);
+  block[0] = QuantizeDC(dc, dc_threshold, last_dc_coeff);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -58,6 +58,7 @@ void InitializeImage(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   m->input_buffer_.clear();
   m->input_buffer_pos_ = 0;
+  m->input_buffer_src_bytes_ = 0;
   m->codestream_bits_ahead_ = 0;
   m->is_multiscan_ = false;
   m->found_soi_ = false;
@@ -65,6 +66,8 @@ void InitializeImage(j_decompress_ptr cinfo) {
   m->found_sof_ = false;
   m->found_sos_ = false;
   m->found_eoi_ = false;
+  m->dc_only_output_ = false;
+  m->skip_scan_ = false;
   m->icc_index_ = 0;
   m->icc_total_ = 0;
   m->icc_profile_.clear();
@@ -88,6 +91,7 @@ void InitializeImage(j_decompress_ptr cinfo) {
   }
   m->output_passes_done_ = 0;
   m->xoffset_ = 0;
+  m->skip_until_ = 0;
   m->dequant_ = nullptr;
 }
 
@@ -211,7 +215,15 @@ void BuildHuffmanLookupTable(j_decompress_ptr cinfo, JHUFF_TBL* table,
 
 void PrepareForScan(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
-  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+  // Scans beyond the limits of jpegli_set_progressive_limit() are skipped as
+  // if they were not in the input, so their coefficient bits are not updated.
+  // The scans of sequential images each hold whole components and are always
+  // decoded.
+  const bool beyond_limit =
+      cinfo->progressive_mode &&
+      ((m->max_scans_ > 0 && cinfo->input_scan_number >= m->max_scans_) ||
+       cinfo->Ss > m->max_coef_index_);
+  for (int i = 0; i < cinfo->comps_in_scan && !beyond_limit; ++i) {
     int comp_idx = cinfo->cur_comp_info[i]->component_index;
     int* prev_coef_bits = cinfo->coef_bits[comp_idx + cinfo->num_components];
     for (int k = std::min(cinfo->Ss, 1); k <= std::max(cinfo->Se, 9); k++) {
@@ -248,6 +260,8 @@ void PrepareForScan(j_decompress_ptr cinfo) {
         JPEGLI_ERROR("AC Huffman table %d not found", ac_tbl_idx);
       }
       BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      BuildJpegHuffmanFastACTable(
+          huff_lut, &m->ac_fast_lut_[ac_tbl_idx * kJpegHuffmanFastACSize]);
     }
   }
   // Copy quantization tables into comp_info.
@@ -284,6 +298,7 @@ void PrepareForScan(j_decompress_ptr cinfo) {
     }
   }
   memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+  m->skip_scan_ = beyond_limit || (m->dc_only_output_ && cinfo->Ss > 0);
   m->restarts_to_go_ = cinfo->restart_interval;
   m->next_restart_marker_ = 0;
   m->eobrun_ = -1;
@@ -296,6 +311,37 @@ void PrepareForScan(j_decompress_ptr cinfo) {
   cinfo->global_state = kDecProcessScan;
 }
 
+namespace {
+
+// Minimum number of bytes copied from the source buffer to the input buffer at
+// a time, while a marker segment or MCU that straddles a source buffer
+// boundary is being completed.
+constexpr size_t kMinInputBufferAppend = 1024;
+
+void ClearInputBuffer(jpeg_decomp_master* m) {
+  m->input_buffer_.clear();
+  m->input_buffer_pos_ = 0;
+  m->input_buffer_src_bytes_ = 0;
+}
+
+// Copies the next few bytes of the source buffer to the end of the input
+// buffer. The amount grows with the unconsumed part of the input buffer, so
+// that completing a large marker segment is linear in its size, while an MCU
+// straddling a buffer boundary only costs a small copy.
+void AppendInputBuffer(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  jpeg_source_mgr* src = cinfo->src;
+  JXL_DASSERT(m->input_buffer_src_bytes_ <= src->bytes_in_buffer);
+  size_t pending = m->input_buffer_.size() - m->input_buffer_pos_;
+  size_t avail = src->bytes_in_buffer - m->input_buffer_src_bytes_;
+  size_t len = std::min(avail, std::max(kMinInputBufferAppend, pending));
+  const uint8_t* begin = src->next_input_byte + m->input_buffer_src_bytes_;
+  m->input_buffer_.insert(m->input_buffer_.end(), begin, begin + len);
+  m->input_buffer_src_bytes_ += len;
+}
+
+}  // namespace
+
 int ConsumeInput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == kDecProcessScan && m->streaming_mode_ &&
@@ -317,7 +363,18 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     }
     size_t pos = 0;
     if (cinfo->global_state == kDecProcessScan) {
-      status = ProcessScan(cinfo, data, len, &pos, &m->codestream_bits_ahead_);
+      if (m->skip_scan_) {
+        status = SkipScan(cinfo, data, len, &pos, &m->codestream_bits_ahead_);
+      } else if (m->input_buffer_.empty() &&
+                 src->init_source == init_mem_source &&
+                 ProcessScanParallel(cinfo, data, len, &pos,
+                                     &m->codestream_bits_ahead_)) {
+        // The parallel scan decoder needs the whole scan in one input buffer.
+        status = JPEG_SCAN_COMPLETED;
+      } else {
+        status =
+            ProcessScan(cinfo, data, len, &pos, &m->codestream_bits_ahead_);
+      }
     } else {
       status = ProcessMarkers(cinfo, data, len, &pos);
     }
@@ -327,18 +384,23 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     } else {
       m->input_buffer_pos_ += pos;
       size_t bytes_left = m->input_buffer_.size() - m->input_buffer_pos_;
-      if (bytes_left <= src->bytes_in_buffer) {
-        src->next_input_byte += (src->bytes_in_buffer - bytes_left);
-        src->bytes_in_buffer = bytes_left;
-        m->input_buffer_.clear();
-        m->input_buffer_pos_ = 0;
+      if (bytes_left <= m->input_buffer_src_bytes_) {
+        // We are past the spilled tail, continue directly from the source.
+        size_t consumed = m->input_buffer_src_bytes_ - bytes_left;
+        bool more_in_src = m->input_buffer_src_bytes_ < src->bytes_in_buffer;
+        src->next_input_byte += consumed;
+        src->bytes_in_buffer -= consumed;
+        ClearInputBuffer(m);
+        if (status == kNeedMoreInput && more_in_src) {
+          // The decoder has not seen the rest of the source buffer yet.
+          continue;
+        }
       }
     }
     if (status == kHandleRestart) {
       JXL_DASSERT(m->input_buffer_.size() <=
-                  m->input_buffer_pos_ + src->bytes_in_buffer);
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+                  m->input_buffer_pos_ + m->input_buffer_src_bytes_);
+      ClearInputBuffer(m);
       if (cinfo->unread_marker == 0xd0 + m->next_restart_marker_) {
         cinfo->unread_marker = 0;
       } else {
@@ -357,9 +419,8 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     }
     if (status == kHandleMarkerProcessor) {
       JXL_DASSERT(m->input_buffer_.size() <=
-                  m->input_buffer_pos_ + src->bytes_in_buffer);
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+                  m->input_buffer_pos_ + m->input_buffer_src_bytes_);
+      ClearInputBuffer(m);
       if (!(*GetMarkerProcessor(cinfo))(cinfo)) {
         return JPEG_SUSPENDED;
       }
@@ -370,20 +431,29 @@ int ConsumeInput(j_decompress_ptr cinfo) {
       break;
     }
     if (m->input_buffer_.empty()) {
+      // Only the unconsumed tail of the source buffer is copied, which is at
+      // most one marker segment or MCU.
       JXL_DASSERT(m->input_buffer_pos_ == 0);
       m->input_buffer_.assign(src->next_input_byte,
                               src->next_input_byte + src->bytes_in_buffer);
+    } else if (m->input_buffer_src_bytes_ < src->bytes_in_buffer) {
+      // The current source buffer has more bytes that were not yet copied.
+      AppendInputBuffer(cinfo);
+      continue;
+    } else {
+      m->input_buffer_.erase(m->input_buffer_.begin(),
+                             m->input_buffer_.begin() + m->input_buffer_pos_);
+      m->input_buffer_pos_ = 0;
     }
     if (!(*cinfo->src->fill_input_buffer)(cinfo)) {
-      m->input_buffer_.clear();
-      m->input_buffer_pos_ = 0;
+      ClearInputBuffer(m);
       return JPEG_SUSPENDED;
     }
     if (src->bytes_in_buffer == 0) {
       JPEGLI_ERROR("Empty input.");
     }
-    m->input_buffer_.insert(m->input_buffer_.end(), src->next_input_byte,
-                            src->next_input_byte + src->bytes_in_buffer);
+    m->input_buffer_src_bytes_ = 0;
+    AppendInputBuffer(cinfo);
   }
   if (status == JPEG_SCAN_COMPLETED) {
     cinfo->global_state = kDecProcessMarkers;
@@ -495,6 +565,7 @@ void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
     coef_arrays[c] = (*cinfo->mem->request_virt_barray)(
         comptr, JPOOL_IMAGE, TRUE, comp->width_in_blocks, height_in_blocks,
         comp->v_samp_factor);
+    m->block_rows_[c] = nullptr;
   }
   cinfo->master->coef_arrays = coef_arrays;
   (*cinfo->mem->realize_virt_arrays)(comptr);
@@ -539,14 +610,178 @@ void AllocateOutputBuffers(j_decompress_ptr cinfo) {
       cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
   m->smoothing_scratch_ =
       Allocate<int16_t>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  if (cinfo->progressive_mode) {
+    size_t max_width_in_blocks = 0;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      max_width_in_blocks = std::max<size_t>(
+          max_width_in_blocks, cinfo->comp_info[c].width_in_blocks);
+    }
+    // Padding for the two blocks on each side and for full vector accesses.
+    m->smoothing_stride_ = RoundUpTo(
+        max_width_in_blocks + 4 + HWY_ALIGNMENT / sizeof(int32_t),
+        HWY_ALIGNMENT / sizeof(int32_t));
+    size_t dc_rows_size = 5 * m->smoothing_stride_;
+    size_t sums_size = SAVED_COEFS * m->smoothing_stride_;
+    m->smoothing_dc_rows_ =
+        Allocate<int32_t>(cinfo, dc_rows_size, JPOOL_IMAGE_ALIGNED);
+    m->smoothing_sums_ =
+        Allocate<int32_t>(cinfo, sums_size, JPOOL_IMAGE_ALIGNED);
+    memset(m->smoothing_dc_rows_, 0, dc_rows_size * sizeof(int32_t));
+  }
   size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
   m->nonzeros_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   m->sumabs_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   m->biases_ = Allocate<float>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   m->dequant_ = Allocate<float>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
+  m->int_dequant_ =
+      Allocate<int32_t>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   memset(m->dequant_, 0, coeffs_per_block * sizeof(float));
 }
 
+// The region index starts with a header that identifies the image, followed
+// by the entropy decoder state at the start of each iMCU row: the byte offset
+// from the start of the scan data, the number of bits already consumed from
+// that byte, the restart interval state and the DC predictors. These are
+// followed by the dequantization bias statistics at the start of every
+// kDequantBiasUpdateInterval iMCU rows: for each component the number of
+// blocks and the per-coefficient count of non-zeros and sum of absolute values
+// over all blocks of the previous iMCU rows.
+constexpr uint32_t kRegionIndexSignature = 0x49524c4a;  // "JLRI"
+constexpr size_t kRegionIndexHeaderSize = 16;
+constexpr size_t kRegionIndexEntrySize = 20 + 4 * kMaxComponents;
+constexpr size_t kRegionIndexStatsSize = 4 + 8 * DCTSIZE2;
+
+size_t RegionIndexSize(j_decompress_ptr cinfo) {
+  size_t num_stats =
+      DivCeil(cinfo->total_iMCU_rows, kDequantBiasUpdateInterval);
+  return kRegionIndexHeaderSize +
+         cinfo->total_iMCU_rows * kRegionIndexEntrySize +
+         num_stats * cinfo->num_components * kRegionIndexStatsSize;
+}
+
+void AppendRegionIndexEntry(j_decompress_ptr cinfo, const uint8_t* scan_start,
+                            std::vector<uint8_t>* index) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t pos = index->size();
+  index->resize(pos + kRegionIndexEntrySize);
+  uint8_t* entry = &(*index)[pos];
+  StoreLE64(cinfo->src->next_input_byte - scan_start, &entry[0]);
+  StoreLE32(m->codestream_bits_ahead_, &entry[8]);
+  StoreLE32(m->restarts_to_go_, &entry[12]);
+  StoreLE32(m->next_restart_marker_, &entry[16]);
+  for (int c = 0; c < kMaxComponents; ++c) {
+    StoreLE32(static_cast<int32_t>(m->last_dc_coeff_[c]), &entry[20 + 4 * c]);
+  }
+}
+
+void AppendRegionIndexStats(j_decompress_ptr cinfo, const size_t* num_blocks,
+                            const int32_t* nonzeros, const int32_t* sumabs,
+                            std::vector<uint8_t>* index) {
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    size_t pos = index->size();
+    index->resize(pos + kRegionIndexStatsSize);
+    uint8_t* entry = &(*index)[pos];
+    StoreLE32(num_blocks[c], &entry[0]);
+    for (size_t k = 0; k < DCTSIZE2; ++k) {
+      StoreLE32(nonzeros[c * DCTSIZE2 + k], &entry[4 + 8 * k]);
+      StoreLE32(sumabs[c * DCTSIZE2 + k], &entry[8 + 8 * k]);
+    }
+  }
+}
+
+// Adds the coefficients of the last decoded iMCU row to the dequantization
+// bias statistics and clears them for the next iMCU row.
+void GatherRegionIndexStats(j_decompress_ptr cinfo, size_t imcu_row,
+                            size_t* num_blocks, int32_t* nonzeros,
+                            int32_t* sumabs) {
+  jpeg_decomp_master* m = cinfo->master;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    int by0 = imcu_row * comp->v_samp_factor;
+    int block_rows_left = comp->height_in_blocks - by0;
+    int num_rows = std::min(comp->v_samp_factor, block_rows_left);
+    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], 0, num_rows,
+        TRUE);
+    for (int iy = 0; iy < num_rows; ++iy) {
+      GatherBlockStats(&blocks[iy][0][0], comp->width_in_blocks * DCTSIZE2,
+                       &nonzeros[c * DCTSIZE2], &sumabs[c * DCTSIZE2]);
+      num_blocks[c] += comp->width_in_blocks;
+      memset(blocks[iy], 0, comp->width_in_blocks * sizeof(JBLOCK));
+    }
+  }
+}
+
+// Restores the entropy decoder state of the scan from the index entry of the
+// given iMCU row. The source must be at the start of the scan data.
+void SeekToRegionIndexEntry(j_decompress_ptr cinfo, const uint8_t* entry,
+                            size_t imcu_row) {
+  jpeg_decomp_master* m = cinfo->master;
+  uint64_t offset = LoadLE64(&entry[0]);
+  if (offset > cinfo->src->bytes_in_buffer) {
+    JPEGLI_ERROR("Invalid region index.");
+  }
+  cinfo->src->next_input_byte += offset;
+  cinfo->src->bytes_in_buffer -= offset;
+  m->codestream_bits_ahead_ = LoadLE32(&entry[8]);
+  m->restarts_to_go_ = LoadLE32(&entry[12]);
+  m->next_restart_marker_ = LoadLE32(&entry[16]);
+  if (m->codestream_bits_ahead_ > 7 || m->next_restart_marker_ < 0 ||
+      m->next_restart_marker_ > 7 || m->restarts_to_go_ < 0 ||
+      m->restarts_to_go_ > static_cast<int>(cinfo->restart_interval)) {
+    JPEGLI_ERROR("Invalid region index.");
+  }
+  for (int c = 0; c < kMaxComponents; ++c) {
+    m->last_dc_coeff_[c] =
+        static_cast<int32_t>(LoadLE32(&entry[20 + 4 * c]));
+  }
+  m->scan_mcu_row_ = imcu_row * m->mcu_rows_per_iMCU_row_;
+  m->scan_mcu_col_ = 0;
+  cinfo->input_iMCU_row = imcu_row;
+  cinfo->output_iMCU_row = imcu_row;
+  PrepareForiMCURow(cinfo);
+}
+
+// Restores the dequantization bias statistics from the index entry of the
+// given iMCU row, which must be the first row of a bias update interval.
+void SeekToRegionIndexStats(j_decompress_ptr cinfo, const uint8_t* stats,
+                            size_t imcu_row) {
+  int32_t nonzeros[DCTSIZE2];
+  int32_t sumabs[DCTSIZE2];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const uint8_t* entry = &stats[c * kRegionIndexStatsSize];
+    if (!ShouldApplyDequantBiases(cinfo, c)) continue;
+    size_t num_blocks = LoadLE32(&entry[0]);
+    size_t block_rows = std::min<size_t>(imcu_row * comp->v_samp_factor,
+                                         comp->height_in_blocks);
+    if (num_blocks != block_rows * comp->width_in_blocks) {
+      JPEGLI_ERROR("Invalid region index.");
+    }
+    for (size_t k = 0; k < DCTSIZE2; ++k) {
+      nonzeros[k] = static_cast<int32_t>(LoadLE32(&entry[4 + 8 * k]));
+      sumabs[k] = static_cast<int32_t>(LoadLE32(&entry[8 + 8 * k]));
+      if (nonzeros[k] < 0 || static_cast<size_t>(nonzeros[k]) > num_blocks ||
+          sumabs[k] < nonzeros[k]) {
+        JPEGLI_ERROR("Invalid region index.");
+      }
+    }
+    SetDequantBiasStats(cinfo, c, num_blocks, nonzeros, sumabs);
+  }
+}
+
+void CheckRegionIndexSupport(j_decompress_ptr cinfo, const char* name) {
+  if (cinfo->global_state != kDecHeaderDone) {
+    JPEGLI_ERROR("%s: unexpected state %d", name, cinfo->global_state);
+  }
+  if (cinfo->src->init_source != init_mem_source) {
+    JPEGLI_ERROR("%s: the input must be in memory (see jpegli_mem_src)", name);
+  }
+  if (cinfo->master->is_multiscan_) {
+    JPEGLI_ERROR("%s: only single-scan images are supported", name);
+  }
+}
+
 }  // namespace jpegli
 
 void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
@@ -576,6 +811,11 @@ void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
   }
   m->com_marker_parser = nullptr;
   memset(m->markers_to_save_, 0, sizeof(m->markers_to_save_));
+  m->runner_ = nullptr;
+  m->runner_opaque_ = nullptr;
+  m->decode_speed_ = 0;
+  m->max_scans_ = 0;
+  m->max_coef_index_ = DCTSIZE2 - 1;
   jpegli::InitializeDecompressParams(cinfo);
   jpegli::InitializeImage(cinfo);
 }
@@ -790,12 +1030,23 @@ boolean jpegli_input_complete(j_decompress_ptr cinfo) {
 boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == jpegli::kDecHeaderDone) {
-    m->streaming_mode_ = !m->is_multiscan_ &&
+    // Decoding the restart intervals in parallel needs the coefficients of the
+    // whole image.
+    bool parallel_restarts = m->runner_ != nullptr &&
+                             cinfo->restart_interval > 0 &&
+                             cinfo->src->init_source == jpegli::init_mem_source;
+    m->streaming_mode_ = !m->is_multiscan_ && !parallel_restarts &&
                          !FROM_JXL_BOOL(cinfo->buffered_image) &&
                          (!FROM_JXL_BOOL(cinfo->quantize_colors) ||
                           !FROM_JXL_BOOL(cinfo->two_pass_quantize));
     jpegli::AllocateCoefficientBuffer(cinfo);
     jpegli_calc_output_dimensions(cinfo);
+    // The AC-only scans of progressive images can be skipped if the output
+    // has one pixel per block.
+    m->dc_only_output_ = !FROM_JXL_BOOL(cinfo->buffered_image);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      if (m->scaled_dct_size[c] != 1) m->dc_only_output_ = false;
+    }
     jpegli::PrepareForScan(cinfo);
     if (cinfo->quantize_colors) {
       if (cinfo->colormap != nullptr) {
@@ -917,8 +1168,16 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
 }
 
 JDIMENSION jpegli_skip_scanlines(j_decompress_ptr cinfo, JDIMENSION num_lines) {
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
-  return jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  jpeg_decomp_master* m = cinfo->master;
+  // The inverse transform and the rendering of the skipped rows can be left
+  // out only if the skip can not be interrupted by a suspending data source,
+  // since otherwise the remaining rows could be read later to real buffers.
+  if (m->found_eoi_ || cinfo->src->init_source == jpegli::init_mem_source) {
+    m->skip_until_ = cinfo->output_scanline + num_lines;
+  }
+  JDIMENSION num_skipped = jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  m->skip_until_ = 0;
+  return num_skipped;
 }
 
 void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
@@ -937,7 +1196,6 @@ void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
       *xoffset + *width > cinfo->output_width) {
     JPEGLI_ERROR("jpegli_crop_scanline: Invalid arguments");
   }
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
   size_t xend = *xoffset + *width;
   size_t iMCU_width = m->min_scaled_dct_size * cinfo->max_h_samp_factor;
   *xoffset = (*xoffset / iMCU_width) * iMCU_width;
@@ -1067,3 +1325,182 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
       JPEGLI_ERROR("Unsupported endianness %d", endianness);
   }
 }
+
+void jpegli_set_decode_parallel_runner(j_decompress_ptr cinfo,
+                                       JxlParallelRunner runner,
+                                       void* runner_opaque) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_decode_parallel_runner: unexpected state %d",
+                 cinfo->global_state);
+  }
+  cinfo->master->runner_ = runner;
+  cinfo->master->runner_opaque_ = runner_opaque;
+}
+
+void jpegli_set_decode_speed(j_decompress_ptr cinfo, int speed) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_decode_speed: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (speed < 0 || speed > 1) {
+    JPEGLI_ERROR("Invalid decode speed %d", speed);
+  }
+  cinfo->master->decode_speed_ = speed;
+}
+
+void jpegli_set_progressive_limit(j_decompress_ptr cinfo, int max_scans,
+                                  int max_coef_index) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecInHeader &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_progressive_limit: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (max_scans < 0) {
+    JPEGLI_ERROR("Invalid maximum number of scans %d", max_scans);
+  }
+  if (max_coef_index < 0 || max_coef_index >= DCTSIZE2) {
+    JPEGLI_ERROR("Invalid maximum coefficient index %d", max_coef_index);
+  }
+  cinfo->master->max_scans_ = max_scans;
+  cinfo->master->max_coef_index_ = max_coef_index;
+}
+
+void jpegli_build_region_index(j_decompress_ptr cinfo, unsigned char** index,
+                               unsigned long* index_size) {
+  jpeg_decomp_master* m = cinfo->master;
+  jpegli::CheckRegionIndexSupport(cinfo, "jpegli_build_region_index");
+  if (index == nullptr || index_size == nullptr) {
+    JPEGLI_ERROR("jpegli_build_region_index: invalid arguments");
+  }
+  std::vector<uint8_t> data(jpegli::kRegionIndexHeaderSize);
+  StoreLE32(jpegli::kRegionIndexSignature, &data[0]);
+  StoreLE32(cinfo->image_width, &data[4]);
+  StoreLE32(cinfo->image_height, &data[8]);
+  StoreLE32(cinfo->total_iMCU_rows, &data[12]);
+  std::vector<uint8_t> stats;
+  // Only the entropy decoder is run, into a coefficient buffer that holds one
+  // iMCU row, and the statistics of the coefficients are gathered for the
+  // adaptive dequantization.
+  m->streaming_mode_ = true;
+  jpegli::AllocateCoefficientBuffer(cinfo);
+  size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  int32_t* nonzeros = jpegli::Allocate<int32_t>(cinfo, coeffs_per_block,
+                                                JPOOL_IMAGE_ALIGNED);
+  int32_t* sumabs = jpegli::Allocate<int32_t>(cinfo, coeffs_per_block,
+                                              JPOOL_IMAGE_ALIGNED);
+  memset(nonzeros, 0, coeffs_per_block * sizeof(nonzeros[0]));
+  memset(sumabs, 0, coeffs_per_block * sizeof(sumabs[0]));
+  size_t num_blocks[jpegli::kMaxComponents] = {};
+  size_t num_gathered_rows = 0;
+  jpegli::PrepareForScan(cinfo);
+  const uint8_t* scan_start = cinfo->src->next_input_byte;
+  while (cinfo->global_state == jpegli::kDecProcessScan) {
+    if (cinfo->input_iMCU_row < cinfo->total_iMCU_rows &&
+        data.size() == jpegli::kRegionIndexHeaderSize +
+                           cinfo->input_iMCU_row *
+                               jpegli::kRegionIndexEntrySize) {
+      jpegli::AppendRegionIndexEntry(cinfo, scan_start, &data);
+      if (cinfo->input_iMCU_row % jpegli::kDequantBiasUpdateInterval == 0) {
+        jpegli::AppendRegionIndexStats(cinfo, num_blocks, nonzeros, sumabs,
+                                       &stats);
+      }
+    }
+    // There is no output, so the input is allowed to get ahead of it.
+    cinfo->output_iMCU_row = cinfo->input_iMCU_row;
+    if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+      JPEGLI_ERROR("jpegli_build_region_index: unexpected end of input");
+    }
+    if (num_gathered_rows < cinfo->input_iMCU_row) {
+      jpegli::GatherRegionIndexStats(cinfo, num_gathered_rows++, num_blocks,
+                                     nonzeros, sumabs);
+    }
+  }
+  data.insert(data.end(), stats.begin(), stats.end());
+  if (data.size() != jpegli::RegionIndexSize(cinfo)) {
+    JPEGLI_ERROR("jpegli_build_region_index: incomplete scan");
+  }
+  *index = static_cast<unsigned char*>(malloc(data.size()));
+  if (*index == nullptr) {
+    JPEGLI_ERROR("jpegli_build_region_index: out of memory");
+  }
+  memcpy(*index, data.data(), data.size());
+  *index_size = data.size();
+  jpegli_abort_decompress(cinfo);
+}
+
+void jpegli_read_region(j_decompress_ptr cinfo, const unsigned char* index,
+                        unsigned long index_size, JDIMENSION x, JDIMENSION y,
+                        JDIMENSION width, JDIMENSION height,
+                        JSAMPARRAY rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  jpegli::CheckRegionIndexSupport(cinfo, "jpegli_read_region");
+  if (index == nullptr || index_size != jpegli::RegionIndexSize(cinfo) ||
+      LoadLE32(&index[0]) != jpegli::kRegionIndexSignature ||
+      LoadLE32(&index[4]) != cinfo->image_width ||
+      LoadLE32(&index[8]) != cinfo->image_height ||
+      LoadLE32(&index[12]) != cinfo->total_iMCU_rows) {
+    JPEGLI_ERROR("jpegli_read_region: invalid region index");
+  }
+  if (cinfo->buffered_image || cinfo->raw_data_out) {
+    JPEGLI_ERROR("jpegli_read_region: unsupported output mode");
+  }
+  jpegli_start_decompress(cinfo);
+  if (!m->streaming_mode_) {
+    JPEGLI_ERROR("jpegli_read_region: the output needs more than one pass");
+  }
+  if (rows == nullptr || width == 0 || height == 0 ||
+      size_t{x} + width > cinfo->output_width ||
+      size_t{y} + height > cinfo->output_height) {
+    JPEGLI_ERROR("jpegli_read_region: invalid region");
+  }
+  JDIMENSION xoffset = x;
+  JDIMENSION crop_width = width;
+  jpegli_crop_scanline(cinfo, &xoffset, &crop_width);
+  // With context rows, the upsampling of the first row of an iMCU row uses the
+  // last row of the previous one, so decoding starts one iMCU row earlier.
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  size_t imcu_row = y / imcu_height;
+  if (m->need_context_rows_ && imcu_row > 0) {
+    --imcu_row;
+  }
+  // The dequantization biases are restored at the start of their update
+  // interval, the iMCU rows after that are decoded without rendering them, so
+  // that the statistics of the rows above the region are the same as in a
+  // full decode.
+  const size_t stats_index = imcu_row / jpegli::kDequantBiasUpdateInterval;
+  imcu_row = stats_index * jpegli::kDequantBiasUpdateInterval;
+  jpegli::SeekToRegionIndexEntry(
+      cinfo,
+      &index[jpegli::kRegionIndexHeaderSize +
+             imcu_row * jpegli::kRegionIndexEntrySize],
+      imcu_row);
+  jpegli::SeekToRegionIndexStats(
+      cinfo,
+      &index[jpegli::kRegionIndexHeaderSize +
+             cinfo->total_iMCU_rows * jpegli::kRegionIndexEntrySize +
+             stats_index * cinfo->num_components *
+                 jpegli::kRegionIndexStatsSize],
+      imcu_row);
+  cinfo->output_scanline = imcu_row * imcu_height;
+  if (y > cinfo->output_scanline) {
+    jpegli_skip_scanlines(cinfo, y - cinfo->output_scanline);
+  }
+  size_t bytes_per_pixel = cinfo->output_components *
+                           jpegli_bytes_per_sample(m->output_data_type_);
+  size_t row_offset = (x - xoffset) * bytes_per_pixel;
+  JSAMPROW row =
+      jpegli::Allocate<JSAMPLE>(cinfo, crop_width * bytes_per_pixel,
+                                JPOOL_IMAGE);
+  for (JDIMENSION i = 0; i < height; ++i) {
+    if (jpegli_read_scanlines(cinfo, &row, 1) != 1) {
+      JPEGLI_ERROR("jpegli_read_region: unexpected end of input");
+    }
+    memcpy(rows[i], row + row_offset, width * bytes_per_pixel);
+  }
+  jpegli_abort_decompress(cinfo);
+}
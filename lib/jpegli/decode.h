@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -104,6 +105,63 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Sets the parallel runner that is used to decode the restart intervals of
+// sequential scans concurrently. It only takes effect if the whole input is in
+// memory (see jpegli_mem_src) and the image has restart markers, in which case
+// the coefficients of the whole image are buffered. A nullptr runner means
+// single-threaded decoding, which is the default. The output does not depend
+// on the runner.
+void jpegli_set_decode_parallel_runner(j_decompress_ptr cinfo,
+                                       JxlParallelRunner runner,
+                                       void* runner_opaque);
+
+// Sets the speed of the decoder. At the default speed 0 the decoder uses the
+// full-precision floating point pipeline. At speed 1 it uses a fixed-point
+// IDCT for the components that are decoded at their full 8x8 DCT size and no
+// adaptive dequantization, which is faster, but the output is no longer
+// identical to that of speed 0 and has slightly lower quality. Upsampling and
+// color conversion are done in floating point at all speeds.
+void jpegli_set_decode_speed(j_decompress_ptr cinfo, int speed);
+
+// Limits the decoding of progressive images to the scans that are needed, e.g.
+// for a low-resolution preview. Only the first max_scans scans are decoded, or
+// all of them if max_scans is 0, and scans that start after the coefficient
+// with zig-zag index max_coef_index are not decoded either. The entropy coded
+// data of the other scans is skipped without decoding it, and their
+// coefficients are treated as missing, as if the input had ended before them.
+// Sequential images are always decoded in full, even if they have more than
+// one scan. The default is no limit, i.e. max_scans = 0 and
+// max_coef_index = 63.
+void jpegli_set_progressive_limit(j_decompress_ptr cinfo, int max_scans,
+                                  int max_coef_index);
+
+// Builds an index of the entropy coded data of a single-scan image that allows
+// jpegli_read_region() to start decoding at any iMCU row. It must be called
+// after jpegli_read_header() with the whole input in memory (see
+// jpegli_mem_src). The index holds the byte position and the decoder state at
+// the start of each iMCU row, and the statistics of the adaptive
+// dequantization every four iMCU rows; it does not depend on the
+// decompression parameters and can be stored alongside the image. The index
+// is returned in a buffer allocated with malloc() that the caller must free().
+// Afterwards the decompress object is reset as by jpegli_abort_decompress().
+void jpegli_build_region_index(j_decompress_ptr cinfo, unsigned char** index,
+                               unsigned long* index_size);
+
+// Decodes the width x height region at (x, y) of the output image into rows,
+// which must have room for width pixels of the output format each. It must be
+// called after jpegli_read_header() and after setting the decompression
+// parameters, with the same input in memory as jpegli_build_region_index(),
+// and it replaces the jpegli_start_decompress() ... jpegli_finish_decompress()
+// sequence. Only the iMCU rows that intersect the region are rendered; up to
+// four iMCU rows above them are decoded as well, for the upsampling and to
+// bring the adaptive dequantization statistics to their state in a full
+// decode, so that the output is identical to the same region of the full
+// output. Afterwards the decompress object is reset as by
+// jpegli_abort_decompress().
+void jpegli_read_region(j_decompress_ptr cinfo, const unsigned char* index,
+                        unsigned long index_size, JDIMENSION x, JDIMENSION y,
+                        JDIMENSION width, JDIMENSION height, JSAMPARRAY rows);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -15,6 +15,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
@@ -498,6 +499,420 @@ TEST(DecodeAPITest, ReuseCinfoSameMemSource) {
   if (buffer) free(buffer);
 }
 
+// Runs the tasks in reverse order to check that the parallel code paths do
+// not depend on the order of the tasks.
+JxlParallelRetCode ReverseOrderRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range,
+                                      uint32_t end_range) {
+  constexpr size_t kNumThreads = 3;
+  JxlParallelRetCode ret = (*init)(jpegxl_opaque, kNumThreads);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+  for (uint32_t i = end_range; i > start_range; --i) {
+    (*func)(jpegxl_opaque, i - 1, i % kNumThreads);
+  }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
+TEST(DecodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs;
+  for (TestConfig config : GenerateBasicConfigs()) {
+    if (config.jparams.progressive_mode) continue;
+    for (int restart_interval : {1, 5, 64}) {
+      config.jparams.restart_interval = restart_interval;
+      for (JpegIOMode output_mode : {PIXELS, COEFFICIENTS}) {
+        config.dparams.output_mode = output_mode;
+        all_configs.push_back(config);
+      }
+    }
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    TestImage output[2];
+    for (int use_runner : {0, 1}) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        if (use_runner) {
+          jpegli_set_decode_parallel_runner(&cinfo, ReverseOrderRunner,
+                                            nullptr);
+        }
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, config.dparams, config.input,
+                           &cinfo, &output[use_runner]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels);
+    EXPECT_EQ(output[0].coeffs, output[1].coeffs);
+  }
+}
+
+TEST(DecodeAPITest, ParallelRunnerCorruptRestartInterval) {
+  TestConfig config;
+  config.input.xsize = 257;
+  config.input.ysize = 265;
+  GeneratePixels(&config.input);
+  config.jparams.progressive_mode = 0;
+  config.jparams.restart_interval = 5;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+  // Inserts some bytes at the end of the third restart interval, which the
+  // parallel decoder rejects and the serial decoder skips with a warning.
+  size_t pos = 0;
+  while (pos + 1 < compressed.size() &&
+         (compressed[pos] != 0xff || compressed[pos + 1] != 0xda)) {
+    ++pos;
+  }
+  int num_markers = 0;
+  for (; pos + 1 < compressed.size(); ++pos) {
+    if (compressed[pos] == 0xff && compressed[pos + 1] >= 0xd0 &&
+        compressed[pos + 1] <= 0xd7 && ++num_markers == 3) {
+      break;
+    }
+  }
+  ASSERT_EQ(3, num_markers);
+  compressed.insert(compressed.begin() + pos, {0x12, 0x34, 0x56});
+  TestImage output[2];
+  int num_warnings[2] = {};
+  for (int use_runner : {0, 1}) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      if (use_runner) {
+        jpegli_set_decode_parallel_runner(&cinfo, ReverseOrderRunner,
+                                          nullptr);
+      }
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_start_decompress(&cinfo);
+      ReadOutputImage(config.dparams, &cinfo, &output[use_runner]);
+      jpegli_finish_decompress(&cinfo);
+      num_warnings[use_runner] = cinfo.err->num_warnings;
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  EXPECT_GT(num_warnings[0], 0);
+  EXPECT_EQ(num_warnings[0], num_warnings[1]);
+  EXPECT_EQ(output[0].pixels, output[1].pixels);
+}
+
+TEST(DecodeAPITest, CropAndSkipSameOutput) {
+  std::vector<TestConfig> all_configs;
+  for (TestConfig config : GenerateBasicConfigs()) {
+    for (int scale_num : {3, 8, 16}) {
+      for (bool fancy : {true, false}) {
+        config.dparams.scale_num = scale_num;
+        config.dparams.scale_denom = 8;
+        config.dparams.do_fancy_upsampling = fancy;
+        all_configs.push_back(config);
+      }
+    }
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    TestImage output[2];
+    for (int crop : {0, 1}) {
+      DecompressParams dparams = config.dparams;
+      dparams.crop_output = crop;
+      TestImage expected;
+      DecodeWithLibjpeg(config.jparams, dparams, compressed, &expected);
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, dparams, expected, &cinfo,
+                           &output[crop]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    // The cropped output must be identical to the same region of the full
+    // output, even though the skipped rows and columns are not rendered.
+    const TestImage& full = output[0];
+    const TestImage& cropped = output[1];
+    size_t xoffset = 2 * (full.xsize / 3) - cropped.xsize;
+    size_t yoffset = full.ysize / 3;
+    ASSERT_EQ(full.ysize / 3, cropped.ysize);
+    size_t full_stride = full.xsize * full.components;
+    size_t cropped_stride = cropped.xsize * cropped.components;
+    for (size_t y = 0; y < cropped.ysize; ++y) {
+      const uint8_t* full_row =
+          &full.pixels[(yoffset + y) * full_stride + xoffset * full.components];
+      const uint8_t* cropped_row = &cropped.pixels[y * cropped_stride];
+      ASSERT_EQ(0, memcmp(full_row, cropped_row, cropped_stride)) << y;
+    }
+  }
+}
+
+TEST(DecodeAPITest, DCOnlyProgressiveSameOutput) {
+  // At 1/8 scale the AC-only scans of the progressive image are skipped, the
+  // output must still be identical to that of the sequential image, which has
+  // the same quantized coefficients.
+  for (int samp : {1, 2}) {
+    TestImage output[2];
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.input.xsize = 257;
+      config.input.ysize = 265;
+      GeneratePixels(&config.input);
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = progr;
+      config.dparams.scale_num = 1;
+      config.dparams.scale_denom = 8;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      TestImage expected;
+      DecodeWithLibjpeg(config.jparams, config.dparams, compressed, &expected);
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, config.dparams, expected, &cinfo,
+                           &output[progr / 2]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels);
+  }
+}
+
+TEST(DecodeAPITest, ProgressiveLimitSameAsTruncatedInput) {
+  TestConfig config;
+  config.input.xsize = 257;
+  config.input.ysize = 265;
+  GeneratePixels(&config.input);
+  config.jparams.progressive_mode = 2;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+  std::vector<size_t> sos_pos;
+  for (size_t i = 0; i + 1 < compressed.size(); ++i) {
+    if (compressed[i] == 0xff && compressed[i + 1] == 0xda) {
+      sos_pos.push_back(i);
+    }
+  }
+  ASSERT_GT(sos_pos.size(), 2u);
+  for (size_t num_scans = 1; num_scans < sos_pos.size(); ++num_scans) {
+    // Skipping the scans after the limit must have the same effect as an
+    // input that ends after the last decoded scan.
+    std::vector<uint8_t> truncated(compressed.begin(),
+                                   compressed.begin() + sos_pos[num_scans]);
+    truncated.push_back(0xff);
+    truncated.push_back(0xd9);
+    TestImage output[2];
+    for (int limit : {0, 1}) {
+      const std::vector<uint8_t>& input = limit ? compressed : truncated;
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        if (limit) {
+          jpegli_set_progressive_limit(&cinfo, num_scans, 63);
+        }
+        jpegli_mem_src(&cinfo, input.data(), input.size());
+        TestAPINonBuffered(config.jparams, config.dparams, config.input,
+                           &cinfo, &output[limit]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels) << num_scans;
+  }
+}
+
+TEST(DecodeAPITest, ProgressiveLimitIgnoredForSequential) {
+  // The first two test scan scripts are sequential with more than one scan.
+  for (int progressive_mode : {3, 4}) {
+    TestConfig config;
+    config.input.xsize = 257;
+    config.input.ysize = 265;
+    GeneratePixels(&config.input);
+    config.jparams.progressive_mode = progressive_mode;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    TestImage output[2];
+    for (int limit : {0, 1}) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        if (limit) {
+          jpegli_set_progressive_limit(&cinfo, 1, 0);
+        }
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, config.dparams, config.input,
+                           &cinfo, &output[limit]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels) << progressive_mode;
+  }
+}
+
+TEST(DecodeAPITest, FastDecodeSpeed) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    TestImage output[2];
+    for (int speed : {0, 1}) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_set_decode_speed(&cinfo, speed);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, config.dparams, config.input,
+                           &cinfo, &output[speed]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    // The fixed-point decoder is not exact, but it must stay close to both
+    // the input and the output of the default decoder.
+    VerifyOutputImage(config.input, output[1], 2.5f);
+    VerifyOutputImage(output[0], output[1], 1.0f);
+  }
+}
+
+TEST(DecodeAPITest, ReadRegionSameOutput) {
+  std::vector<TestConfig> all_configs;
+  for (TestConfig config : GenerateBasicConfigs()) {
+    if (config.jparams.progressive_mode > 0) continue;
+    for (unsigned int restart_interval : {0u, 3u}) {
+      for (bool fancy : {true, false}) {
+        for (int scale_num : {4, 8}) {
+          config.jparams.restart_interval = restart_interval;
+          config.dparams.do_fancy_upsampling = fancy;
+          config.dparams.scale_num = scale_num;
+          config.dparams.scale_denom = 8;
+          all_configs.push_back(config);
+        }
+      }
+    }
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    // At decode speed 0, and at speed 1 with scaled output, the adaptive
+    // dequantization statistics of the rows above the region are restored
+    // from the index.
+    TestImage expected;
+    DecodeWithLibjpeg(config.jparams, config.dparams, compressed, &expected);
+    for (int speed : {0, 1}) {
+      TestImage full;
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_set_decode_speed(&cinfo, speed);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, config.dparams, expected, &cinfo,
+                           &full);
+        unsigned char* index = nullptr;
+        unsigned long index_size = 0;
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_build_region_index(&cinfo, &index, &index_size);
+        const size_t x0 = full.xsize / 3;
+        const size_t y0 = full.ysize / 3 + 5;
+        const size_t xsize = full.xsize / 4;
+        const size_t ysize = full.ysize / 2;
+        const size_t stride = xsize * full.components;
+        std::vector<uint8_t> region(ysize * stride);
+        std::vector<JSAMPROW> rows(ysize);
+        for (size_t y = 0; y < ysize; ++y) {
+          rows[y] = &region[y * stride];
+        }
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_decode_speed(&cinfo, speed);
+        SetDecompressParams(config.dparams, &cinfo);
+        jpegli_read_region(&cinfo, index, index_size, x0, y0, xsize, ysize,
+                           rows.data());
+        free(index);
+        size_t full_stride = full.xsize * full.components;
+        for (size_t y = 0; y < ysize; ++y) {
+          const uint8_t* full_row =
+              &full.pixels[(y0 + y) * full_stride + x0 * full.components];
+          EXPECT_EQ(0, memcmp(full_row, rows[y], stride)) << y;
+        }
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+  }
+}
+
+TEST(DecodeAPITest, ReuseCinfoRetainedImageMemory) {
+  std::vector<TestConfig> all_configs;
+  for (TestConfig config : GenerateBasicConfigs()) {
+    for (int restart_interval : {0, 3}) {
+      config.jparams.restart_interval = restart_interval;
+      // Decode each image twice so that the second one can use only the
+      // retained image memory.
+      all_configs.push_back(config);
+      all_configs.push_back(config);
+    }
+  }
+  std::vector<std::vector<uint8_t>> all_compressed(all_configs.size());
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    ASSERT_TRUE(EncodeWithJpegli(all_configs[i].input, all_configs[i].jparams,
+                                 &all_compressed[i]));
+  }
+  std::vector<TestImage> all_outputs(all_configs.size());
+  std::vector<TestImage> all_expected(all_configs.size());
+  for (int reuse : {0, 1}) {
+    jpeg_decompress_struct cinfo;
+    std::vector<TestImage>& outputs = reuse ? all_outputs : all_expected;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      for (size_t i = 0; i < all_configs.size(); ++i) {
+        if (!reuse && i > 0) {
+          jpegli_destroy_decompress(&cinfo);
+          jpegli_create_decompress(&cinfo);
+        }
+        if (reuse && i == 0) {
+          jpegli_set_retained_image_memory(
+              reinterpret_cast<j_common_ptr>(&cinfo), 1 << 30);
+          jpegli_set_decode_parallel_runner(&cinfo, ReverseOrderRunner,
+                                            nullptr);
+        }
+        jpegli_mem_src(&cinfo, all_compressed[i].data(),
+                       all_compressed[i].size());
+        TestAPINonBuffered(all_configs[i].jparams, DecompressParams(),
+                           all_configs[i].input, &cinfo, &outputs[i]);
+      }
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    EXPECT_EQ(all_expected[i].pixels, all_outputs[i].pixels);
+  }
+}
+
 TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
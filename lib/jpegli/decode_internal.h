@@ -27,6 +27,10 @@ static constexpr size_t kAllHuffLutSize = NUM_HUFF_TBLS * kJpegHuffmanLutSize;
 
 typedef int16_t coeff_t;
 
+// Source manager init function of jpegli_mem_src(), used to detect that the
+// whole input is available in memory.
+void init_mem_source(j_decompress_ptr cinfo);
+
 // State of the decoder that has to be saved before decoding one MCU in case
 // we run out of the bitstream.
 struct MCUCodingState {
@@ -43,8 +47,11 @@ struct jpeg_decomp_master {
   //
   // Input handling state.
   //
+  // Holds the unconsumed tail of the previous source buffer, followed by the
+  // first input_buffer_src_bytes_ bytes of the current source buffer.
   std::vector<uint8_t> input_buffer_;
   size_t input_buffer_pos_;
+  size_t input_buffer_src_bytes_;
   // Number of bits after codestream_pos_ that were already processed.
   size_t codestream_bits_ahead_;
 
@@ -53,6 +60,25 @@ struct jpeg_decomp_master {
   JBLOCKARRAY coeff_rows[jpegli::kMaxComponents];
 
   bool streaming_mode_;
+  // Only the DC coefficients are needed for the output, because all components
+  // are decoded to one pixel per block.
+  bool dc_only_output_;
+  // The entropy coded data of the current scan is skipped without decoding.
+  bool skip_scan_;
+
+  // Parallel runner used to decode the restart intervals of a scan
+  // concurrently, and the block row pointers of the coefficient arrays used
+  // by the parallel scan decoder.
+  JxlParallelRunner runner_;
+  void* runner_opaque_;
+  JBLOCKROW* block_rows_[jpegli::kMaxComponents];
+  std::vector<size_t> restart_marker_pos_;
+  std::vector<uint8_t> restart_interval_ok_;
+  // Set by jpegli_set_decode_speed().
+  int decode_speed_;
+  // Set by jpegli_set_progressive_limit().
+  int max_scans_;
+  int max_coef_index_;
 
   //
   // Marker data processing state.
@@ -72,6 +98,8 @@ struct jpeg_decomp_master {
   std::vector<uint8_t> icc_profile_;
   jpegli::HuffmanTableEntry dc_huff_lut_[jpegli::kAllHuffLutSize];
   jpegli::HuffmanTableEntry ac_huff_lut_[jpegli::kAllHuffLutSize];
+  jpegli::HuffmanFastACEntry
+      ac_fast_lut_[NUM_HUFF_TBLS * jpegli::kJpegHuffmanFastACSize];
   uint8_t markers_to_save_[32];
   jpeg_marker_parser_method app_marker_parsers[16];
   jpeg_marker_parser_method com_marker_parser;
@@ -103,6 +131,9 @@ struct jpeg_decomp_master {
   int output_passes_done_;
   JpegliDataType output_data_type_ = JPEGLI_TYPE_UINT8;
   size_t xoffset_;
+  // Output rows before this row index are being skipped by
+  // jpegli_skip_scanlines() and therefore do not have to be rendered.
+  size_t skip_until_;
   bool swap_endianness_ = false;
   bool need_context_rows_;
   bool regenerate_inverse_colormap_;
@@ -120,12 +151,26 @@ struct jpeg_decomp_master {
       const float* JXL_RESTRICT biases, float* JXL_RESTRICT scratch_space,
       float* JXL_RESTRICT output, size_t output_stride, size_t dctsize);
 
+  // Fixed-point inverse transforms of the fast decoding mode, nullptr for the
+  // components that use the floating point inverse_transform above. They
+  // transform num_blocks consecutive blocks of a block row.
+  void (*int_inverse_transform[jpegli::kMaxComponents])(
+      const int16_t* JXL_RESTRICT qblocks, size_t num_blocks,
+      const int32_t* JXL_RESTRICT dequant, float* JXL_RESTRICT output,
+      size_t output_stride);
+  int32_t* int_dequant_;
+
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
 
   float* idct_scratch_;
   float* upsample_scratch_;
   uint8_t* output_scratch_;
   int16_t* smoothing_scratch_;
+  // Edge-padded DC values of the 5 block rows around the current one, and the
+  // per-coefficient weighted sums of them used by the block smoothing.
+  int32_t* smoothing_dc_rows_;
+  int32_t* smoothing_sums_;
+  size_t smoothing_stride_;
   float* dequant_;
   // 1 = 1pass, 2 = 2pass, 3 = external
   int quant_mode_;
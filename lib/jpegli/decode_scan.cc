@@ -9,7 +9,9 @@
 #include <algorithm>
 #include <cstring>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
+#include <vector>
 
+#include "lib/base/byte_order.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
@@ -63,6 +65,21 @@ struct BitReaderState {
 
   void FillBitWindow() {
     if (bits_left_ <= 16) {
+      if (pos_ + 8 <= next_marker_pos_) {
+        // Fast path: if there is no 0xff byte among the next 8 bytes, we can
+        // append them to the bit window without looking at them one by one.
+        uint64_t bytes = LoadBE64(data_ + pos_);
+        if (!HasByteFF(bytes)) {
+          int num_bytes = (64 - bits_left_) >> 3;
+          int num_bits = num_bytes * 8;
+          val_ = num_bytes == 8
+                     ? bytes
+                     : ((val_ << num_bits) | (bytes >> (64 - num_bits)));
+          bits_left_ += num_bits;
+          pos_ += num_bytes;
+          return;
+        }
+      }
       while (bits_left_ <= 56) {
         val_ <<= 8;
         val_ |= static_cast<uint64_t>(GetNextByte());
@@ -71,6 +88,18 @@ struct BitReaderState {
     }
   }
 
+  // Returns whether any of the bytes of x is 0xff.
+  static bool HasByteFF(uint64_t x) {
+    uint64_t y = ~x;
+    return ((y - 0x0101010101010101ULL) & ~y & 0x8080808080808080ULL) != 0;
+  }
+
+  // Returns the next nbits bits without consuming them. FillBitWindow() must
+  // be called before.
+  int PeekBits(int nbits) const {
+    return (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
+  }
+
   int ReadBits(int nbits) {
     FillBitWindow();
     uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
@@ -175,7 +204,8 @@ int HuffExtend(int x, int s) {
 
 // Decodes one 8x8 block of DCT coefficients from the bit stream.
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
-                    const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
+                    const HuffmanTableEntry* ac_huff,
+                    const HuffmanFastACEntry* ac_fast, int Ss, int Se, int Al,
                     int* eobrun, BitReaderState* br, coeff_t* last_dc_coeff,
                     coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
@@ -209,6 +239,19 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
     return true;
   }
   for (int k = Ss; k <= Se; k++) {
+    br->FillBitWindow();
+    const HuffmanFastACEntry& fast =
+        ac_fast[br->PeekBits(kJpegHuffmanFastACBits)];
+    if (fast.bits > 0 && k + fast.run <= Se &&
+        fast.size + Al < kJpegDCAlphabetSize) {
+      // Short code and extra bits decoded with one lookup. Invalid symbols
+      // take the regular path, so that they consume the same bits, which
+      // matters when the data ran out within this block.
+      k += fast.run;
+      br->bits_left_ -= fast.bits;
+      coeffs[kJPEGNaturalOrder[k]] = fast.value * Am;
+      continue;
+    }
     int sr = ReadSymbol(ac_huff, br);
     if (sr >= kJpegHuffmanAlphabetSize) {
       return false;
@@ -418,8 +461,196 @@ bool FinishScan(j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
   return true;
 }
 
+// Finds the positions of the restart markers and of the marker that ends the
+// entropy coded data of the current scan, starting the search at pos. Returns
+// false if the restart markers are not in the expected order, or if the end of
+// the scan is not within the input.
+bool FindRestartMarkers(const uint8_t* data, const size_t len, size_t pos,
+                        size_t num_restarts, std::vector<size_t>* marker_pos) {
+  marker_pos->clear();
+  while (pos + 1 < len) {
+    const uint8_t* next =
+        static_cast<const uint8_t*>(memchr(data + pos, 0xff, len - 1 - pos));
+    if (next == nullptr) {
+      return false;
+    }
+    pos = next - data;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0 || marker == 0xff) {
+      // Escaped 0xff byte or fill byte.
+      pos += marker == 0 ? 2 : 1;
+      continue;
+    }
+    if (marker < 0xd0 || marker > 0xd7) {
+      marker_pos->push_back(pos);
+      return marker_pos->size() == num_restarts + 1;
+    }
+    if (marker_pos->size() == num_restarts ||
+        marker != 0xd0 + (marker_pos->size() & 7)) {
+      return false;
+    }
+    marker_pos->push_back(pos);
+    pos += 2;
+  }
+  return false;
+}
+
+// Calls func(c, block_y, block_x) for each block of the MCUs in the
+// [mcu_begin, mcu_end) range of the current scan, with c being the index of
+// the component in the scan. Blocks outside of the image are passed with
+// block_y and block_x set to the height and width of the component in blocks.
+template <typename Func>
+void ForEachBlockInMCURange(j_decompress_ptr cinfo, size_t mcu_begin,
+                            size_t mcu_end, const Func& func) {
+  for (size_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+    size_t mcu_row = mcu / cinfo->MCUs_per_row;
+    size_t mcu_col = mcu % cinfo->MCUs_per_row;
+    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+      for (int iy = 0; iy < comp->MCU_height; ++iy) {
+        size_t block_y = mcu_row * comp->MCU_height + iy;
+        for (int ix = 0; ix < comp->MCU_width; ++ix) {
+          size_t block_x = mcu_col * comp->MCU_width + ix;
+          if (block_x >= comp->width_in_blocks ||
+              block_y >= comp->height_in_blocks) {
+            if (!func(i, comp->height_in_blocks, comp->width_in_blocks)) {
+              return;
+            }
+          } else if (!func(i, block_y, block_x)) {
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Decodes the MCUs of one restart interval of a sequential scan, whose entropy
+// coded data starts at start_pos. Returns false if the data is invalid or it
+// does not end exactly at end_pos.
+bool DecodeRestartInterval(j_decompress_ptr cinfo, const uint8_t* data,
+                           const size_t len, size_t start_pos, size_t end_pos,
+                           size_t mcu_begin, size_t mcu_end) {
+  jpeg_decomp_master* m = cinfo->master;
+  BitReaderState br(data, len, start_pos);
+  coeff_t last_dc_coeff[kMaxComponents] = {0};
+  int eobrun = -1;
+  HWY_ALIGN_MAX coeff_t sink_block[DCTSIZE2];
+  bool scan_ok = true;
+  ForEachBlockInMCURange(
+      cinfo, mcu_begin, mcu_end, [&](int i, size_t block_y, size_t block_x) {
+        const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+        int c = comp->component_index;
+        coeff_t* coeffs = block_y < comp->height_in_blocks
+                              ? &m->block_rows_[c][block_y][block_x][0]
+                              : sink_block;
+        scan_ok = DecodeDCTBlock(
+            &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize],
+            &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize],
+            &m->ac_fast_lut_[comp->ac_tbl_no * kJpegHuffmanFastACSize],
+            cinfo->Ss, cinfo->Se, cinfo->Al, &eobrun, &br, &last_dc_coeff[c],
+            coeffs);
+        return scan_ok;
+      });
+  size_t pos;
+  size_t bit_pos;
+  if (!br.FinishStream(&pos, &bit_pos) || !scan_ok) {
+    return false;
+  }
+  if (bit_pos > 0) {
+    pos += data[pos] == 0xff ? 2 : 1;
+  }
+  return pos == end_pos;
+}
+
 }  // namespace
 
+bool ProcessScanParallel(j_decompress_ptr cinfo, const uint8_t* const data,
+                         const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t restart_interval = cinfo->restart_interval;
+  if (m->runner_ == nullptr || m->streaming_mode_ || cinfo->progressive_mode ||
+      restart_interval == 0 || m->scan_mcu_row_ != 0 ||
+      m->scan_mcu_col_ != 0 || *bit_pos != 0) {
+    return false;
+  }
+  const size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  const size_t num_intervals = DivCeil(num_mcus, restart_interval);
+  // The marker positions and interval statuses are kept in the master, so that
+  // their memory is reused across scans and images.
+  std::vector<size_t>& marker_pos = m->restart_marker_pos_;
+  if (num_intervals < 2 ||
+      !FindRestartMarkers(data, len, *pos, num_intervals - 1, &marker_pos)) {
+    return false;
+  }
+  // The memory manager is not thread-safe, so we collect the block row
+  // pointers of the whole coefficient arrays here.
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    if (m->block_rows_[c] != nullptr) {
+      continue;
+    }
+    m->block_rows_[c] =
+        Allocate<JBLOCKROW>(cinfo, comp->height_in_blocks, JPOOL_IMAGE);
+    for (size_t by0 = 0; by0 < comp->height_in_blocks;
+         by0 += comp->v_samp_factor) {
+      size_t num_rows =
+          std::min<size_t>(comp->v_samp_factor, comp->height_in_blocks - by0);
+      JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by0,
+          num_rows, TRUE);
+      std::copy(rows, rows + num_rows, &m->block_rows_[c][by0]);
+    }
+  }
+  std::vector<uint8_t>& interval_ok = m->restart_interval_ok_;
+  interval_ok.assign(num_intervals, 0);
+  const auto decode_interval = [&](uint32_t k, size_t /*thread*/) {
+    size_t start_pos = k == 0 ? *pos : marker_pos[k - 1] + 2;
+    size_t mcu_begin = k * restart_interval;
+    size_t mcu_end = std::min(mcu_begin + restart_interval, num_mcus);
+    interval_ok[k] = DecodeRestartInterval(cinfo, data, len, start_pos,
+                                           marker_pos[k], mcu_begin, mcu_end);
+    return true;
+  };
+  const auto no_init = [](size_t /*num_threads*/) { return true; };
+  RunOnPool(cinfo, m->runner_, m->runner_opaque_, 0, num_intervals, no_init,
+            decode_interval, "ProcessScanParallel");
+  size_t first_bad = std::find(interval_ok.begin(), interval_ok.end(), 0) -
+                     interval_ok.begin();
+  if (first_bad < num_intervals) {
+    // Clear the coefficients written by the intervals starting from the first
+    // invalid one and let the serial decoder continue from there, so that
+    // errors and warnings are reported the same way as without the runner.
+    ForEachBlockInMCURange(
+        cinfo, first_bad * restart_interval, num_mcus,
+        [&](int i, size_t block_y, size_t block_x) {
+          const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+          if (block_y < comp->height_in_blocks) {
+            int c = comp->component_index;
+            memset(m->block_rows_[c][block_y][block_x], 0, sizeof(JBLOCK));
+          }
+          return true;
+        });
+    if (first_bad > 0) {
+      size_t mcu = first_bad * restart_interval;
+      *pos = marker_pos[first_bad - 1] + 2;
+      m->scan_mcu_row_ = mcu / cinfo->MCUs_per_row;
+      m->scan_mcu_col_ = mcu % cinfo->MCUs_per_row;
+      m->next_restart_marker_ = first_bad & 7;
+      cinfo->input_iMCU_row = m->scan_mcu_row_ / m->mcu_rows_per_iMCU_row_;
+      PrepareForiMCURow(cinfo);
+    }
+    return false;
+  }
+  *pos = marker_pos.back();
+  m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+  m->scan_mcu_col_ = 0;
+  m->next_restart_marker_ = (num_intervals - 1) & 7;
+  cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+  return true;
+}
+
 void PrepareForiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   for (int i = 0; i < cinfo->comps_in_scan; ++i) {
@@ -485,6 +716,8 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
           &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
       const HuffmanTableEntry* ac_lut =
           &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
+      const HuffmanFastACEntry* ac_fast =
+          &m->ac_fast_lut_[comp->ac_tbl_no * kJpegHuffmanFastACSize];
       for (int iy = 0; iy < comp->MCU_height; ++iy) {
         size_t block_y = m->scan_mcu_row_ * comp->MCU_height + iy;
         int biy = block_y % comp->v_samp_factor;
@@ -502,8 +735,8 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
             coeffs = &m->coeff_rows[c][biy][block_x][0];
           }
           if (cinfo->Ah == 0) {
-            if (!DecodeDCTBlock(dc_lut, ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br,
+            if (!DecodeDCTBlock(dc_lut, ac_lut, ac_fast, cinfo->Ss, cinfo->Se,
+                                cinfo->Al, &m->eobrun_, &br,
                                 &m->last_dc_coeff_[comp->component_index],
                                 coeffs)) {
               scan_ok = false;
@@ -568,4 +801,33 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
   return JPEG_SCAN_COMPLETED;
 }
 
+int SkipScan(j_decompress_ptr cinfo, const uint8_t* const data,
+             const size_t len, size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  *bit_pos = 0;
+  while (*pos + 1 < len) {
+    const uint8_t* next =
+        static_cast<const uint8_t*>(memchr(data + *pos, 0xff, len - 1 - *pos));
+    if (next == nullptr) {
+      // Keep the last byte, it can be the first byte of a marker.
+      *pos = len - 1;
+      return kNeedMoreInput;
+    }
+    *pos = next - data;
+    uint8_t marker = data[*pos + 1];
+    if (marker == 0xff) {
+      // Fill byte.
+      *pos += 1;
+    } else if (marker == 0 || (marker >= 0xd0 && marker <= 0xd7)) {
+      // Escaped 0xff byte or restart marker.
+      *pos += 2;
+    } else {
+      m->eobrun_ = -1;
+      cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+      return JPEG_SCAN_COMPLETED;
+    }
+  }
+  return kNeedMoreInput;
+}
+
 }  // namespace jpegli
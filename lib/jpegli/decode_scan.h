@@ -26,6 +26,22 @@ namespace jpegli {
 int ProcessScan(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
                 size_t* pos, size_t* bit_pos);
 
+// Decodes the whole sequential scan at once by decoding its restart intervals
+// in parallel with the runner set by jpegli_set_decode_parallel_runner().
+// The entropy coded data of the whole scan must be in the [data, data + len)
+// input range, and the decoder must be at the start of the scan.
+// Returns false if the scan can not be decoded this way, in which case the
+// caller has to continue with ProcessScan(); this can happen after some
+// restart intervals were already decoded and *pos was moved past them.
+bool ProcessScanParallel(j_decompress_ptr cinfo, const uint8_t* data,
+                         size_t len, size_t* pos, size_t* bit_pos);
+
+// Skips the entropy coded data of the current scan without decoding it, by
+// searching for the marker that ends the scan. Returns JPEG_SCAN_COMPLETED
+// with *pos at that marker, or kNeedMoreInput if the input ends before it.
+int SkipScan(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
+             size_t* pos, size_t* bit_pos);
+
 void PrepareForiMCURow(j_decompress_ptr cinfo);
 
 }  // namespace jpegli
@@ -90,6 +90,48 @@ struct MemoryDestinationManager {
   }
 };
 
+struct ChunkDestinationManager {
+  jpeg_destination_mgr pub;
+  jpegli_chunk_request_func request;
+  void* opaque;
+  size_t* total_size;
+  // Total size of the chunks before the current one.
+  size_t full_chunks_size;
+  size_t chunk_size;
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkDestinationManager*>(cinfo->dest);
+    // The first chunk is requested when the first byte is written.
+    dest->full_chunks_size = 0;
+    dest->chunk_size = 0;
+    dest->pub.next_output_byte = nullptr;
+    dest->pub.free_in_buffer = 0;
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkDestinationManager*>(cinfo->dest);
+    unsigned char* chunk = nullptr;
+    size_t chunk_size = 0;
+    if (!(*dest->request)(dest->opaque, &chunk, &chunk_size)) {
+      return FALSE;
+    }
+    if (chunk == nullptr || chunk_size == 0) {
+      JPEGLI_ERROR("jpegli_chunk_dest: invalid output chunk.");
+    }
+    dest->full_chunks_size += dest->chunk_size;
+    dest->chunk_size = chunk_size;
+    dest->pub.next_output_byte = chunk;
+    dest->pub.free_in_buffer = chunk_size;
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkDestinationManager*>(cinfo->dest);
+    *dest->total_size =
+        dest->full_chunks_size + dest->chunk_size - dest->pub.free_in_buffer;
+  }
+};
+
 }  // namespace jpegli
 
 void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile) {
@@ -151,3 +193,32 @@ void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
   dest->pub.next_output_byte = dest->current_buffer;
   dest->pub.free_in_buffer = dest->buffer_size;
 }
+
+void jpegli_chunk_dest(j_compress_ptr cinfo, jpegli_chunk_request_func request,
+                       void* opaque, size_t* total_size) {
+  if (request == nullptr || total_size == nullptr) {
+    JPEGLI_ERROR("jpegli_chunk_dest: Invalid destination.");
+  }
+  if (cinfo->dest && cinfo->dest->init_destination !=
+                         jpegli::ChunkDestinationManager::init_destination) {
+    JPEGLI_ERROR("jpegli_chunk_dest: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(
+        jpegli::Allocate<jpegli::ChunkDestinationManager>(cinfo, 1));
+  }
+  auto* dest = reinterpret_cast<jpegli::ChunkDestinationManager*>(cinfo->dest);
+  dest->request = request;
+  dest->opaque = opaque;
+  dest->total_size = total_size;
+  dest->full_chunks_size = 0;
+  dest->chunk_size = 0;
+  dest->pub.next_output_byte = nullptr;
+  dest->pub.free_in_buffer = 0;
+  dest->pub.init_destination =
+      jpegli::ChunkDestinationManager::init_destination;
+  dest->pub.empty_output_buffer =
+      jpegli::ChunkDestinationManager::empty_output_buffer;
+  dest->pub.term_destination =
+      jpegli::ChunkDestinationManager::term_destination;
+}
@@ -7,10 +7,12 @@
 #include "lib/jpegli/downsample.h"
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/downsample.cc"
@@ -291,28 +293,33 @@ void DownsampleInputBuffer(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   const size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
   const size_t y0 = m->next_iMCU_row * iMCU_height;
-  const size_t y1 = y0 + iMCU_height;
   const size_t xsize_padded = m->xsize_blocks * DCTSIZE;
-  for (int c = 0; c < cinfo->num_components; c++) {
+  // Each output row of each component is computed in a separate task, where
+  // the task index is c * iMCU_height + (index of the row in the iMCU row).
+  const auto downsample_row = [&](uint32_t task, size_t /*thread*/) {
+    const int c = task / iMCU_height;
+    const size_t iy_out = task % iMCU_height;
     jpeg_component_info* comp = &cinfo->comp_info[c];
     const int h_factor = cinfo->max_h_samp_factor / comp->h_samp_factor;
     const int v_factor = cinfo->max_v_samp_factor / comp->v_samp_factor;
-    if (h_factor == 1 && v_factor == 1) {
-      continue;
+    if ((h_factor == 1 && v_factor == 1) || iy_out * v_factor >= iMCU_height) {
+      return true;
     }
+    const size_t y_in = y0 + iy_out * v_factor;
     auto& input = *m->smooth_input[c];
     auto& output = *m->raw_data[c];
-    const size_t y_out0 = y0 / v_factor;
     float* rows_in[MAX_SAMP_FACTOR];
-    for (size_t y_in = y0, y_out = y_out0; y_in < y1;
-         y_in += v_factor, ++y_out) {
-      for (int iy = 0; iy < v_factor; ++iy) {
-        rows_in[iy] = input.Row(y_in + iy);
-      }
-      float* row_out = output.Row(y_out);
-      (*m->downsample_method[c])(rows_in, xsize_padded, row_out);
+    for (int iy = 0; iy < v_factor; ++iy) {
+      rows_in[iy] = input.Row(y_in + iy);
     }
-  }
+    float* row_out = output.Row(y0 / v_factor + iy_out);
+    (*m->downsample_method[c])(rows_in, xsize_padded, row_out);
+    return true;
+  };
+  const auto no_init = [](size_t /*num_threads*/) { return true; };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0,
+            cinfo->num_components * iMCU_height, no_init, downsample_row,
+            "DownsampleInputBuffer");
 }
 
 void ApplyInputSmoothing(j_compress_ptr cinfo) {
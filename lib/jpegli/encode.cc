@@ -7,6 +7,7 @@
 #include "lib/jpegli/encode.h"
 
 #include <algorithm>
+#include <csetjmp>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
@@ -83,6 +84,8 @@ void InitializeCompressParams(j_compress_ptr cinfo) {
 #endif
   cinfo->master->psnr_target = 0.0f;
   cinfo->master->psnr_tolerance = 0.01f;
+  cinfo->master->target_size = 0;
+  cinfo->master->target_size_tolerance = 0.02f;
   cinfo->master->min_distance = 0.1f;
   cinfo->master->max_distance = 25.0f;
 }
@@ -387,22 +390,37 @@ bool IsStreamingSupported(j_compress_ptr cinfo) {
   if (cinfo->global_state == kEncWriteCoeffs) {
     return false;
   }
-  // TODO(szabadka) Remove this restriction.
-  if (cinfo->restart_interval > 0 || cinfo->restart_in_rows > 0) {
-    return false;
-  }
   if (cinfo->num_scans > 1) {
     return false;
   }
-  if (cinfo->master->psnr_target > 0) {
+  // The distance is chosen for the whole image, so no block row can be
+  // quantized and written out before the last one is read.
+  if (jpegli::HasDistanceTarget(cinfo)) {
     return false;
   }
   return true;
 }
 
+// Returns true if the scans of a multi-scan image can be tokenized one iMCU row
+// at a time while the image is read, so that only the coefficients of the
+// current iMCU row have to be buffered.
+bool IsScanSpoolingSupported(j_compress_ptr cinfo) {
+  if (cinfo->global_state == kEncWriteCoeffs) {
+    return false;
+  }
+  if (cinfo->num_scans == 1) {
+    return false;
+  }
+  return !jpegli::HasDistanceTarget(cinfo);
+}
+
 void AllocateBuffers(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+  m->num_threads = 0;
+  m->band_tokens = nullptr;
+  m->band_restarts = nullptr;
+  m->scan_spools = nullptr;
   if (!IsStreamingSupported(cinfo) || cinfo->optimize_coding) {
     int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
     int num_arrays = cinfo->num_scans * ysize_blocks;
@@ -449,16 +467,27 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
   if (!IsStreamingSupported(cinfo)) {
+    const bool spool_scans = IsScanSpoolingSupported(cinfo);
     m->coeff_buffers =
         Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       const size_t xsize_blocks = comp->width_in_blocks;
-      const size_t ysize_blocks = comp->height_in_blocks;
+      const size_t ysize_blocks =
+          spool_scans ? comp->v_samp_factor : comp->height_in_blocks;
       m->coeff_buffers[c] = (*cinfo->mem->request_virt_barray)(
           reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
           /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
     }
+    if (m->runner != nullptr) {
+      m->dc_values =
+          Allocate<float>(cinfo, m->blocks_per_iMCU_row, JPOOL_IMAGE);
+      m->dc_thresholds =
+          Allocate<float>(cinfo, m->blocks_per_iMCU_row, JPOOL_IMAGE);
+    }
+    if (spool_scans) {
+      InitScanSpools(cinfo);
+    }
   }
   if (m->use_adaptive_quantization) {
     int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
@@ -471,7 +500,7 @@ void AllocateBuffers(j_compress_ptr cinfo) {
     m->fuzzy_erosion_tmp.Allocate(cinfo, 2, xsize_padded);
     m->pre_erosion.Allocate(cinfo, 6 * cinfo->max_v_samp_factor, xsize_padded);
     size_t qf_height = cinfo->max_v_samp_factor;
-    if (m->psnr_target > 0) {
+    if (HasDistanceTarget(cinfo)) {
       qf_height *= cinfo->total_iMCU_rows;
     }
     m->quant_field.Allocate(cinfo, qf_height, xsize_blocks);
@@ -502,30 +531,233 @@ void InitProgressMonitor(j_compress_ptr cinfo) {
   }
 }
 
-// Common setup code between streaming and transcoding code paths. Called in
-// both jpegli_start_compress() and jpegli_write_coefficients().
-void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
+// Clears the output left over from an interrupted
+// jpegli_finish_compress_suspending() call.
+void ResetPendingOutput(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
-  (*cinfo->err->reset_error_mgr)(reinterpret_cast<j_common_ptr>(cinfo));
-  ProcessCompressionParams(cinfo);
-  InitProgressMonitor(cinfo);
-  AllocateBuffers(cinfo);
+  m->output_suspension = false;
+  m->pending_output = nullptr;
+  m->pending_output_tail = nullptr;
+  m->pending_output_len = 0;
+  m->pending_output_pos = 0;
+}
+
+bool UsesFixedHuffmanCodes(j_compress_ptr cinfo) {
+  return !cinfo->optimize_coding && !cinfo->progressive_mode;
+}
+
+// Computes the tables and chooses the methods that depend only on the
+// compression parameters and not on the image dimensions or contents.
+void InitTables(j_compress_ptr cinfo) {
   if (cinfo->global_state != kEncWriteCoeffs) {
     ChooseInputMethod(cinfo);
     if (!cinfo->raw_data_in) {
       ChooseColorTransform(cinfo);
       ChooseDownsampleMethods(cinfo);
     }
-    QuantPass pass = m->psnr_target > 0 ? QuantPass::SEARCH_FIRST_PASS
-                                        : QuantPass::NO_SEARCH;
+    QuantPass pass = HasDistanceTarget(cinfo) ? QuantPass::SEARCH_FIRST_PASS
+                                              : QuantPass::NO_SEARCH;
     InitQuantizer(cinfo, pass);
   }
+  if (UsesFixedHuffmanCodes(cinfo)) {
+    CopyHuffmanTables(cinfo);
+    InitEntropyCoder(cinfo);
+  }
+}
+
+// Compression parameters that the results of InitTables() depend on. Only the
+// Huffman tables and scan components of fixed Huffman codes are included.
+struct SetupKey {
+  int global_state;
+  int has_distance_target;
+  int input_components;
+  int num_components;
+  int in_color_space;
+  int jpeg_color_space;
+  int data_type;
+  int endianness;
+  int raw_data_in;
+  int xyb_mode;
+  int cicp_transfer_function;
+  int force_baseline;
+  int use_adaptive_quantization;
+  int fixed_codes;
+  int h_samp_factor[kMaxComponents];
+  int v_samp_factor[kMaxComponents];
+  int quant_tbl_no[kMaxComponents];
+  UINT16 quantval[kMaxComponents][DCTSIZE2];
+  int num_scans;
+  int scan_components[kMaxComponents][MAX_COMPS_IN_SCAN + 1];
+  int huff_tbl_no[2 * kMaxComponents];
+  int huff_sent[2 * kMaxComponents];
+  UINT8 huff_bits[2 * kMaxComponents][17];
+  UINT8 huffval[2 * kMaxComponents][256];
+};
+
+// Results of InitTables() for the compression parameters in key.
+struct SetupCache {
+  bool valid = false;
+  SetupKey key;
+  decltype(jpeg_comp_master::input_method) input_method;
+  decltype(jpeg_comp_master::color_transform) color_transform;
+  decltype(jpeg_comp_master::downsample_method) downsample_method;
+  float quant_mul[kMaxComponents][DCTSIZE2];
+  float zero_bias_offset[kMaxComponents][DCTSIZE2];
+  float zero_bias_mul[kMaxComponents][DCTSIZE2];
+  size_t num_huffman_tables;
+  JHUFF_TBL huffman_tables[2 * kMaxComponents];
+  uint8_t slot_id_map[2 * kMaxComponents];
+  uint8_t context_map[8];
+  HuffmanCodeTable coding_tables[2 * kMaxComponents];
+};
+
+bool CopyHuffmanTableToKey(const JHUFF_TBL* table, int tbl_no, int idx,
+                           SetupKey* key) {
+  if (table == nullptr) return false;
+  key->huff_tbl_no[idx] = tbl_no;
+  key->huff_sent[idx] = table->sent_table;
+  memcpy(key->huff_bits[idx], table->bits, sizeof(key->huff_bits[idx]));
+  memcpy(key->huffval[idx], table->huffval, sizeof(key->huffval[idx]));
+  return true;
+}
+
+// Returns false if the compression parameters are invalid, in which case
+// InitTables() reports the error.
+bool GetSetupKey(j_compress_ptr cinfo, SetupKey* key) {
+  jpeg_comp_master* m = cinfo->master;
+  memset(key, 0, sizeof(*key));
+  key->global_state = cinfo->global_state;
+  key->has_distance_target = HasDistanceTarget(cinfo);
+  key->input_components = cinfo->input_components;
+  key->num_components = cinfo->num_components;
+  key->in_color_space = cinfo->in_color_space;
+  key->jpeg_color_space = cinfo->jpeg_color_space;
+  key->data_type = m->data_type;
+  key->endianness = m->endianness;
+  key->raw_data_in = cinfo->raw_data_in;
+  key->xyb_mode = m->xyb_mode;
+  key->cicp_transfer_function = m->cicp_transfer_function;
+  key->force_baseline = m->force_baseline;
+  key->use_adaptive_quantization = m->use_adaptive_quantization;
+  key->fixed_codes = UsesFixedHuffmanCodes(cinfo);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    key->h_samp_factor[c] = comp->h_samp_factor;
+    key->v_samp_factor[c] = comp->v_samp_factor;
+    int quant_idx = comp->quant_tbl_no;
+    if (quant_idx < 0 || quant_idx >= NUM_QUANT_TBLS ||
+        cinfo->quant_tbl_ptrs[quant_idx] == nullptr) {
+      return false;
+    }
+    key->quant_tbl_no[c] = quant_idx;
+    memcpy(key->quantval[c], cinfo->quant_tbl_ptrs[quant_idx]->quantval,
+           sizeof(key->quantval[c]));
+  }
+  if (!key->fixed_codes) {
+    return true;
+  }
+  if (cinfo->num_scans > static_cast<int>(kMaxComponents)) {
+    return false;
+  }
+  key->num_scans = cinfo->num_scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    key->scan_components[i][0] = si->comps_in_scan;
+    for (int j = 0; j < si->comps_in_scan; ++j) {
+      key->scan_components[i][j + 1] = si->component_index[j];
+    }
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    int dc_idx = comp->dc_tbl_no;
+    int ac_idx = comp->ac_tbl_no;
+    if (dc_idx < 0 || dc_idx >= NUM_HUFF_TBLS || ac_idx < 0 ||
+        ac_idx >= NUM_HUFF_TBLS ||
+        !CopyHuffmanTableToKey(cinfo->dc_huff_tbl_ptrs[dc_idx], dc_idx, 2 * c,
+                               key) ||
+        !CopyHuffmanTableToKey(cinfo->ac_huff_tbl_ptrs[ac_idx], ac_idx,
+                               2 * c + 1, key)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void SaveTables(j_compress_ptr cinfo, const SetupKey& key, SetupCache* cache) {
+  jpeg_comp_master* m = cinfo->master;
+  cache->valid = true;
+  cache->key = key;
+  if (cinfo->global_state != kEncWriteCoeffs) {
+    cache->input_method = m->input_method;
+    cache->color_transform = m->color_transform;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      cache->downsample_method[c] = m->downsample_method[c];
+      memcpy(cache->quant_mul[c], m->quant_mul[c], DCTSIZE2 * sizeof(float));
+      memcpy(cache->zero_bias_offset[c], m->zero_bias_offset[c],
+             DCTSIZE2 * sizeof(float));
+      memcpy(cache->zero_bias_mul[c], m->zero_bias_mul[c],
+             DCTSIZE2 * sizeof(float));
+    }
+  }
+  if (key.fixed_codes) {
+    cache->num_huffman_tables = m->num_huffman_tables;
+    for (size_t i = 0; i < m->num_huffman_tables; ++i) {
+      cache->huffman_tables[i] = m->huffman_tables[i];
+      cache->slot_id_map[i] = m->slot_id_map[i];
+      cache->coding_tables[i] = m->coding_tables[i];
+    }
+    memcpy(cache->context_map, m->context_map, sizeof(cache->context_map));
+  }
+}
+
+void RestoreTables(j_compress_ptr cinfo, SetupCache* cache) {
+  jpeg_comp_master* m = cinfo->master;
+  if (cinfo->global_state != kEncWriteCoeffs) {
+    m->input_method = cache->input_method;
+    m->color_transform = cache->color_transform;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      m->downsample_method[c] = cache->downsample_method[c];
+      memcpy(m->quant_mul[c], cache->quant_mul[c], DCTSIZE2 * sizeof(float));
+      memcpy(m->zero_bias_offset[c], cache->zero_bias_offset[c],
+             DCTSIZE2 * sizeof(float));
+      memcpy(m->zero_bias_mul[c], cache->zero_bias_mul[c],
+             DCTSIZE2 * sizeof(float));
+    }
+  }
+  if (cache->key.fixed_codes) {
+    // The tables are not modified after their initialization, so they can be
+    // used directly from the cache.
+    m->num_huffman_tables = cache->num_huffman_tables;
+    m->huffman_tables = cache->huffman_tables;
+    m->slot_id_map = cache->slot_id_map;
+    m->context_map = cache->context_map;
+    m->coding_tables = cache->coding_tables;
+  }
+}
+
+// Common setup code between streaming and transcoding code paths. Called in
+// both jpegli_start_compress() and jpegli_write_coefficients().
+void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
+  jpeg_comp_master* m = cinfo->master;
+  (*cinfo->err->reset_error_mgr)(reinterpret_cast<j_common_ptr>(cinfo));
+  ResetPendingOutput(cinfo);
+  m->marker_bytes = 0;
+  m->entropy_coding_ready = false;
+  ProcessCompressionParams(cinfo);
+  InitProgressMonitor(cinfo);
+  AllocateBuffers(cinfo);
   if (write_all_tables) {
     jpegli_suppress_tables(cinfo, FALSE);
   }
-  if (!cinfo->optimize_coding && !cinfo->progressive_mode) {
-    CopyHuffmanTables(cinfo);
-    InitEntropyCoder(cinfo);
+  SetupCache* cache = m->setup_cache;
+  SetupKey key;
+  if (cache == nullptr || !GetSetupKey(cinfo, &key)) {
+    InitTables(cinfo);
+  } else if (cache->valid && memcmp(&key, &cache->key, sizeof(key)) == 0) {
+    RestoreTables(cinfo, cache);
+  } else {
+    InitTables(cinfo);
+    SaveTables(cinfo, key, cache);
   }
   (*cinfo->dest->init_destination)(cinfo);
   WriteFileHeader(cinfo);
@@ -607,6 +839,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
     }
   } else {
     ComputeCoefficientsForiMCURow(cinfo);
+    if (cinfo->master->scan_spools != nullptr) {
+      TokenizeiMCURow(cinfo);
+    }
   }
   ++cinfo->master->next_iMCU_row;
 }
@@ -693,6 +928,13 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->scan_spools = nullptr;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->setup_cache = nullptr;
+  cinfo->master->marker_bytes = 0;
+  cinfo->master->entropy_coding_ready = false;
+  jpegli::ResetPendingOutput(cinfo);
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -853,6 +1095,18 @@ void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
   CheckState(cinfo, jpegli::kEncStart);
   cinfo->master->psnr_target = psnr;
   cinfo->master->psnr_tolerance = tolerance;
+  cinfo->master->target_size = 0;
+  cinfo->master->min_distance = min_distance;
+  cinfo->master->max_distance = max_distance;
+}
+
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float tolerance, float min_distance,
+                            float max_distance) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->target_size = target_size;
+  cinfo->master->target_size_tolerance = tolerance;
+  cinfo->master->psnr_target = 0.0f;
   cinfo->master->min_distance = min_distance;
   cinfo->master->max_distance = max_distance;
 }
@@ -923,6 +1177,13 @@ void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value) {
   cinfo->master->use_adaptive_quantization = FROM_JXL_BOOL(value);
 }
 
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
 void jpegli_simple_progression(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   jpegli_set_progressive_level(cinfo, 2);
@@ -936,6 +1197,18 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level) {
   cinfo->master->progressive_level = level;
 }
 
+void jpegli_set_effort(j_compress_ptr cinfo, int effort) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (effort < 1 || effort > 5) {
+    JPEGLI_ERROR("Invalid effort %d", effort);
+  }
+  // Efforts 1 and 2 write the entropy coded data while the scanlines are read
+  // with the standard Huffman codes, without storing the coefficients.
+  cinfo->master->use_adaptive_quantization = effort >= 2;
+  cinfo->optimize_coding = TO_JXL_BOOL(effort >= 3);
+  cinfo->master->progressive_level = std::max(0, effort - 3);
+}
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -1037,6 +1310,93 @@ void jpegli_write_coefficients(j_compress_ptr cinfo,
   cinfo->master->next_input_row = cinfo->image_height;
 }
 
+size_t jpegli_output_size_bound(j_compress_ptr cinfo) {
+  if (cinfo->global_state != jpegli::kEncHeader &&
+      cinfo->global_state != jpegli::kEncReadImage &&
+      cinfo->global_state != jpegli::kEncWriteCoeffs) {
+    JPEGLI_ERROR("jpegli_output_size_bound: unexpected state %d",
+                 cinfo->global_state);
+  }
+  // Longest Huffman code and number of extra bits of a DC difference, an AC
+  // coefficient and an end-of-band run.
+  constexpr size_t kMaxCodeBits = 16;
+  constexpr size_t kMaxDCExtraBits = 11;
+  constexpr size_t kMaxACExtraBits = 11;
+  constexpr size_t kMaxEOBRunExtraBits = 14;
+  constexpr size_t kMaxHuffmanTableBytes = 1 + 16 + 256;
+  // SOI, APP0, APP14, DQT, SOF, DRI and EOI markers.
+  size_t bound = 2 + 18 + 16 + 4 + NUM_QUANT_TBLS * (1 + 2 * DCTSIZE2) + 10 +
+                 3 * cinfo->num_components + 6 + 2;
+  const size_t iMCU_cols =
+      jpegli::DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
+  // Upper bounds of the number of entropy coded bits, and of how many of them
+  // can be one bits, over all scans.
+  uint64_t num_bits = 0;
+  uint64_t num_one_bits = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    // SOS, DRI and DHT markers.
+    bound += 6 + 2 * si.comps_in_scan + 3 + 6 + 4;
+    bound += 2 * si.comps_in_scan * kMaxHuffmanTableBytes;
+    // The all-ones code is not allowed, so every Huffman code has a zero bit.
+    size_t bits_per_block = 0;
+    size_t one_bits_per_block = 0;
+    if (si.Ss == 0) {
+      size_t bits = si.Ah == 0 ? kMaxCodeBits + kMaxDCExtraBits - si.Al : 1;
+      bits_per_block += bits;
+      one_bits_per_block += si.Ah == 0 ? bits - 1 : bits;
+    }
+    if (si.Se > 0) {
+      size_t num_coeffs = si.Se - std::max(si.Ss, 1) + 1;
+      // A refinement scan codes one correction bit for every coefficient that
+      // is already nonzero. A coefficient that first becomes nonzero in a
+      // refinement scan costs a Huffman code and a sign bit there, which is at
+      // most what its first scan would have cost if it was nonzero there, so
+      // that cost is counted in its first scan instead.
+      size_t bits_per_coeff =
+          si.Ah == 0 ? kMaxCodeBits + kMaxACExtraBits - si.Al : 1;
+      size_t one_bits_per_coeff =
+          si.Ah == 0 ? bits_per_coeff - 1 : bits_per_coeff;
+      size_t eob_bits = kMaxCodeBits + kMaxEOBRunExtraBits;
+      bits_per_block += num_coeffs * bits_per_coeff + eob_bits;
+      one_bits_per_block += num_coeffs * one_bits_per_coeff + eob_bits - 1;
+    }
+    size_t num_blocks = 0;
+    size_t num_MCUs;
+    size_t MCUs_per_row;
+    if (si.comps_in_scan == 1) {
+      const jpeg_component_info* comp =
+          &cinfo->comp_info[si.component_index[0]];
+      num_blocks = comp->width_in_blocks * comp->height_in_blocks;
+      num_MCUs = num_blocks;
+      MCUs_per_row = comp->width_in_blocks;
+    } else {
+      for (int j = 0; j < si.comps_in_scan; ++j) {
+        const jpeg_component_info* comp =
+            &cinfo->comp_info[si.component_index[j]];
+        num_blocks += comp->h_samp_factor * comp->v_samp_factor;
+      }
+      num_MCUs = iMCU_cols * cinfo->total_iMCU_rows;
+      num_blocks *= num_MCUs;
+      MCUs_per_row = iMCU_cols;
+    }
+    size_t restart_interval =
+        cinfo->restart_in_rows <= 0
+            ? cinfo->restart_interval
+            : std::min<size_t>(MCUs_per_row * cinfo->restart_in_rows, 65535u);
+    size_t num_intervals =
+        restart_interval > 0 ? jpegli::DivCeil(num_MCUs, restart_interval) : 1;
+    num_bits += static_cast<uint64_t>(num_blocks) * bits_per_block;
+    num_one_bits += static_cast<uint64_t>(num_blocks) * one_bits_per_block;
+    // Each restart interval ends with up to one byte of padding bits, which
+    // may need a stuffed zero byte, and an RST marker.
+    bound += 4 * num_intervals;
+  }
+  // Only bytes with eight one bits are followed by a stuffed zero byte.
+  bound += static_cast<size_t>(jpegli::DivCeil(num_bits + num_one_bits, 8));
+  return bound;
+}
+
 void jpegli_write_tables(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   if (cinfo->dest == nullptr) {
@@ -1044,6 +1404,7 @@ void jpegli_write_tables(j_compress_ptr cinfo) {
   }
   jpeg_comp_master* m = cinfo->master;
   (*cinfo->err->reset_error_mgr)(reinterpret_cast<j_common_ptr>(cinfo));
+  jpegli::ResetPendingOutput(cinfo);
   (*cinfo->dest->init_destination)(cinfo);
   jpegli::WriteOutput(cinfo, {0xFF, 0xD8});  // SOI
   jpegli::EncodeDQT(cinfo, /*write_all_tables=*/true);
@@ -1220,13 +1581,21 @@ JDIMENSION jpegli_write_raw_data(j_compress_ptr cinfo, JSAMPIMAGE data,
 // Non-streaming part
 //
 
-void jpegli_finish_compress(j_compress_ptr cinfo) {
+namespace jpegli {
+namespace {
+
+// Tokenizes the image and computes the final Huffman codes, unless this was
+// already done by jpegli_estimate_output_size().
+void PrepareEntropyCoding(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
   jpeg_comp_master* m = cinfo->master;
   if (cinfo->next_scanline < cinfo->image_height) {
     JPEGLI_ERROR("Incomplete image, expected %d rows, got %d",
                  cinfo->image_height, cinfo->next_scanline);
   }
+  if (m->entropy_coding_ready) {
+    return;
+  }
 
   if (cinfo->global_state == jpegli::kEncWriteCoeffs) {
     // Zig-zag shuffle all the blocks. For non-transcoding case it was already
@@ -1236,13 +1605,11 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
 
   if (m->psnr_target > 0) {
     jpegli::QuantizetoPSNR(cinfo);
+  } else if (m->target_size > 0) {
+    jpegli::QuantizeToTargetSize(cinfo);
   }
 
-  const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
-  const bool bitstream_done =
-      tokens_done && !FROM_JXL_BOOL(cinfo->optimize_coding);
-
-  if (!tokens_done) {
+  if (!jpegli::IsStreamingSupported(cinfo) && m->scan_spools == nullptr) {
     jpegli::TokenizeJpeg(cinfo);
   }
 
@@ -1250,6 +1617,15 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
     jpegli::OptimizeHuffmanCodes(cinfo);
     jpegli::InitEntropyCoder(cinfo);
   }
+  m->entropy_coding_ready = true;
+}
+
+// Writes the whole output, except the call to term_destination().
+void WriteCompressedImage(j_compress_ptr cinfo) {
+  PrepareEntropyCoding(cinfo);
+  jpeg_comp_master* m = cinfo->master;
+  const bool bitstream_done = jpegli::IsStreamingSupported(cinfo) &&
+                              !FROM_JXL_BOOL(cinfo->optimize_coding);
 
   if (!bitstream_done) {
     jpegli::WriteFrameHeader(cinfo);
@@ -1265,12 +1641,48 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
   }
 
   jpegli::WriteOutput(cinfo, {0xFF, 0xD9});  // EOI
+}
+
+}  // namespace
+}  // namespace jpegli
+
+void jpegli_finish_compress(j_compress_ptr cinfo) {
+  jpegli::WriteCompressedImage(cinfo);
   (*cinfo->dest->term_destination)(cinfo);
 
   // Release memory and reset global state.
   jpegli_abort_compress(cinfo);
 }
 
+boolean jpegli_finish_compress_suspending(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kEncFlushOutput) {
+    m->output_suspension = true;
+    jpegli::WriteCompressedImage(cinfo);
+    m->output_suspension = false;
+    cinfo->global_state = jpegli::kEncFlushOutput;
+  }
+  if (!jpegli::FlushPendingOutput(cinfo)) {
+    return FALSE;
+  }
+  (*cinfo->dest->term_destination)(cinfo);
+
+  // Release memory and reset global state.
+  jpegli_abort_compress(cinfo);
+  return TRUE;
+}
+
+size_t jpegli_estimate_output_size(j_compress_ptr cinfo) {
+  CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
+  if (jpegli::IsStreamingSupported(cinfo) && !cinfo->optimize_coding) {
+    JPEGLI_ERROR(
+        "jpegli_estimate_output_size: not supported for single-scan images "
+        "without optimize_coding");
+  }
+  jpegli::PrepareEntropyCoding(cinfo);
+  return jpegli::EstimateTokenizedOutputSize(cinfo);
+}
+
 void jpegli_abort_compress(j_compress_ptr cinfo) {
   jpegli_abort(reinterpret_cast<j_common_ptr>(cinfo));
 }
@@ -1278,3 +1690,98 @@ void jpegli_abort_compress(j_compress_ptr cinfo) {
 void jpegli_destroy_compress(j_compress_ptr cinfo) {
   jpegli_destroy(reinterpret_cast<j_common_ptr>(cinfo));
 }
+
+namespace jpegli {
+namespace {
+
+// Compressor object of one thread of jpegli_encode_batch(), with an error
+// handler that long-jumps back to the image that is being encoded. The setup
+// cache outlives the compressor object, which is recreated after an error.
+struct BatchEncoder {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  jmp_buf env;
+  bool initialized = false;
+  SetupCache setup_cache;
+};
+
+void BatchErrorExit(j_common_ptr cinfo) {
+  BatchEncoder* enc = reinterpret_cast<BatchEncoder*>(cinfo->client_data);
+  jpegli_destroy(cinfo);
+  enc->initialized = false;
+  longjmp(enc->env, 1);
+}
+
+void BatchSilentMessage(j_common_ptr cinfo) {}
+
+// Memory that is kept by the batch compressor objects between images.
+constexpr size_t kBatchRetainedImageMemory = 64 << 20;
+
+void EncodeBatchImage(BatchEncoder* enc, jpegli_batch_image* image,
+                      jpegli_batch_setup_func setup, void* setup_opaque) {
+  j_compress_ptr cinfo = &enc->cinfo;
+  image->success = FALSE;
+  if (setjmp(enc->env)) {
+    return;
+  }
+  if (!enc->initialized) {
+    cinfo->err = jpegli_std_error(&enc->jerr);
+    enc->jerr.error_exit = BatchErrorExit;
+    enc->jerr.output_message = BatchSilentMessage;
+    cinfo->client_data = enc;
+    jpegli_create_compress(cinfo);
+    enc->initialized = true;
+    cinfo->master->setup_cache = &enc->setup_cache;
+    jpegli_set_retained_image_memory(reinterpret_cast<j_common_ptr>(cinfo),
+                                     kBatchRetainedImageMemory);
+    (*setup)(cinfo, setup_opaque);
+  }
+  cinfo->image_width = image->width;
+  cinfo->image_height = image->height;
+  jpegli_mem_dest(cinfo, &image->outbuffer, &image->outsize);
+  jpegli_start_compress(cinfo, TRUE);
+  constexpr size_t kRowsPerCall = 16;
+  JSAMPROW rows[kRowsPerCall];
+  while (cinfo->next_scanline < cinfo->image_height) {
+    size_t y0 = cinfo->next_scanline;
+    size_t num_rows = std::min(kRowsPerCall, cinfo->image_height - y0);
+    for (size_t i = 0; i < num_rows; ++i) {
+      rows[i] = const_cast<JSAMPROW>(image->pixels + (y0 + i) * image->stride);
+    }
+    jpegli_write_scanlines(cinfo, rows, num_rows);
+  }
+  jpegli_finish_compress(cinfo);
+  image->success = TRUE;
+}
+
+}  // namespace
+}  // namespace jpegli
+
+boolean jpegli_encode_batch(jpegli_batch_image* images, size_t num_images,
+                            jpegli_batch_setup_func setup, void* setup_opaque,
+                            JxlParallelRunner runner, void* runner_opaque) {
+  for (size_t i = 0; i < num_images; ++i) {
+    images[i].success = FALSE;
+  }
+  std::vector<jpegli::BatchEncoder> encoders;
+  const auto init = [&](size_t num_threads) {
+    encoders = std::vector<jpegli::BatchEncoder>(num_threads);
+    return true;
+  };
+  const auto encode = [&](uint32_t i, size_t thread) {
+    jpegli::EncodeBatchImage(&encoders[thread], &images[i], setup,
+                             setup_opaque);
+    return true;
+  };
+  jxl::ThreadPool pool(runner, runner_opaque);
+  bool ok = pool.Run(0, num_images, init, encode, "jpegli_encode_batch");
+  for (jpegli::BatchEncoder& enc : encoders) {
+    if (enc.initialized) {
+      jpegli_destroy_compress(&enc.cinfo);
+    }
+  }
+  for (size_t i = 0; i < num_images; ++i) {
+    ok = ok && images[i].success;
+  }
+  return TO_JXL_BOOL(ok);
+}
@@ -24,6 +24,7 @@
 #include <cstddef>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -126,6 +127,19 @@ float jpegli_quality_to_distance(int quality);
 void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
                      float min_distance, float max_distance);
 
+// Enables distance parameter search to make the output approximately
+// target_size bytes. The search looks for the smallest distance whose
+// estimated size is at most target_size, and stops early if the estimate is
+// at least (1 - tolerance) * target_size bytes. The size is estimated from
+// the symbol histograms of the requantized coefficients, so the image is
+// compressed only once, but the written output is not checked against the
+// target and may be slightly larger than the estimate. The estimate includes
+// the markers that were written before jpegli_finish_compress(), and uses the
+// same size model as jpegli_estimate_output_size().
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float tolerance, float min_distance,
+                            float max_distance);
+
 // Changes the default behaviour of the encoder in the selection of quantization
 // matrices and chroma subsampling. Must be called before jpegli_set_defaults()
 // because some default setting depend on the XYB mode.
@@ -149,6 +163,21 @@ void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value);
 // greater level value means more progression steps. Default is 2.
 void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 
+// Sets the adaptive quantization, progressive level and optimize_coding
+// settings to one of the presets below. This is only a shorthand for setting
+// these three directly: it overwrites any earlier choice for them, and any
+// later call to jpegli_enable_adaptive_quantization(),
+// jpegli_set_progressive_level() or change of optimize_coding overrides the
+// preset. It must be called after jpegli_set_defaults(). Lower efforts are
+// expected to be faster and less dense:
+//   1: sequential, standard Huffman codes, no adaptive quantization
+//   2: sequential, standard Huffman codes
+//   3: sequential, optimized Huffman codes
+//   4: progressive level 1
+//   5: progressive level 2, same as the defaults
+// Efforts 1 and 2 encode in a single pass over the input.
+void jpegli_set_effort(j_compress_ptr cinfo, int effort);
+
 // If this function is called before starting compression, the quality and
 // linear quality parameters will be used to scale the standard quantization
 // tables from Annex K of the JPEG standard. By default jpegli uses a different
@@ -156,6 +185,99 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 // AC coefficients. Must be called before jpegli_set_defaults().
 void jpegli_use_standard_quant_tables(j_compress_ptr cinfo);
 
+// Sets the parallel runner that is used for downsampling and, when the encoder
+// does not write the entropy coded data while the image is read (e.g. in
+// progressive mode), for computing the DCT coefficients and tokenizing the
+// scans. A nullptr runner means single-threaded encoding, which is the
+// default. The output does not depend on the runner.
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
+// Called by the destination manager of jpegli_chunk_dest() when it needs more
+// output space, after the previous chunk, if any, was filled completely. It
+// must set *chunk and *chunk_size to a non-empty buffer owned by the
+// application, which must stay valid until the compression is finished, or
+// return FALSE to suspend the output.
+typedef boolean (*jpegli_chunk_request_func)(void* opaque,
+                                             unsigned char** chunk,
+                                             size_t* chunk_size);
+
+// Sets up a destination manager that writes the compressed image directly into
+// chunks of memory provided by the application, e.g. from a pool of buffers or
+// a single buffer of jpegli_output_size_bound() bytes, so that the output is
+// never reallocated or copied. When the compression is finished, *total_size
+// is set to the size of the output; all but the last chunk are full.
+void jpegli_chunk_dest(j_compress_ptr cinfo, jpegli_chunk_request_func request,
+                       void* opaque, size_t* total_size);
+
+// Returns an upper bound of the size of the compressed image, based on the
+// image dimensions, the component sampling factors, the scan script and the
+// restart interval. It must be called after jpegli_start_compress() or
+// jpegli_write_coefficients(). It does not include the markers written with
+// jpegli_write_marker() or jpegli_write_icc_profile(). Since it holds for
+// every input, it is several times the size of typical outputs, even for noise
+// at the highest quality.
+size_t jpegli_output_size_bound(j_compress_ptr cinfo);
+
+// Returns the estimated size of the complete output, including the markers
+// that were already written. Can be called after all image data was passed to
+// the encoder and before jpegli_finish_compress(). The image is tokenized and
+// the Huffman codes are computed, but no entropy coded data is written, so the
+// estimate is cheap compared to writing the output. Not supported for
+// single-scan images without optimize_coding, whose entropy coded data is
+// written while the scanlines are read. The tokens and Huffman codes computed
+// here are final and are reused by jpegli_finish_compress(), so this function
+// cannot be used to compare the sizes of alternative quantization tables or
+// scan scripts on the same compressor object.
+size_t jpegli_estimate_output_size(j_compress_ptr cinfo);
+
+// Same as jpegli_finish_compress(), but it also works with a suspending data
+// destination. If the empty_output_buffer() method of the destination returns
+// FALSE, the rest of the compressed image is kept in memory and this function
+// returns FALSE; it must then be called again when the destination can accept
+// more output. Returns TRUE after all of the output was written, at which
+// point the compressor object is reset as by jpegli_finish_compress().
+// Only this function can suspend: the destination must still accept all of the
+// output of jpegli_start_compress() and jpegli_write_scanlines(), i.e. the
+// headers and, for single-scan images without optimize_coding, the entropy
+// coded data written while the scanlines are read, without suspending.
+boolean jpegli_finish_compress_suspending(j_compress_ptr cinfo);
+
+// Description of one image of a batch encoded by jpegli_encode_batch(). The
+// pixels are given as height rows of width * input_components samples, with
+// stride bytes between the starts of consecutive rows. The outbuffer and
+// outsize fields have the same meaning as the arguments of jpegli_mem_dest(),
+// the caller must free the output buffer regardless of the value of success.
+typedef struct {
+  const JSAMPLE* pixels;
+  size_t stride;
+  JDIMENSION width;
+  JDIMENSION height;
+  unsigned char* outbuffer;
+  unsigned long outsize;  // NOLINT
+  boolean success;
+} jpegli_batch_image;
+
+// Sets up the input format and compression parameters of a newly created
+// compressor object used by jpegli_encode_batch(), e.g. by setting
+// input_components and in_color_space and calling jpegli_set_defaults().
+typedef void (*jpegli_batch_setup_func)(j_compress_ptr cinfo, void* opaque);
+
+// Encodes num_images images with the same parameters to memory buffers. One
+// compressor object is created and set up for each thread of the parallel
+// runner, and it is reused for all images encoded on that thread, keeping its
+// image memory. The quantization multipliers, zero-bias tables, color
+// transform and downsampling methods and fixed Huffman code tables are
+// computed for the first image of each thread and reused for the following
+// images with the same compression parameters, only the buffers that depend
+// on the image dimensions are set up for every image. A nullptr runner means
+// single-threaded encoding.
+// Errors are reported through the success field of the failed images. Returns
+// TRUE if all images were encoded successfully.
+boolean jpegli_encode_batch(jpegli_batch_image* images, size_t num_images,
+                            jpegli_batch_setup_func setup, void* setup_opaque,
+                            JxlParallelRunner runner, void* runner_opaque);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
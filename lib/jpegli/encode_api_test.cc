@@ -10,11 +10,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 #include <ostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
@@ -152,6 +156,154 @@ TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
   if (buffer) free(buffer);
 }
 
+TEST(EncodeAPITest, ReuseCinfoRetainedImageMemory) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  // Encode each image twice so that the second one can use only the retained
+  // image memory.
+  std::vector<TestConfig> configs;
+  for (const TestConfig& config : all_configs) {
+    configs.push_back(config);
+    configs.push_back(config);
+  }
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  std::vector<std::vector<uint8_t>> outputs;
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    jpegli_set_retained_image_memory(reinterpret_cast<j_common_ptr>(&cinfo),
+                                     1 << 30);
+    for (const TestConfig& config : configs) {
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      outputs.emplace_back(buffer, buffer + buffer_size);
+    }
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  if (buffer) free(buffer);
+  ASSERT_EQ(configs.size(), outputs.size());
+  for (size_t i = 0; i < configs.size(); ++i) {
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(
+        EncodeWithJpegli(configs[i].input, configs[i].jparams, &expected));
+    EXPECT_EQ(expected, outputs[i]);
+  }
+}
+
+// Memory block allocator that counts the allocated blocks and bytes.
+struct CountingAllocator {
+  size_t num_allocs = 0;
+  size_t num_frees = 0;
+  size_t allocated_bytes = 0;
+  std::map<void*, size_t> blocks;
+
+  static void* Alloc(void* opaque, size_t size) {
+    auto* self = reinterpret_cast<CountingAllocator*>(opaque);
+    void* p = malloc(size);
+    ++self->num_allocs;
+    self->allocated_bytes += size;
+    self->blocks[p] = size;
+    return p;
+  }
+  static void Free(void* opaque, void* address) {
+    auto* self = reinterpret_cast<CountingAllocator*>(opaque);
+    ++self->num_frees;
+    self->allocated_bytes -= self->blocks[address];
+    self->blocks.erase(address);
+    free(address);
+  }
+};
+
+// Number of calls to the alloc_small method of the memory manager.
+size_t num_alloc_calls = 0;
+void* (*default_alloc_small)(j_common_ptr, int, size_t) = nullptr;
+
+void* CountingAllocSmall(j_common_ptr cinfo, int pool_id, size_t size) {
+  ++num_alloc_calls;
+  return (*default_alloc_small)(cinfo, pool_id, size);
+}
+
+TEST(EncodeAPITest, MemoryBlocksCarvedAndRetained) {
+  const TestConfig config = GenerateBasicConfigs()[0];
+  CountingAllocator allocator;
+  size_t num_calls[2];
+  size_t num_blocks[2];
+  size_t retained_bytes = 0;
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+    jpegli_set_memory_block_allocator(comptr, CountingAllocator::Alloc,
+                                      CountingAllocator::Free, &allocator);
+    jpegli_set_retained_image_memory(comptr, 1 << 30);
+    default_alloc_small = cinfo.mem->alloc_small;
+    cinfo.mem->alloc_small = CountingAllocSmall;
+    for (size_t i = 0; i < 2; ++i) {
+      num_alloc_calls = 0;
+      size_t num_allocs = allocator.num_allocs;
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      num_calls[i] = num_alloc_calls;
+      num_blocks[i] = allocator.num_allocs - num_allocs;
+      if (i == 0) retained_bytes = allocator.allocated_bytes;
+    }
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  if (buffer) free(buffer);
+  // Most objects of the first image are carved from slabs.
+  EXPECT_GT(num_calls[0], 0u);
+  EXPECT_LT(num_blocks[0], num_calls[0]);
+  // The image memory of the first image is kept, so that the second one needs
+  // fewer new memory blocks.
+  EXPECT_GT(retained_bytes, 0u);
+  EXPECT_GT(num_calls[1], 0u);
+  EXPECT_LT(num_blocks[1], num_blocks[0]);
+  // Every block is freed with the allocator that allocated it.
+  EXPECT_EQ(allocator.num_frees, allocator.num_allocs);
+  EXPECT_EQ(allocator.allocated_bytes, 0u);
+}
+
+TEST(EncodeAPITest, ProgressiveMemoryBudget) {
+  TestImage input;
+  input.xsize = 1024;
+  input.ysize = 1024;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.progressive_mode = 2;
+  jparams.quality = 75;
+  // The quantized coefficients of the luma component alone take 2 MB, but the
+  // scans are tokenized while the image is read, so only one iMCU row of
+  // coefficients is kept.
+  const long kMemoryBudget = 5 << 19;
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &expected));
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    cinfo.mem->max_memory_to_use = kMemoryBudget;
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(input, jparams, &cinfo);
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  std::vector<uint8_t> compressed;
+  if (buffer) compressed.assign(buffer, buffer + buffer_size);
+  free(buffer);
+  EXPECT_EQ(expected, compressed);
+}
+
 TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
@@ -185,6 +337,436 @@ TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   }
 }
 
+// Runs the tasks on the calling thread, but in reverse order and with
+// changing thread ids, to test that the output does not depend on the order
+// of the tasks.
+JxlParallelRetCode ReverseOrderRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range,
+                                      uint32_t end_range) {
+  constexpr size_t kNumThreads = 3;
+  JxlParallelRetCode ret = (*init)(jpegxl_opaque, kNumThreads);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+  for (uint32_t i = end_range; i > start_range; --i) {
+    (*func)(jpegxl_opaque, i - 1, i % kNumThreads);
+  }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
+TEST(EncodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig config : GenerateBasicConfigs()) {
+    // Restart markers in the scans that are tokenized in parallel, which are
+    // the sequential scans and the first scans of progressive images.
+    config.jparams.restart_interval = 7;
+    all_configs.push_back(config);
+    config.jparams.restart_interval = 0;
+    config.jparams.restart_in_rows = 2;
+    all_configs.push_back(config);
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed[2];
+    for (int use_runner : {0, 1}) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        if (use_runner) {
+          jpegli_set_parallel_runner(&cinfo, ReverseOrderRunner, nullptr);
+        }
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      compressed[use_runner].assign(buffer, buffer + buffer_size);
+      if (buffer) free(buffer);
+    }
+    EXPECT_EQ(compressed[0], compressed[1]);
+  }
+}
+
+// Hands out chunks of increasing sizes from a vector of buffers.
+boolean RequestChunk(void* opaque, unsigned char** chunk, size_t* chunk_size) {
+  auto* chunks = reinterpret_cast<std::vector<std::vector<uint8_t>>*>(opaque);
+  chunks->emplace_back(1000 + 37 * chunks->size());
+  *chunk = chunks->back().data();
+  *chunk_size = chunks->back().size();
+  return TRUE;
+}
+
+TEST(EncodeAPITest, ChunkDestSameOutput) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    std::vector<std::vector<uint8_t>> chunks;
+    size_t total_size = 0;
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_chunk_dest(&cinfo, RequestChunk, &chunks, &total_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    std::vector<uint8_t> output;
+    for (const auto& chunk : chunks) {
+      output.insert(output.end(), chunk.begin(), chunk.end());
+    }
+    ASSERT_LE(total_size, output.size());
+    output.resize(total_size);
+    EXPECT_EQ(compressed, output);
+  }
+}
+
+TEST(EncodeAPITest, OutputSizeBound) {
+  for (int progressive_level : {0, 2}) {
+    for (unsigned int restart_interval : {0u, 1u}) {
+      TestImage input;
+      input.xsize = 129;
+      input.ysize = 75;
+      // Uniform noise is the least compressible input.
+      std::minstd_rand rng(progressive_level + restart_interval + 1);
+      std::uniform_int_distribution<int> dist(0, 255);
+      input.pixels.resize(input.xsize * input.ysize * input.components);
+      for (uint8_t& v : input.pixels) v = dist(rng);
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      size_t bound = 0;
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        cinfo.image_width = input.xsize;
+        cinfo.image_height = input.ysize;
+        cinfo.input_components = input.components;
+        cinfo.in_color_space = JCS_RGB;
+        jpegli_set_defaults(&cinfo);
+        jpegli_set_quality(&cinfo, 100, TRUE);
+        jpegli_set_progressive_level(&cinfo, progressive_level);
+        cinfo.restart_interval = restart_interval;
+        jpegli_start_compress(&cinfo, TRUE);
+        bound = jpegli_output_size_bound(&cinfo);
+        size_t stride = cinfo.image_width * cinfo.input_components;
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row = &input.pixels[cinfo.next_scanline * stride];
+          jpegli_write_scanlines(&cinfo, &row, 1);
+        }
+        jpegli_finish_compress(&cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      EXPECT_LE(buffer_size, bound);
+      // The bound is 5.5 to 8.5 times the size of the noise image, for both
+      // the sequential and the progressive scan scripts.
+      EXPECT_LE(bound, 9 * buffer_size);
+      if (buffer) free(buffer);
+    }
+  }
+}
+
+TEST(EncodeAPITest, EstimateOutputSize) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    if (!config.jparams.progressive_mode && !config.jparams.optimize_coding) {
+      continue;
+    }
+    const TestImage& input = config.input;
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    size_t estimate = 0;
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = input.xsize;
+      cinfo.image_height = input.ysize;
+      cinfo.input_components = input.components;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      jpegli_set_progressive_level(&cinfo, config.jparams.progressive_mode);
+      cinfo.optimize_coding = config.jparams.optimize_coding;
+      jpegli_start_compress(&cinfo, TRUE);
+      size_t stride = cinfo.image_width * cinfo.input_components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row =
+            const_cast<JSAMPROW>(&input.pixels[cinfo.next_scanline * stride]);
+        jpegli_write_scanlines(&cinfo, &row, 1);
+      }
+      estimate = jpegli_estimate_output_size(&cinfo);
+      jpegli_finish_compress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    EXPECT_NEAR(estimate, buffer_size, buffer_size / 50);
+    if (buffer) free(buffer);
+  }
+}
+
+TEST(EncodeAPITest, HuffmanTableSlots) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  CompressParams jparams;
+  // Use the test scan script with the most AC scans, so that there are more
+  // AC Huffman codes than slots.
+  jparams.progressive_mode = 3 + NumTestScanScripts() - 1;
+  GenerateInput(COEFFICIENTS, jparams, &input);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  // Collect the slots of the AC Huffman tables in the order of their DHT
+  // markers, skipping over the entropy coded segments.
+  std::vector<size_t> ac_slots;
+  size_t pos = 2;
+  while (pos + 4 <= compressed.size()) {
+    ASSERT_EQ(0xff, compressed[pos]);
+    uint8_t marker = compressed[pos + 1];
+    if (marker == 0xd9) break;
+    size_t end = pos + 2 + (compressed[pos + 2] << 8) + compressed[pos + 3];
+    ASSERT_LE(end, compressed.size());
+    for (size_t i = pos + 4; marker == 0xc4 && i < end;) {
+      size_t num_symbols = 0;
+      for (size_t j = 1; j <= 16; ++j) num_symbols += compressed[i + j];
+      if (compressed[i] >> 4) ac_slots.push_back(compressed[i] & 0xf);
+      i += 17 + num_symbols;
+    }
+    pos = end;
+    while (marker == 0xda && pos + 1 < compressed.size() &&
+           (compressed[pos] != 0xff || compressed[pos + 1] == 0 ||
+            (compressed[pos + 1] & 0xf8) == 0xd0)) {
+      ++pos;
+    }
+  }
+  // Once all four slots are in use, the slots are replaced in round-robin
+  // order.
+  ASSERT_GT(ac_slots.size(), 4u);
+  for (size_t i = 0; i < ac_slots.size(); ++i) {
+    EXPECT_EQ(i % 4, ac_slots[i]);
+  }
+  // The coefficients do not depend on the SIMD target, so the size of the
+  // output is the same everywhere.
+  EXPECT_EQ(10541u, compressed.size());
+}
+
+TEST(EncodeAPITest, TargetSize) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    for (size_t target_size : {8000u, 16000u}) {
+      const TestImage& input = config.input;
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        cinfo.image_width = input.xsize;
+        cinfo.image_height = input.ysize;
+        cinfo.input_components = input.components;
+        cinfo.in_color_space = JCS_RGB;
+        jpegli_set_defaults(&cinfo);
+        jpegli_set_progressive_level(&cinfo,
+                                     config.jparams.progressive_mode);
+        cinfo.optimize_coding = config.jparams.optimize_coding;
+        jpegli_set_target_size(&cinfo, target_size, 0.05f, 0.1f, 25.0f);
+        jpegli_start_compress(&cinfo, TRUE);
+        size_t stride = cinfo.image_width * cinfo.input_components;
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row = const_cast<JSAMPROW>(
+              &input.pixels[cinfo.next_scanline * stride]);
+          jpegli_write_scanlines(&cinfo, &row, 1);
+        }
+        jpegli_finish_compress(&cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      // The output size is estimated, so it can slightly exceed the target.
+      EXPECT_LE(buffer_size, target_size * 1.1);
+      EXPECT_GE(buffer_size, target_size * 0.75);
+      if (buffer) free(buffer);
+    }
+  }
+}
+
+void SetupBatchEncoder(j_compress_ptr cinfo, void* opaque) {
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;
+  jpegli_set_defaults(cinfo);
+  jpegli_set_quality(cinfo, 85, TRUE);
+  jpegli_set_progressive_level(cinfo, *reinterpret_cast<int*>(opaque));
+}
+
+TEST(EncodeAPITest, BatchEncodeSameOutput) {
+  std::vector<TestImage> inputs;
+  for (size_t xsize : {1, 64, 128, 131}) {
+    for (size_t ysize : {1, 100, 128}) {
+      TestImage input;
+      input.xsize = xsize;
+      input.ysize = ysize;
+      GeneratePixels(&input);
+      inputs.push_back(input);
+    }
+  }
+  for (int progressive_level : {0, 2}) {
+    std::vector<std::vector<uint8_t>> expected(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        SetupBatchEncoder(&cinfo, &progressive_level);
+        cinfo.image_width = inputs[i].xsize;
+        cinfo.image_height = inputs[i].ysize;
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_start_compress(&cinfo, TRUE);
+        size_t stride = inputs[i].xsize * 3;
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row = &inputs[i].pixels[cinfo.next_scanline * stride];
+          jpegli_write_scanlines(&cinfo, &row, 1);
+        }
+        jpegli_finish_compress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      expected[i].assign(buffer, buffer + buffer_size);
+      if (buffer) free(buffer);
+    }
+    for (int use_runner : {0, 1}) {
+      std::vector<jpegli_batch_image> images(inputs.size());
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        images[i].pixels = inputs[i].pixels.data();
+        images[i].stride = inputs[i].xsize * 3;
+        images[i].width = inputs[i].xsize;
+        images[i].height = inputs[i].ysize;
+        images[i].outbuffer = nullptr;
+        images[i].outsize = 0;
+      }
+      EXPECT_TRUE(jpegli_encode_batch(
+          images.data(), images.size(), SetupBatchEncoder, &progressive_level,
+          use_runner ? ReverseOrderRunner : nullptr, nullptr));
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        EXPECT_TRUE(images[i].success);
+        std::vector<uint8_t> compressed(
+            images[i].outbuffer, images[i].outbuffer + images[i].outsize);
+        EXPECT_EQ(expected[i], compressed);
+        free(images[i].outbuffer);
+      }
+    }
+  }
+}
+
+TEST(EncodeAPITest, BatchEncodeInvalidImage) {
+  TestImage input;
+  input.xsize = input.ysize = 64;
+  GeneratePixels(&input);
+  int progressive_level = 0;
+  std::vector<jpegli_batch_image> images(3);
+  for (jpegli_batch_image& image : images) {
+    image.pixels = input.pixels.data();
+    image.stride = input.xsize * 3;
+    image.width = input.xsize;
+    image.height = input.ysize;
+    image.outbuffer = nullptr;
+    image.outsize = 0;
+  }
+  images[1].width = 0;
+  EXPECT_FALSE(jpegli_encode_batch(images.data(), images.size(),
+                                   SetupBatchEncoder, &progressive_level,
+                                   nullptr, nullptr));
+  EXPECT_TRUE(images[0].success);
+  EXPECT_FALSE(images[1].success);
+  EXPECT_TRUE(images[2].success);
+  for (jpegli_batch_image& image : images) {
+    free(image.outbuffer);
+  }
+}
+
+// Compression parameters for the successive setups of a batch compressor
+// object, as quality and luma sampling factor pairs.
+struct BatchSetupSequence {
+  std::vector<std::pair<int, int>> params;
+  size_t num_calls = 0;
+};
+
+void SetupBatchEncoderSequence(j_compress_ptr cinfo, void* opaque) {
+  BatchSetupSequence* seq = reinterpret_cast<BatchSetupSequence*>(opaque);
+  const auto& params =
+      seq->params[std::min(seq->num_calls++, seq->params.size() - 1)];
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;
+  jpegli_set_defaults(cinfo);
+  jpegli_set_quality(cinfo, params.first, TRUE);
+  jpegli_set_progressive_level(cinfo, 0);
+  cinfo->comp_info[0].h_samp_factor = params.second;
+  cinfo->comp_info[0].v_samp_factor = params.second;
+}
+
+TEST(EncodeAPITest, BatchEncodeParamsChangeAfterError) {
+  TestImage input;
+  input.xsize = 131;
+  input.ysize = 100;
+  GeneratePixels(&input);
+  std::vector<jpegli_batch_image> images(5);
+  for (jpegli_batch_image& image : images) {
+    image.pixels = input.pixels.data();
+    image.stride = input.xsize * 3;
+    image.width = input.xsize;
+    image.height = input.ysize;
+  }
+  const auto encode = [&](BatchSetupSequence* seq, size_t num_images) {
+    for (size_t i = 0; i < num_images; ++i) {
+      images[i].outbuffer = nullptr;
+      images[i].outsize = 0;
+    }
+    jpegli_encode_batch(images.data(), num_images, SetupBatchEncoderSequence,
+                        seq, nullptr, nullptr);
+    std::vector<std::vector<uint8_t>> outputs(num_images);
+    for (size_t i = 0; i < num_images; ++i) {
+      outputs[i].assign(images[i].outbuffer,
+                        images[i].outbuffer + images[i].outsize);
+      free(images[i].outbuffer);
+    }
+    return outputs;
+  };
+  // Change either the quantization tables or the sampling factors.
+  for (const auto& params : std::vector<std::vector<std::pair<int, int>>>{
+           {{90, 2}, {50, 2}}, {{90, 2}, {90, 1}}}) {
+    std::vector<std::vector<uint8_t>> expected;
+    for (const auto& p : params) {
+      BatchSetupSequence seq;
+      seq.params = {p};
+      expected.push_back(encode(&seq, 1)[0]);
+    }
+    ASSERT_NE(expected[0], expected[1]);
+    // The compressor object is set up again after the error in the third
+    // image, but it keeps the cached tables of the first two images, which
+    // must not be used for the next image.
+    images[2].width = 0;
+    BatchSetupSequence seq;
+    seq.params = params;
+    std::vector<std::vector<uint8_t>> outputs = encode(&seq, images.size());
+    images[2].width = input.xsize;
+    EXPECT_EQ(2u, seq.num_calls);
+    EXPECT_EQ(expected[0], outputs[0]);
+    EXPECT_EQ(expected[0], outputs[1]);
+    EXPECT_FALSE(images[2].success);
+    EXPECT_EQ(expected[1], outputs[3]);
+    EXPECT_EQ(expected[1], outputs[4]);
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoChangeParams) {
   TestImage input;
   TestImage output;
@@ -254,6 +836,65 @@ TEST(EncodeAPITest, ReuseCinfoChangeParams) {
   if (buffer) free(buffer);
 }
 
+TEST(EncodeAPITest, EffortPresets) {
+  TestImage input;
+  input.xsize = 257;
+  input.ysize = 265;
+  GeneratePixels(&input);
+  const auto encode = [&](int effort, boolean aq, int progressive_level,
+                          boolean optimize_coding) -> std::vector<uint8_t> {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = input.xsize;
+      cinfo.image_height = input.ysize;
+      cinfo.input_components = input.components;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      if (effort > 0) {
+        jpegli_set_effort(&cinfo, effort);
+      } else {
+        jpegli_enable_adaptive_quantization(&cinfo, aq);
+        jpegli_set_progressive_level(&cinfo, progressive_level);
+        cinfo.optimize_coding = optimize_coding;
+      }
+      jpegli_start_compress(&cinfo, TRUE);
+      size_t stride = cinfo.image_width * cinfo.input_components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row =
+            const_cast<JSAMPROW>(&input.pixels[cinfo.next_scanline * stride]);
+        jpegli_write_scanlines(&cinfo, &row, 1);
+      }
+      jpegli_finish_compress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    std::vector<uint8_t> compressed(buffer, buffer + buffer_size);
+    if (buffer) free(buffer);
+    return compressed;
+  };
+  // Every effort is the same as setting the three parameters explicitly.
+  std::vector<std::vector<uint8_t>> outputs(6);
+  for (int effort = 1; effort <= 5; ++effort) {
+    outputs[effort] = encode(effort, FALSE, 0, FALSE);
+    EXPECT_EQ(outputs[effort],
+              encode(0, effort >= 2 ? TRUE : FALSE, std::max(0, effort - 3),
+                     effort >= 3 ? TRUE : FALSE));
+  }
+  // Optimized Huffman codes make the output smaller, and so do the default
+  // progressive scans on top of them. Progressive level 1 can be a little
+  // larger than sequential with optimized codes, so it is only compared with
+  // the fixed codes.
+  EXPECT_LT(outputs[3].size(), outputs[2].size());
+  EXPECT_LT(outputs[4].size(), outputs[2].size());
+  EXPECT_LT(outputs[5].size(), outputs[3].size());
+}
+
 TEST(EncodeAPITest, AbbreviatedStreams) {
   uint8_t* table_stream = nullptr;
   unsigned long table_stream_size = 0;  // NOLINT
@@ -379,6 +1020,25 @@ std::vector<TestConfig> GenerateTests() {
       }
     }
   }
+  for (int effort = 1; effort <= 5; ++effort) {
+    TestConfig config;
+    config.jparams.h_sampling = {1, 1, 1};
+    config.jparams.v_sampling = {1, 1, 1};
+    config.jparams.effort = effort;
+    // Efforts 1, 2, 3 and 5 produce the same output as the P0FixedCodeNoAQ,
+    // P0FixedCode, P0OptimizedCode and P2 1x1 configs (see EffortPresets), so
+    // they have the same limits. Effort 4 is denser than effort 2, so it has
+    // the limits of effort 2.
+    const float kMaxBpp[5] = {2.05, 1.55, 1.55 * 0.97, 1.55, 1.55 * 0.97};
+    const float kMaxDist[5] = {2.3, 1.95, 1.95, 1.95, 1.95};
+    if (effort == 1) {
+      config.input.xsize = 257;
+      config.input.ysize = 265;
+    }
+    config.max_bpp = kMaxBpp[effort - 1];
+    config.max_dist = kMaxDist[effort - 1];
+    all_tests.push_back(config);
+  }
   {
     TestConfig config;
     config.jparams.quality = 100;
@@ -11,10 +11,18 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <utility>
+#include <vector>
 
+#include "lib/base/bits.h"
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
+#include "lib/jpegli/huffman.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/quant.h"
 
@@ -90,50 +98,82 @@ void ComputeInverseWeights(const float* qmc, float* iqmc) {
   }
 }
 
-float ComputePSNR(j_compress_ptr cinfo, int sampling) {
+// Returns the squared error of every sampling-th block of the given block row
+// of component c at the current quantization settings.
+double BlockRowError(j_compress_ptr cinfo, int c, size_t by,
+                     const JBLOCKROW row, int sampling) {
   jpeg_comp_master* m = cinfo->master;
-  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  jpeg_component_info* comp = &cinfo->comp_info[c];
+  const float* qmc = m->quant_mul[c];
+  const int h_factor = m->h_factor[c];
+  const float* zero_bias_offset = m->zero_bias_offset[c];
+  const float* zero_bias_mul = m->zero_bias_mul[c];
+  HWY_ALIGN float iqmc[64];
+  ComputeInverseWeights(qmc, iqmc);
+  const float* qf = m->quant_field.Row(by * m->v_factor[c]);
   double error = 0.0;
-  size_t num = 0;
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    jpeg_component_info* comp = &cinfo->comp_info[c];
-    const float* qmc = m->quant_mul[c];
-    const int h_factor = m->h_factor[c];
-    const int v_factor = m->v_factor[c];
-    const float* zero_bias_offset = m->zero_bias_offset[c];
-    const float* zero_bias_mul = m->zero_bias_mul[c];
-    HWY_ALIGN float iqmc[64];
-    ComputeInverseWeights(qmc, iqmc);
-    for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
-      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
-      const float* qf = m->quant_field.Row(by * v_factor);
-      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx += sampling) {
-        error += BlockError(&blocks[0][bx][0], qmc, iqmc, qf[bx * h_factor],
-                            zero_bias_offset, zero_bias_mul);
-        num += DCTSIZE2;
-      }
-    }
+  for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx += sampling) {
+    error += BlockError(&row[bx][0], qmc, iqmc, qf[bx * h_factor],
+                        zero_bias_offset, zero_bias_mul);
   }
-  return 4.3429448f * log(num / (error / 255. / 255.));
+  return error;
 }
 
-void ReQuantizeCoeffs(j_compress_ptr cinfo) {
+void ReQuantizeBlockRow(j_compress_ptr cinfo, int c, size_t by,
+                        JBLOCKROW row) {
   jpeg_comp_master* m = cinfo->master;
-  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    jpeg_component_info* comp = &cinfo->comp_info[c];
-    const float* qmc = m->quant_mul[c];
-    const int h_factor = m->h_factor[c];
-    const int v_factor = m->v_factor[c];
-    const float* zero_bias_offset = m->zero_bias_offset[c];
-    const float* zero_bias_mul = m->zero_bias_mul[c];
-    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-      JBLOCKARRAY block = GetBlockRow(cinfo, c, by);
-      const float* qf = m->quant_field.Row(by * v_factor);
-      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
-        ReQuantizeBlock(&block[0][bx][0], qmc, qf[bx * h_factor],
-                        zero_bias_offset, zero_bias_mul);
+  jpeg_component_info* comp = &cinfo->comp_info[c];
+  const float* qmc = m->quant_mul[c];
+  const int h_factor = m->h_factor[c];
+  const float* zero_bias_offset = m->zero_bias_offset[c];
+  const float* zero_bias_mul = m->zero_bias_mul[c];
+  const float* qf = m->quant_field.Row(by * m->v_factor[c]);
+  for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+    ReQuantizeBlock(&row[bx][0], qmc, qf[bx * h_factor], zero_bias_offset,
+                    zero_bias_mul);
+  }
+}
+
+// Adds the Huffman symbols of the requantized blocks of the given block row of
+// component c to the DC and AC histograms. The blocks are coded as in a
+// sequential scan, with the DC prediction restarted at the beginning of the
+// row.
+void BlockRowHistograms(j_compress_ptr cinfo, int c, size_t by,
+                        const JBLOCKROW row, Histogram* dc_histo,
+                        Histogram* ac_histo) {
+  jpeg_comp_master* m = cinfo->master;
+  jpeg_component_info* comp = &cinfo->comp_info[c];
+  const float* qmc = m->quant_mul[c];
+  const int h_factor = m->h_factor[c];
+  const float* zero_bias_offset = m->zero_bias_offset[c];
+  const float* zero_bias_mul = m->zero_bias_mul[c];
+  const float* qf = m->quant_field.Row(by * m->v_factor[c]);
+  HWY_ALIGN int16_t block[DCTSIZE2];
+  int last_dc = 0;
+  for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+    memcpy(block, &row[bx][0], sizeof(block));
+    ReQuantizeBlock(block, qmc, qf[bx * h_factor], zero_bias_offset,
+                    zero_bias_mul);
+    uint32_t temp = std::abs(block[0] - last_dc);
+    int nbits = temp == 0 ? 0 : jxl::FloorLog2Nonzero(temp) + 1;
+    ++dc_histo->count[nbits];
+    last_dc = block[0];
+    int run = 0;
+    for (int k = 1; k < DCTSIZE2; ++k) {
+      if (block[k] == 0) {
+        ++run;
+        continue;
       }
+      for (; run >= 16; run -= 16) {
+        ++ac_histo->count[0xf0];
+      }
+      temp = std::abs(block[k]);
+      nbits = jxl::FloorLog2Nonzero(temp) + 1;
+      ++ac_histo->count[(run << 4) + nbits];
+      run = 0;
+    }
+    if (run > 0) {
+      ++ac_histo->count[0];
     }
   }
 }
@@ -146,15 +186,83 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 namespace {
-HWY_EXPORT(ComputePSNR);
-HWY_EXPORT(ReQuantizeCoeffs);
+HWY_EXPORT(BlockRowError);
+HWY_EXPORT(ReQuantizeBlockRow);
+HWY_EXPORT(BlockRowHistograms);
+
+// Pointers to the block rows of all components, looked up once on the calling
+// thread, since the virtual array access methods may not be thread-safe.
+struct BlockRows {
+  JBLOCKROW* rows[kMaxComponents];
+};
+
+void GetBlockRows(j_compress_ptr cinfo, BlockRows* block_rows) {
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    block_rows->rows[c] =
+        Allocate<JBLOCKROW>(cinfo, comp->height_in_blocks, JPOOL_IMAGE);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      block_rows->rows[c][by] = GetBlockRow(cinfo, c, by)[0];
+    }
+  }
+}
 
-void ReQuantizeCoeffs(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ReQuantizeCoeffs)(cinfo);
+// Returns the (component, block row) pairs of every sampling-th block row.
+std::vector<std::pair<int, size_t>> SampledRows(j_compress_ptr cinfo,
+                                                int sampling) {
+  std::vector<std::pair<int, size_t>> rows;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
+      rows.emplace_back(c, by);
+    }
+  }
+  return rows;
 }
 
-float ComputePSNR(j_compress_ptr cinfo, int sampling) {
-  return HWY_DYNAMIC_DISPATCH(ComputePSNR)(cinfo, sampling);
+void ReQuantizeCoeffs(j_compress_ptr cinfo, const BlockRows& block_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  const std::vector<std::pair<int, size_t>> rows = SampledRows(cinfo, 1);
+  const auto init = [](size_t num_threads) { return true; };
+  const auto requantize_row = [&](uint32_t task, size_t thread) {
+    int c = rows[task].first;
+    size_t by = rows[task].second;
+    HWY_DYNAMIC_DISPATCH(ReQuantizeBlockRow)
+    (cinfo, c, by, block_rows.rows[c][by]);
+    return true;
+  };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0, rows.size(), init,
+            requantize_row, "ReQuantizeCoeffs");
+}
+
+// The errors of the block rows are computed in parallel, but summed up in a
+// fixed order, so that the result does not depend on the parallel runner.
+float ComputePSNR(j_compress_ptr cinfo, const BlockRows& block_rows,
+                  int sampling) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  const std::vector<std::pair<int, size_t>> rows =
+      SampledRows(cinfo, sampling);
+  std::vector<double> row_errors(rows.size());
+  const auto init = [](size_t num_threads) { return true; };
+  const auto compute_row_error = [&](uint32_t task, size_t thread) {
+    int c = rows[task].first;
+    size_t by = rows[task].second;
+    row_errors[task] = HWY_DYNAMIC_DISPATCH(BlockRowError)(
+        cinfo, c, by, block_rows.rows[c][by], sampling);
+    return true;
+  };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0, rows.size(), init,
+            compute_row_error, "ComputePSNR");
+  double error = 0.0;
+  size_t num = 0;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    const jpeg_component_info* comp = &cinfo->comp_info[rows[i].first];
+    error += row_errors[i];
+    num += DivCeil(comp->width_in_blocks, sampling) * DCTSIZE2;
+  }
+  return 4.3429448f * log(num / (error / 255. / 255.));
 }
 
 void UpdateDistance(j_compress_ptr cinfo, float distance) {
@@ -168,7 +276,13 @@ float Clamp(float val, float minval, float maxval) {
 
 #define PSNR_SEARCH_DBG 0
 
-float FindDistanceForPSNR(j_compress_ptr cinfo) {
+// Each probe requantizes the stored coefficients without writing them back and
+// is much cheaper than an encode, which also does the color conversion, the
+// adaptive quantization, the DCT and the entropy coding. The probes of the
+// first round only look at every 4th block of every 4th block row, i.e. 1/16
+// of the blocks, so the search mostly costs the few full-resolution probes of
+// the second round.
+float FindDistanceForPSNR(j_compress_ptr cinfo, const BlockRows& block_rows) {
   constexpr int kMaxIters = 20;
   const float psnr_target = cinfo->master->psnr_target;
   const float tolerance = cinfo->master->psnr_tolerance;
@@ -185,7 +299,7 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
     bool found_upper_bound = false;
     for (int i = 0; i < kMaxIters; ++i) {
       UpdateDistance(cinfo, d);
-      float psnr = ComputePSNR(cinfo, sampling);
+      float psnr = ComputePSNR(cinfo, block_rows, sampling);
       if (psnr > psnr_target) {
         dmin = d;
         found_lower_bound = true;
@@ -226,12 +340,155 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
   return d;
 }
 
+// Returns the estimated size of the output with the current quantization
+// tables, as if every component was coded in one sequential scan with its own
+// optimal Huffman codes, or with the fixed Huffman codes if the codes are not
+// optimized. Only every sampling-th block row is requantized and its symbol
+// counts are extrapolated.
+float EstimateRequantizedSize(j_compress_ptr cinfo,
+                              const BlockRows& block_rows, int sampling) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  const std::vector<std::pair<int, size_t>> rows =
+      SampledRows(cinfo, sampling);
+  const size_t histo_stride = 2 * kMaxComponents;
+  std::vector<Histogram> histograms;
+  const auto init = [&](size_t num_threads) {
+    histograms.resize(num_threads * histo_stride);
+    return true;
+  };
+  const auto count_symbols = [&](uint32_t task, size_t thread) {
+    int c = rows[task].first;
+    size_t by = rows[task].second;
+    Histogram* dc_histo = &histograms[thread * histo_stride + 2 * c];
+    Histogram* ac_histo = dc_histo + 1;
+    HWY_DYNAMIC_DISPATCH(BlockRowHistograms)(
+        cinfo, c, by, block_rows.rows[c][by], dc_histo, ac_histo);
+    return true;
+  };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0, rows.size(), init,
+            count_symbols, "EstimateRequantizedSize");
+  const size_t num_threads = histograms.size() / histo_stride;
+  std::vector<Histogram> component_histograms(2 * cinfo->num_components);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const size_t num_rows = comp->height_in_blocks;
+    const float scale =
+        static_cast<float>(num_rows) / DivCeil(num_rows, sampling);
+    for (size_t j = 0; j < 2; ++j) {
+      Histogram& histo = component_histograms[2 * c + j];
+      for (size_t t = 0; t < num_threads; ++t) {
+        const Histogram& thread_histo =
+            histograms[t * histo_stride + 2 * c + j];
+        for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+          histo.count[i] += thread_histo.count[i];
+        }
+      }
+      // The sampled counts are extrapolated to the whole component, keeping
+      // every symbol that occurred in the code.
+      for (int& count : histo.count) {
+        count = static_cast<int>(std::ceil(count * scale));
+      }
+    }
+  }
+  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+    return EstimateOutputSize(cinfo, component_histograms.data(),
+                              component_histograms.size(), nullptr, 0);
+  }
+  // With fixed Huffman codes the context map was computed together with the
+  // codes, the DC contexts are the component indexes and the AC contexts
+  // follow in scan order.
+  std::vector<Histogram> code_histograms(m->num_huffman_tables);
+  const auto add_histogram = [&](size_t ctx, const Histogram& histo) {
+    Histogram& code_histo = code_histograms[m->context_map[ctx]];
+    for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+      code_histo.count[i] += histo.count[i];
+    }
+  };
+  size_t ac_ctx = 4;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    for (int j = 0; j < si->comps_in_scan; ++j) {
+      int c = si->component_index[j];
+      add_histogram(c, component_histograms[2 * c]);
+      add_histogram(ac_ctx++, component_histograms[2 * c + 1]);
+    }
+  }
+  return EstimateOutputSize(cinfo, code_histograms.data(),
+                            code_histograms.size(), m->huffman_tables, 0);
+}
+
+// Returns the smallest distance for which the estimated output size is at most
+// the target size, or the maximum distance if there is none.
+float FindDistanceForTargetSize(j_compress_ptr cinfo,
+                                const BlockRows& block_rows) {
+  constexpr int kMaxIters = 20;
+  const float target_size = cinfo->master->target_size;
+  const float tolerance = cinfo->master->target_size_tolerance;
+  const float min_dist = cinfo->master->min_distance;
+  const float max_dist = cinfo->master->max_distance;
+  float d = Clamp(1.0f, min_dist, max_dist);
+  for (int sampling : {4, 1}) {
+    float best_distance = max_dist;
+    float dmin = min_dist;
+    float dmax = max_dist;
+    bool found_lower_bound = false;
+    bool found_upper_bound = false;
+    for (int i = 0; i < kMaxIters; ++i) {
+      UpdateDistance(cinfo, d);
+      float size = EstimateRequantizedSize(cinfo, block_rows, sampling);
+      if (size > target_size) {
+        dmin = d;
+        found_lower_bound = true;
+      } else {
+        dmax = d;
+        found_upper_bound = true;
+        best_distance = std::min(best_distance, d);
+      }
+#if (PSNR_SEARCH_DBG > 1)
+      printf("sampling %d iter %2d d %7.4f size %.0f\n", sampling, i, d, size);
+#endif
+      if ((size <= target_size && size >= (1.0f - tolerance) * target_size) ||
+          dmin == dmax) {
+        break;
+      }
+      if (!found_lower_bound || !found_upper_bound) {
+        // The size is roughly inversely proportional to the distance, but it
+        // changes in steps, so the distance is changed by at least 5% to find
+        // the other bound in a few iterations.
+        const float ratio = size / target_size;
+        d *= size > target_size ? std::max(ratio, 1.05f)
+                                : std::min(ratio, 1.0f / 1.05f);
+      } else {
+        d = std::sqrt(dmin * dmax);
+      }
+      d = Clamp(d, min_dist, max_dist);
+    }
+    d = best_distance;
+  }
+  return d;
+}
+
 }  // namespace
 
+bool HasDistanceTarget(j_compress_ptr cinfo) {
+  return cinfo->master->psnr_target > 0 || cinfo->master->target_size > 0;
+}
+
+void QuantizeToTargetSize(j_compress_ptr cinfo) {
+  BlockRows block_rows;
+  GetBlockRows(cinfo, &block_rows);
+  float distance = FindDistanceForTargetSize(cinfo, block_rows);
+  UpdateDistance(cinfo, distance);
+  ReQuantizeCoeffs(cinfo, block_rows);
+}
+
 void QuantizetoPSNR(j_compress_ptr cinfo) {
-  float distance = FindDistanceForPSNR(cinfo);
+  BlockRows block_rows;
+  GetBlockRows(cinfo, &block_rows);
+  float distance = FindDistanceForPSNR(cinfo, block_rows);
   UpdateDistance(cinfo, distance);
-  ReQuantizeCoeffs(cinfo);
+  ReQuantizeCoeffs(cinfo, block_rows);
 }
 
 }  // namespace jpegli
@@ -11,8 +11,14 @@
 
 namespace jpegli {
 
+// Returns true if the distance is searched for after the whole image is read,
+// in which case the coefficients are kept unquantized until then.
+bool HasDistanceTarget(j_compress_ptr cinfo);
+
 void QuantizetoPSNR(j_compress_ptr cinfo);
 
+void QuantizeToTargetSize(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENCODE_FINISH_H_
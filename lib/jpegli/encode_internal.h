@@ -40,6 +40,10 @@ struct Token {
 struct TokenArray {
   Token* tokens;
   size_t num_tokens;
+  // Index of the scan of the tokens if the scans are spooled, otherwise the
+  // scans are tokenized one after the other and a token array can hold the
+  // tokens of more than one scan.
+  int scan_index;
 };
 
 struct RefToken {
@@ -47,11 +51,33 @@ struct RefToken {
   uint8_t refbits;
 };
 
-struct ScanTokenInfo {
+// Tokens of a part of an AC refinement scan, with their refinement bits and
+// the extra bits of their EOB runs.
+struct RefTokenArray {
   RefToken* tokens;
   size_t num_tokens;
   uint8_t* refbits;
   uint16_t* eobruns;
+};
+
+struct SetupCache;
+struct ScanSpool;
+
+// Part of the output that the destination did not accept during
+// jpegli_finish_compress_suspending().
+struct OutputChunk {
+  uint8_t* data;
+  size_t len;
+  OutputChunk* next;
+};
+
+struct ScanTokenInfo {
+  // Tokens of AC refinement scans.
+  RefTokenArray* ref_token_arrays;
+  size_t num_ref_token_arrays;
+  size_t num_tokens;
+  // Refinement bits of DC refinement scans, one for each block.
+  uint8_t* refbits;
   size_t* restarts;
   size_t num_restarts;
   size_t num_nonzeros;
@@ -118,13 +144,32 @@ struct jpeg_comp_master {
   jpegli::RowBuffer<float> fuzzy_erosion_tmp;
   jpegli::RowBuffer<float> pre_erosion;
   jpegli::RowBuffer<float> quant_field;
+  // Quantized coefficients of the whole image, or, if the scans are spooled,
+  // of only the current iMCU row.
   jvirt_barray_ptr* coeff_buffers;
+  // Tokenization state of each scan if the scans of a multi-scan image are
+  // spooled, i.e. tokenized into their own token arrays one iMCU row at a time
+  // while the image is read, otherwise nullptr.
+  jpegli::ScanSpool* scan_spools;
   size_t next_input_row;
   size_t next_iMCU_row;
   size_t next_dht_index;
   size_t last_restart_interval;
   JCOEF last_dc_coeff[MAX_COMPS_IN_SCAN];
   jpegli::JpegBitWriter bw;
+  // Set during jpegli_finish_compress_suspending(), in which case the output
+  // that the destination does not accept is kept in the pending_output list,
+  // pending_output_len is its total size and pending_output_pos is the number
+  // of bytes of its first chunk that are already written.
+  bool output_suspension;
+  jpegli::OutputChunk* pending_output;
+  jpegli::OutputChunk* pending_output_tail;
+  size_t pending_output_len;
+  size_t pending_output_pos;
+  // Number of bytes written by WriteOutput() since the start of compression.
+  size_t marker_bytes;
+  // Set when the image is tokenized and the Huffman codes are final.
+  bool entropy_coding_ready;
   float* dct_buffer;
   int32_t* block_tmp;
   jpegli::TokenArray* token_arrays;
@@ -136,8 +181,31 @@ struct jpeg_comp_master {
   uint8_t* next_refinement_bit;
   float psnr_target;
   float psnr_tolerance;
+  // Output size target of the distance search, or 0 if disabled.
+  size_t target_size;
+  float target_size_tolerance;
   float min_distance;
   float max_distance;
+  // Tables of the previous image that are reused if the compression
+  // parameters did not change, or nullptr if they are always recomputed.
+  jpegli::SetupCache* setup_cache;
+  // Parallel runner used in the non-streaming code path, or nullptr for
+  // single-threaded encoding.
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // Per-thread scratch space for the parallel coefficient computation.
+  size_t num_threads;
+  float* thread_dct_buffer;
+  int32_t* thread_block_tmp;
+  // Unrounded DC values and their zero-bias thresholds for each block of the
+  // current iMCU row, the final DC values are computed sequentially because
+  // they depend on the DC value of the previous block.
+  float* dc_values;
+  float* dc_thresholds;
+  // Scratch space for the tokens and restart positions of the MCU rows that
+  // are tokenized in parallel.
+  jpegli::Token* band_tokens;
+  size_t* band_restarts;
 };
 
 #endif  // LIB_JPEGLI_ENCODE_INTERNAL_H_
@@ -16,6 +16,7 @@
 #include "lib/jpegli/bitstream.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_finish.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
@@ -119,7 +120,11 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   int32_t* symbols = m->block_tmp + DCTSIZE2;
   int32_t* nonzero_idx = m->block_tmp + 3 * DCTSIZE2;
   coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
-  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  bool adaptive_quant =
+      m->use_adaptive_quantization && !HasDistanceTarget(cinfo);
+  ScanTokenInfo* sti = &m->scan_token_info[0];
+  const size_t restart_interval = sti->restart_interval;
+  TokenArray* ta = nullptr;
   JBLOCKARRAY blocks[kMaxComponents];
   if (kMode == kStreamingModeCoefficients) {
     for (int c = 0; c < cinfo->num_components; ++c) {
@@ -127,13 +132,14 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
       int by0 = mcu_y * comp->v_samp_factor;
       int block_rows_left = comp->height_in_blocks - by0;
       int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+      // If the scans are spooled, only the current iMCU row is buffered.
       blocks[c] = (*cinfo->mem->access_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by0,
-          max_block_rows, true);
+          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c],
+          m->scan_spools ? 0 : by0, max_block_rows, true);
     }
   }
   if (kMode == kStreamingModeTokens) {
-    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    ta = &m->token_arrays[m->cur_token_array];
     int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
     if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
       if (ta->tokens) {
@@ -161,8 +167,27 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   HuffmanCodeTable* ac_code = nullptr;
   const size_t qf_stride = m->quant_field.stride();
   for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+    // Possibly emit a restart marker. The DC prediction is reset after the
+    // marker, but the quantization of the DC coefficients still depends on
+    // last_dc_coeff, so that the coefficients are the same as without
+    // restarts.
+    const size_t mcu_idx = mcu_y * xsize_mcus + mcu_x;
+    const bool restart = kMode != kStreamingModeCoefficients &&
+                         restart_interval > 0 && mcu_idx > 0 &&
+                         mcu_idx % restart_interval == 0;
+    if (restart) {
+      const size_t restart_idx = mcu_idx / restart_interval - 1;
+      if (kMode == kStreamingModeTokens) {
+        sti->restarts[restart_idx] =
+            m->total_num_tokens + (m->next_token - ta->tokens);
+      } else if (kMode == kStreamingModeBits) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + (restart_idx & 0x7));
+      }
+    }
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
+      coeff_t dc_pred = restart ? 0 : last_dc_coeff[c];
       if (kMode == kStreamingModeBits) {
         dc_code = &m->coding_tables[m->context_map[c]];
         ac_code = &m->coding_tables[m->context_map[c + 4]];
@@ -200,8 +225,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
               cblock[k] = block[kJPEGNaturalOrder[k]];
             }
           }
-          block[0] -= last_dc_coeff[c];
-          last_dc_coeff[c] += block[0];
+          last_dc_coeff[c] = block[0];
+          block[0] -= dc_pred;
+          dc_pred = last_dc_coeff[c];
           if (kMode == kStreamingModeTokens) {
             ComputeTokensForBlock<int32_t, false>(block, 0, c, c + 4,
                                                   &m->next_token);
@@ -218,16 +244,129 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
     }
   }
   if (kMode == kStreamingModeTokens) {
-    TokenArray* ta = &m->token_arrays[m->cur_token_array];
     ta->num_tokens = m->next_token - ta->tokens;
-    ScanTokenInfo* sti = &m->scan_token_info[0];
     sti->num_tokens = m->total_num_tokens + ta->num_tokens;
-    sti->restarts[0] = sti->num_tokens;
+    sti->restarts[sti->num_restarts - 1] = sti->num_tokens;
+  }
+}
+
+// Number of MCU columns processed by one task in the parallel coefficient
+// computation.
+constexpr int kMCUsPerTask = 16;
+
+// Same as ProcessiMCURow<kStreamingModeCoefficients>, but the DCT and the
+// quantization of the AC coefficients is done in parallel on m->runner. Since
+// the quantized DC value of a block depends on the DC value of the previous
+// block, the DC values are computed in a second, sequential pass, this way the
+// output is the same as the output of the single-threaded version.
+void ComputeCoefficientsParallel(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  int xsize_mcus = DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  int mcu_y = m->next_iMCU_row;
+  bool adaptive_quant =
+      m->use_adaptive_quantization && !HasDistanceTarget(cinfo);
+  JBLOCKARRAY blocks[kMaxComponents];
+  const float* imcu_start[kMaxComponents];
+  size_t dc_offset[kMaxComponents];
+  size_t num_blocks = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    int by0 = mcu_y * comp->v_samp_factor;
+    int block_rows_left = comp->height_in_blocks - by0;
+    int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+    blocks[c] = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c],
+        m->scan_spools ? 0 : by0, max_block_rows, true);
+    imcu_start[c] = m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
+    dc_offset[c] = num_blocks;
+    num_blocks += comp->v_samp_factor * comp->width_in_blocks;
+  }
+  const float* qf = nullptr;
+  if (adaptive_quant) {
+    qf = m->quant_field.Row(0);
+  }
+  const size_t qf_stride = m->quant_field.stride();
+  const auto allocate_scratch = [&](size_t num_threads) {
+    if (num_threads > m->num_threads) {
+      m->thread_dct_buffer = Allocate<float>(
+          cinfo, num_threads * 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+      m->thread_block_tmp =
+          Allocate<int32_t>(cinfo, num_threads * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+      m->num_threads = num_threads;
+    }
+    return true;
+  };
+  const auto compute_ac = [&](uint32_t task, size_t thread) {
+    float* dct_buffer = m->thread_dct_buffer + thread * 2 * DCTSIZE2;
+    int32_t* block = m->thread_block_tmp + thread * DCTSIZE2;
+    const int mcu_x0 = task * kMCUsPerTask;
+    const int mcu_x1 = std::min(mcu_x0 + kMCUsPerTask, xsize_mcus);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      const float* qmc = m->quant_mul[c];
+      const size_t stride = m->raw_data[c]->stride();
+      const int h_factor = m->h_factor[c];
+      const float* zero_bias_offset = m->zero_bias_offset[c];
+      const float* zero_bias_mul = m->zero_bias_mul[c];
+      const size_t bx0 = mcu_x0 * comp->h_samp_factor;
+      const size_t bx1 = std::min<size_t>(mcu_x1 * comp->h_samp_factor,
+                                          comp->width_in_blocks);
+      float aq_strength = 0.0f;
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        size_t by = mcu_y * comp->v_samp_factor + iy;
+        if (by >= comp->height_in_blocks) break;
+        for (size_t bx = bx0; bx < bx1; ++bx) {
+          if (adaptive_quant) {
+            aq_strength = qf[iy * qf_stride + bx * h_factor];
+          }
+          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+          const size_t ix = dc_offset[c] + iy * comp->width_in_blocks + bx;
+          ComputeACCoefficients(pixels, stride, qmc, aq_strength,
+                                zero_bias_offset, zero_bias_mul, dct_buffer,
+                                block, &m->dc_values[ix],
+                                &m->dc_thresholds[ix]);
+          JCOEF* cblock = &blocks[c][iy][bx][0];
+          for (int k = 1; k < DCTSIZE2; ++k) {
+            cblock[k] = block[kJPEGNaturalOrder[k]];
+          }
+        }
+      }
+    }
+    return true;
+  };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0,
+            DivCeil(xsize_mcus, kMCUsPerTask), allocate_scratch, compute_ac,
+            "ComputeCoefficients");
+  // The DC values must be computed in the same order as the blocks appear in
+  // the sequential version, i.e. MCU order.
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        for (int ix = 0; ix < comp->h_samp_factor; ++ix) {
+          size_t by = mcu_y * comp->v_samp_factor + iy;
+          size_t bx = mcu_x * comp->h_samp_factor + ix;
+          if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
+            continue;
+          }
+          const size_t i = dc_offset[c] + iy * comp->width_in_blocks + bx;
+          JCOEF* cblock = &blocks[c][iy][bx][0];
+          cblock[0] =
+              QuantizeDC(m->dc_values[i], m->dc_thresholds[i],
+                         m->last_dc_coeff[c]);
+          m->last_dc_coeff[c] = cblock[0];
+        }
+      }
+    }
   }
 }
 
 void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeCoefficients>(cinfo);
+  if (cinfo->master->runner != nullptr) {
+    ComputeCoefficientsParallel(cinfo);
+  } else {
+    ProcessiMCURow<kStreamingModeCoefficients>(cinfo);
+  }
 }
 
 void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
@@ -11,11 +11,13 @@
 #include <cstdint>
 #include <cstring>
 #include <limits>
+#include <utility>
 #include <vector>
 
 #include "lib/base/bits.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
+#include "lib/jpegli/bitstream.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
@@ -91,31 +93,107 @@ void TokenizeProgressiveDC(const coeff_t* coeffs, int context, int Al,
   *(*next_token)++ = Token(context, nbits, bits);
 }
 
+// State of the tokenization of an AC first scan that is carried over from one
+// block row to the next.
+struct ACScanState {
+  int eob_run;
+  int restarts_to_go;
+  size_t restart_idx;
+};
+
+Token* EmitEOBRun(int context, ACScanState* state, Token* next_token) {
+  int eob_run = state->eob_run;
+  int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
+  int symbol = nbits << 4u;
+  *next_token++ = Token(context, symbol, eob_run & ((1 << nbits) - 1));
+  state->eob_run = 0;
+  return next_token;
+}
+
+// Tokenizes one block row of an AC first scan (Ss > 0, Ah == 0) starting at
+// next_token and returns the end of its tokens. The restart positions are
+// stored in sti->restarts as token_offset plus the index of the token relative
+// to first_token.
+Token* TokenizeACProgressiveRow(const jpeg_scan_info* scan_info, int context,
+                                const JBLOCKROW row, JDIMENSION width,
+                                const Token* first_token, size_t token_offset,
+                                ScanTokenInfo* sti, ACScanState* state,
+                                Token* next_token) {
+  const int Al = scan_info->Al;
+  const int Ss = scan_info->Ss;
+  const int Se = scan_info->Se;
+  const size_t restart_interval = sti->restart_interval;
+  for (JDIMENSION bx = 0; bx < width; ++bx) {
+    if (restart_interval > 0 && state->restarts_to_go == 0) {
+      if (state->eob_run > 0) {
+        next_token = EmitEOBRun(context, state, next_token);
+      }
+      sti->restarts[state->restart_idx++] =
+          token_offset + (next_token - first_token);
+      state->restarts_to_go = restart_interval;
+    }
+    const coeff_t* block = &row[bx][0];
+    coeff_t temp2;
+    coeff_t temp;
+    int r = 0;
+    int num_nzeros = 0;
+    int num_future_nzeros = 0;
+    for (int k = Ss; k <= Se; ++k) {
+      temp = block[k];
+      if (temp == 0) {
+        r++;
+        continue;
+      }
+      if (temp < 0) {
+        temp = -temp;
+        temp >>= Al;
+        temp2 = ~temp;
+      } else {
+        temp >>= Al;
+        temp2 = temp;
+      }
+      if (temp == 0) {
+        r++;
+        num_future_nzeros++;
+        continue;
+      }
+      if (state->eob_run > 0) {
+        next_token = EmitEOBRun(context, state, next_token);
+      }
+      while (r > 15) {
+        *next_token++ = Token(context, 0xf0, 0);
+        r -= 16;
+      }
+      int nbits = jxl::FloorLog2Nonzero<uint32_t>(temp) + 1;
+      int symbol = (r << 4u) + nbits;
+      *next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
+      ++num_nzeros;
+      r = 0;
+    }
+    if (r > 0) {
+      ++state->eob_run;
+      if (state->eob_run == 0x7FFF) {
+        next_token = EmitEOBRun(context, state, next_token);
+      }
+    }
+    sti->num_nonzeros += num_nzeros;
+    sti->num_future_nonzeros += num_future_nzeros;
+    --state->restarts_to_go;
+  }
+  return next_token;
+}
+
 void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
                                int context, ScanTokenInfo* sti) {
   jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
   const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-  const int Al = scan_info->Al;
   const int Ss = scan_info->Ss;
   const int Se = scan_info->Se;
-  const size_t restart_interval = sti->restart_interval;
-  int restarts_to_go = restart_interval;
-  size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
-  size_t num_restarts =
-      restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
-  size_t restart_idx = 0;
-  int eob_run = 0;
+  ACScanState state = {0, static_cast<int>(sti->restart_interval), 0};
   TokenArray* ta = &m->token_arrays[m->cur_token_array];
   sti->token_offset = m->total_num_tokens + ta->num_tokens;
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
-  const auto emit_eob_run = [&]() {
-    int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
-    int symbol = nbits << 4u;
-    *m->next_token++ = Token(context, symbol, eob_run & ((1 << nbits) - 1));
-    eob_run = 0;
-  };
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
     JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
         reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
@@ -136,65 +214,141 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
       ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
       m->next_token = ta->tokens;
     }
-    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
-      if (restart_interval > 0 && restarts_to_go == 0) {
-        if (eob_run > 0) emit_eob_run();
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
-        restarts_to_go = restart_interval;
-      }
-      const coeff_t* block = &blocks[0][bx][0];
-      coeff_t temp2;
-      coeff_t temp;
-      int r = 0;
-      int num_nzeros = 0;
-      int num_future_nzeros = 0;
-      for (int k = Ss; k <= Se; ++k) {
-        temp = block[k];
-        if (temp == 0) {
-          r++;
-          continue;
-        }
-        if (temp < 0) {
-          temp = -temp;
-          temp >>= Al;
-          temp2 = ~temp;
-        } else {
-          temp >>= Al;
-          temp2 = temp;
-        }
-        if (temp == 0) {
-          r++;
-          num_future_nzeros++;
-          continue;
-        }
-        if (eob_run > 0) emit_eob_run();
-        while (r > 15) {
-          *m->next_token++ = Token(context, 0xf0, 0);
-          r -= 16;
-        }
-        int nbits = jxl::FloorLog2Nonzero<uint32_t>(temp) + 1;
-        int symbol = (r << 4u) + nbits;
-        *m->next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
-        ++num_nzeros;
-        r = 0;
-      }
-      if (r > 0) {
-        ++eob_run;
-        if (eob_run == 0x7FFF) emit_eob_run();
-      }
-      sti->num_nonzeros += num_nzeros;
-      sti->num_future_nonzeros += num_future_nzeros;
-      --restarts_to_go;
-    }
+    m->next_token = TokenizeACProgressiveRow(
+        scan_info, context, blocks[0], comp->width_in_blocks, ta->tokens,
+        m->total_num_tokens, sti, &state, m->next_token);
     ta->num_tokens = m->next_token - ta->tokens;
   }
-  if (eob_run > 0) {
-    emit_eob_run();
+  if (state.eob_run > 0) {
+    m->next_token = EmitEOBRun(context, &state, m->next_token);
     ++ta->num_tokens;
   }
   sti->num_tokens = m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+  sti->restarts[state.restart_idx++] = m->total_num_tokens + ta->num_tokens;
+}
+
+// State of the tokenization of an AC refinement scan that is carried over from
+// one block row to the next. If eob_run > 0, the last token is the EOB run
+// token at next_eob_token that the following blocks can still extend, and the
+// last eob_refbits refinement bits belong to it.
+struct RefScanState {
+  RefToken* next_token;
+  RefToken* next_eob_token;
+  uint8_t* next_ref_bit;
+  uint16_t* next_eobrun;
+  int eob_run;
+  int eob_refbits;
+  int restarts_to_go;
+  size_t restart_idx;
+};
+
+// Tokenizes one block row of an AC refinement scan (Ss > 0, Ah > 0). The
+// restart positions are stored in sti->restarts as token_offset plus the index
+// of the token relative to first_token.
+void TokenizeACRefinementRow(const jpeg_scan_info* scan_info,
+                             const JBLOCKROW row, JDIMENSION width,
+                             const RefToken* first_token, size_t token_offset,
+                             ScanTokenInfo* sti, RefScanState* state) {
+  const int Al = scan_info->Al;
+  const int Ss = scan_info->Ss;
+  const int Se = scan_info->Se;
+  const size_t restart_interval = sti->restart_interval;
+  RefToken token;
+  RefToken* next_token = state->next_token;
+  RefToken* next_eob_token = state->next_eob_token;
+  uint8_t* next_ref_bit = state->next_ref_bit;
+  uint16_t* next_eobrun = state->next_eobrun;
+  int eob_run = state->eob_run;
+  int eob_refbits = state->eob_refbits;
+  int restarts_to_go = state->restarts_to_go;
+  for (JDIMENSION bx = 0; bx < width; ++bx) {
+    if (restart_interval > 0 && restarts_to_go == 0) {
+      sti->restarts[state->restart_idx++] =
+          token_offset + (next_token - first_token);
+      restarts_to_go = restart_interval;
+      next_eob_token = next_token;
+      eob_run = eob_refbits = 0;
+    }
+    const coeff_t* block = &row[bx][0];
+    int num_eob_refinement_bits = 0;
+    int num_refinement_bits = 0;
+    int num_nzeros = 0;
+    int r = 0;
+    for (int k = Ss; k <= Se; ++k) {
+      int absval = block[k];
+      if (absval == 0) {
+        r++;
+        continue;
+      }
+      const int mask = absval >> (8 * sizeof(int) - 1);
+      absval += mask;
+      absval ^= mask;
+      absval >>= Al;
+      if (absval == 0) {
+        r++;
+        continue;
+      }
+      while (r > 15) {
+        token.symbol = 0xf0;
+        token.refbits = num_refinement_bits;
+        *next_token++ = token;
+        r -= 16;
+        num_eob_refinement_bits += num_refinement_bits;
+        num_refinement_bits = 0;
+      }
+      if (absval > 1) {
+        *next_ref_bit++ = absval & 1u;
+        ++num_refinement_bits;
+        continue;
+      }
+      int symbol = (r << 4u) + 1 + ((mask + 1) << 1);
+      token.symbol = symbol;
+      token.refbits = num_refinement_bits;
+      *next_token++ = token;
+      ++num_nzeros;
+      num_refinement_bits = 0;
+      num_eob_refinement_bits = 0;
+      r = 0;
+      next_eob_token = next_token;
+      eob_run = eob_refbits = 0;
+    }
+    if (r > 0 || num_eob_refinement_bits + num_refinement_bits > 0) {
+      ++eob_run;
+      eob_refbits += num_eob_refinement_bits + num_refinement_bits;
+      if (eob_refbits > 255) {
+        ++next_eob_token;
+        eob_refbits = num_eob_refinement_bits + num_refinement_bits;
+        eob_run = 1;
+      }
+      next_token = next_eob_token;
+      next_token->refbits = eob_refbits;
+      if (eob_run == 1) {
+        next_token->symbol = 0;
+      } else if (eob_run == 2) {
+        next_token->symbol = 16;
+        *next_eobrun++ = 0;
+      } else if ((eob_run & (eob_run - 1)) == 0) {
+        next_token->symbol += 16;
+        next_eobrun[-1] = 0;
+      } else {
+        ++next_eobrun[-1];
+      }
+      ++next_token;
+      if (eob_run == 0x7fff) {
+        next_eob_token = next_token;
+        eob_run = eob_refbits = 0;
+      }
+    }
+    sti->num_nonzeros += num_nzeros;
+    --restarts_to_go;
+  }
+  state->next_token = next_token;
+  state->next_eob_token = next_eob_token;
+  state->next_ref_bit = next_ref_bit;
+  state->next_eobrun = next_eobrun;
+  state->eob_run = eob_run;
+  state->eob_refbits = eob_refbits;
+  state->restarts_to_go = restarts_to_go;
 }
 
 void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
@@ -203,115 +357,259 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
   const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-  const int Al = scan_info->Al;
-  const int Ss = scan_info->Ss;
-  const int Se = scan_info->Se;
   const size_t restart_interval = sti->restart_interval;
-  int restarts_to_go = restart_interval;
-  RefToken token;
-  int eob_run = 0;
-  int eob_refbits = 0;
   size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
   size_t num_restarts =
       restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
-  sti->tokens = m->next_refinement_token;
-  sti->refbits = m->next_refinement_bit;
-  sti->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
+  RefTokenArray* rta = Allocate<RefTokenArray>(cinfo, 1, JPOOL_IMAGE);
+  rta->tokens = m->next_refinement_token;
+  rta->refbits = m->next_refinement_bit;
+  rta->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
+  sti->ref_token_arrays = rta;
+  sti->num_ref_token_arrays = 1;
   sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
-  RefToken* next_token = sti->tokens;
-  RefToken* next_eob_token = next_token;
-  uint8_t* next_ref_bit = sti->refbits;
-  uint16_t* next_eobrun = sti->eobruns;
-  size_t restart_idx = 0;
+  RefScanState state = {rta->tokens,
+                        rta->tokens,
+                        rta->refbits,
+                        rta->eobruns,
+                        0,
+                        0,
+                        static_cast<int>(restart_interval),
+                        0};
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
     JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
         reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
         1, FALSE);
-    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
-      if (restart_interval > 0 && restarts_to_go == 0) {
-        sti->restarts[restart_idx++] = next_token - sti->tokens;
-        restarts_to_go = restart_interval;
-        next_eob_token = next_token;
-        eob_run = eob_refbits = 0;
+    TokenizeACRefinementRow(scan_info, blocks[0], comp->width_in_blocks,
+                            rta->tokens, 0, sti, &state);
+  }
+  rta->num_tokens = state.next_token - rta->tokens;
+  sti->num_tokens = rta->num_tokens;
+  sti->restarts[state.restart_idx++] = sti->num_tokens;
+  m->next_refinement_token = state.next_token;
+  m->next_refinement_bit = state.next_ref_bit;
+}
+
+// Number of MCU rows of a sequential scan that are tokenized in parallel
+// before their tokens are appended to the token arrays.
+constexpr size_t kMCURowsPerRound = 16;
+
+// Tokenizes MCU row mcu_y of a sequential scan into tokens and returns the
+// number of tokens. The token indexes of the restart markers, relative to the
+// start of the MCU row, are stored in restarts, and their number in
+// *num_restarts.
+size_t TokenizeSequentialMCURow(j_compress_ptr cinfo,
+                                const jpeg_scan_info* scan_info,
+                                int ac_ctx_offset, const ScanTokenInfo* sti,
+                                const JBLOCKARRAY* block_rows, size_t mcu_y,
+                                Token* tokens, size_t* restarts,
+                                size_t* num_restarts) {
+  const bool is_interleaved = (scan_info->comps_in_scan > 1);
+  const size_t restart_interval = sti->restart_interval;
+  HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
+  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN] = {0};
+  size_t mcu_idx = mcu_y * sti->MCUs_per_row;
+  if (mcu_y > 0 && (restart_interval == 0 || mcu_idx % restart_interval)) {
+    // The DC prediction continues from the last block of the previous MCU.
+    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+      int comp_idx = scan_info->component_index[i];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      int n_blocks_y = is_interleaved ? comp->v_samp_factor : 1;
+      int n_blocks_x = is_interleaved ? comp->h_samp_factor : 1;
+      size_t block_y = mcu_y * n_blocks_y - 1;
+      size_t block_x = sti->MCUs_per_row * n_blocks_x - 1;
+      if (block_x < comp->width_in_blocks &&
+          block_y < comp->height_in_blocks) {
+        last_dc_coeff[i] = block_rows[i][block_y][block_x][0];
       }
-      const coeff_t* block = &blocks[0][bx][0];
-      int num_eob_refinement_bits = 0;
-      int num_refinement_bits = 0;
-      int num_nzeros = 0;
-      int r = 0;
-      for (int k = Ss; k <= Se; ++k) {
-        int absval = block[k];
-        if (absval == 0) {
-          r++;
-          continue;
-        }
-        const int mask = absval >> (8 * sizeof(int) - 1);
-        absval += mask;
-        absval ^= mask;
-        absval >>= Al;
-        if (absval == 0) {
-          r++;
-          continue;
-        }
-        while (r > 15) {
-          token.symbol = 0xf0;
-          token.refbits = num_refinement_bits;
-          *next_token++ = token;
-          r -= 16;
-          num_eob_refinement_bits += num_refinement_bits;
-          num_refinement_bits = 0;
-        }
-        if (absval > 1) {
-          *next_ref_bit++ = absval & 1u;
-          ++num_refinement_bits;
-          continue;
+    }
+  }
+  Token* next_token = tokens;
+  *num_restarts = 0;
+  for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x, ++mcu_idx) {
+    // Possibly emit a restart marker.
+    if (restart_interval > 0 && mcu_idx > 0 &&
+        mcu_idx % restart_interval == 0) {
+      memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
+      restarts[(*num_restarts)++] = next_token - tokens;
+    }
+    // Encode one MCU
+    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+      int comp_idx = scan_info->component_index[i];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      int n_blocks_y = is_interleaved ? comp->v_samp_factor : 1;
+      int n_blocks_x = is_interleaved ? comp->h_samp_factor : 1;
+      for (int iy = 0; iy < n_blocks_y; ++iy) {
+        for (int ix = 0; ix < n_blocks_x; ++ix) {
+          size_t block_y = mcu_y * n_blocks_y + iy;
+          size_t block_x = mcu_x * n_blocks_x + ix;
+          const coeff_t* block;
+          if (block_x >= comp->width_in_blocks ||
+              block_y >= comp->height_in_blocks) {
+            block = kSinkBlock;
+          } else {
+            block = &block_rows[i][block_y][block_x][0];
+          }
+          HWY_DYNAMIC_DISPATCH(ComputeTokensSequential)
+          (block, last_dc_coeff[i], comp_idx, ac_ctx_offset + i, &next_token);
+          last_dc_coeff[i] = block[0];
         }
-        int symbol = (r << 4u) + 1 + ((mask + 1) << 1);
-        token.symbol = symbol;
-        token.refbits = num_refinement_bits;
-        *next_token++ = token;
-        ++num_nzeros;
-        num_refinement_bits = 0;
-        num_eob_refinement_bits = 0;
-        r = 0;
-        next_eob_token = next_token;
-        eob_run = eob_refbits = 0;
       }
-      if (r > 0 || num_eob_refinement_bits + num_refinement_bits > 0) {
-        ++eob_run;
-        eob_refbits += num_eob_refinement_bits + num_refinement_bits;
-        if (eob_refbits > 255) {
-          ++next_eob_token;
-          eob_refbits = num_eob_refinement_bits + num_refinement_bits;
-          eob_run = 1;
-        }
-        next_token = next_eob_token;
-        next_token->refbits = eob_refbits;
-        if (eob_run == 1) {
-          next_token->symbol = 0;
-        } else if (eob_run == 2) {
-          next_token->symbol = 16;
-          *next_eobrun++ = 0;
-        } else if ((eob_run & (eob_run - 1)) == 0) {
-          next_token->symbol += 16;
-          next_eobrun[-1] = 0;
-        } else {
-          ++next_eobrun[-1];
+    }
+  }
+  return next_token - tokens;
+}
+
+// Same as TokenizeScan() for sequential scans, but kMCURowsPerRound MCU rows
+// are tokenized in parallel on m->runner into scratch buffers, which are then
+// appended to the token arrays in order. The resulting tokens and restart
+// positions are the same as in the single-threaded version.
+void TokenizeSequentialScanParallel(j_compress_ptr cinfo, size_t scan_index,
+                                    int ac_ctx_offset, ScanTokenInfo* sti) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  const size_t max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
+  const size_t max_restarts_per_mcu_row = m->xsize_blocks + 1;
+  if (m->band_tokens == nullptr) {
+    m->band_tokens = Allocate<Token>(
+        cinfo, kMCURowsPerRound * max_tokens_per_mcu_row, JPOOL_IMAGE);
+    m->band_restarts = Allocate<size_t>(
+        cinfo, kMCURowsPerRound * max_restarts_per_mcu_row, JPOOL_IMAGE);
+  }
+  // The block rows are looked up on this thread, since the virtual array
+  // access methods may not be thread-safe.
+  JBLOCKARRAY block_rows[MAX_COMPS_IN_SCAN];
+  for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+    int comp_idx = scan_info->component_index[i];
+    jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+    block_rows[i] =
+        Allocate<JBLOCKROW>(cinfo, comp->height_in_blocks, JPOOL_IMAGE);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      block_rows[i][by] = GetBlockRow(cinfo, comp_idx, by)[0];
+    }
+  }
+  size_t num_tokens[kMCURowsPerRound];
+  size_t num_restarts[kMCURowsPerRound];
+  size_t restart_idx = 0;
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  sti->token_offset = m->total_num_tokens + ta->num_tokens;
+  for (size_t mcu_y0 = 0; mcu_y0 < sti->MCU_rows_in_scan;
+       mcu_y0 += kMCURowsPerRound) {
+    const size_t num_rows =
+        std::min(kMCURowsPerRound, sti->MCU_rows_in_scan - mcu_y0);
+    const auto tokenize_row = [&](uint32_t i, size_t /*thread*/) {
+      num_tokens[i] = TokenizeSequentialMCURow(
+          cinfo, scan_info, ac_ctx_offset, sti, block_rows, mcu_y0 + i,
+          m->band_tokens + i * max_tokens_per_mcu_row,
+          m->band_restarts + i * max_restarts_per_mcu_row, &num_restarts[i]);
+      return true;
+    };
+    const auto no_init = [](size_t /*num_threads*/) { return true; };
+    RunOnPool(cinfo, m->runner, m->runner_opaque, 0, num_rows, no_init,
+              tokenize_row, "TokenizeScan");
+    for (size_t i = 0; i < num_rows; ++i) {
+      const size_t mcu_y = mcu_y0 + i;
+      if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
+        if (ta->tokens) {
+          m->total_num_tokens += ta->num_tokens;
+          ++m->cur_token_array;
+          ta = &m->token_arrays[m->cur_token_array];
         }
-        ++next_token;
-        if (eob_run == 0x7fff) {
-          next_eob_token = next_token;
-          eob_run = eob_refbits = 0;
+        m->num_tokens =
+            EstimateNumTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
+                              m->total_num_tokens, max_tokens_per_mcu_row);
+        ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
+        m->next_token = ta->tokens;
+      }
+      const size_t row_start = m->total_num_tokens + ta->num_tokens;
+      const size_t* restarts = m->band_restarts + i * max_restarts_per_mcu_row;
+      for (size_t j = 0; j < num_restarts[i]; ++j) {
+        sti->restarts[restart_idx++] = row_start + restarts[j];
+      }
+      memcpy(m->next_token, m->band_tokens + i * max_tokens_per_mcu_row,
+             num_tokens[i] * sizeof(Token));
+      m->next_token += num_tokens[i];
+      ta->num_tokens = m->next_token - ta->tokens;
+    }
+  }
+  sti->num_tokens = m->total_num_tokens + ta->num_tokens - sti->token_offset;
+  sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+}
+
+// State of the tokenization of a sequential scan or of a DC scan of a
+// progressive image that is carried over from one MCU row to the next.
+struct MCUScanState {
+  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN];
+  int restarts_to_go;
+  size_t restart_idx;
+  size_t block_idx;
+};
+
+// Tokenizes MCU row mcu_y of a sequential scan or of a DC scan of a progressive
+// image starting at next_token and returns the end of its tokens. blocks[i]
+// are the block rows of the ith component of the scan, starting at the first
+// block row of the MCU row. The restart positions are stored in sti->restarts
+// as token_offset plus the index of the token relative to first_token, except
+// for DC refinement scans, whose bits are stored in sti->refbits and whose
+// restart positions are block indexes.
+Token* TokenizeMCURow(j_compress_ptr cinfo, const jpeg_scan_info* scan_info,
+                      int ac_ctx_offset, size_t mcu_y,
+                      const JBLOCKARRAY* blocks, const Token* first_token,
+                      size_t token_offset, ScanTokenInfo* sti,
+                      MCUScanState* state, Token* next_token) {
+  const size_t restart_interval = sti->restart_interval;
+  // "Non-interleaved" means color data comes in separate scans, in other words
+  // each scan can contain only one color component.
+  const bool is_interleaved = (scan_info->comps_in_scan > 1);
+  const bool is_progressive = FROM_JXL_BOOL(cinfo->progressive_mode);
+  const int Ah = scan_info->Ah;
+  const int Al = scan_info->Al;
+  HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
+  coeff_t* last_dc_coeff = state->last_dc_coeff;
+  for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
+    // Possibly emit a restart marker.
+    if (restart_interval > 0 && state->restarts_to_go == 0) {
+      state->restarts_to_go = restart_interval;
+      memset(last_dc_coeff, 0, sizeof(state->last_dc_coeff));
+      sti->restarts[state->restart_idx++] =
+          Ah > 0 ? state->block_idx : token_offset + (next_token - first_token);
+    }
+    // Encode one MCU
+    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+      int comp_idx = scan_info->component_index[i];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      int n_blocks_y = is_interleaved ? comp->v_samp_factor : 1;
+      int n_blocks_x = is_interleaved ? comp->h_samp_factor : 1;
+      for (int iy = 0; iy < n_blocks_y; ++iy) {
+        for (int ix = 0; ix < n_blocks_x; ++ix) {
+          size_t block_y = mcu_y * n_blocks_y + iy;
+          size_t block_x = mcu_x * n_blocks_x + ix;
+          const coeff_t* block;
+          if (block_x >= comp->width_in_blocks ||
+              block_y >= comp->height_in_blocks) {
+            block = kSinkBlock;
+          } else {
+            block = &blocks[i][iy][block_x][0];
+          }
+          if (!is_progressive) {
+            HWY_DYNAMIC_DISPATCH(ComputeTokensSequential)
+            (block, last_dc_coeff[i], comp_idx, ac_ctx_offset + i, &next_token);
+            last_dc_coeff[i] = block[0];
+          } else {
+            if (Ah == 0) {
+              TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
+                                    &next_token);
+            } else {
+              sti->refbits[state->block_idx] = (block[0] >> Al) & 1;
+            }
+          }
+          ++state->block_idx;
         }
       }
-      sti->num_nonzeros += num_nzeros;
-      --restarts_to_go;
     }
+    --state->restarts_to_go;
   }
-  sti->num_tokens = next_token - sti->tokens;
-  sti->restarts[restart_idx++] = sti->num_tokens;
-  m->next_refinement_token = next_token;
-  m->next_refinement_bit = next_ref_bit;
+  return next_token;
 }
 
 void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
@@ -325,21 +623,16 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
     }
     return;
   }
+  if (!cinfo->progressive_mode && cinfo->master->runner != nullptr) {
+    TokenizeSequentialScanParallel(cinfo, scan_index, ac_ctx_offset, sti);
+    return;
+  }
 
   jpeg_comp_master* m = cinfo->master;
-  size_t restart_interval = sti->restart_interval;
-  int restarts_to_go = restart_interval;
-  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN] = {0};
-
-  // "Non-interleaved" means color data comes in separate scans, in other words
-  // each scan can contain only one color component.
+  MCUScanState state = {{0}, static_cast<int>(sti->restart_interval), 0, 0};
   const bool is_interleaved = (scan_info->comps_in_scan > 1);
-  const bool is_progressive = FROM_JXL_BOOL(cinfo->progressive_mode);
   const int Ah = scan_info->Ah;
-  const int Al = scan_info->Al;
-  HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
 
-  size_t restart_idx = 0;
   TokenArray* ta = &m->token_arrays[m->cur_token_array];
   sti->token_offset = Ah > 0 ? 0 : m->total_num_tokens + ta->num_tokens;
 
@@ -359,7 +652,6 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
   }
 
   JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
-  size_t block_idx = 0;
   for (size_t mcu_y = 0; mcu_y < sti->MCU_rows_in_scan; ++mcu_y) {
     for (int i = 0; i < scan_info->comps_in_scan; ++i) {
       int comp_idx = scan_info->component_index[i];
@@ -387,16 +679,44 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
         m->next_token = ta->tokens;
       }
     }
+    m->next_token =
+        TokenizeMCURow(cinfo, scan_info, ac_ctx_offset, mcu_y, blocks,
+                       ta->tokens, m->total_num_tokens, sti, &state,
+                       m->next_token);
+    ta->num_tokens = m->next_token - ta->tokens;
+  }
+  JXL_DASSERT(state.block_idx == sti->num_blocks);
+  sti->num_tokens =
+      Ah > 0 ? sti->num_blocks
+             : m->total_num_tokens + ta->num_tokens - sti->token_offset;
+  sti->restarts[state.restart_idx++] =
+      Ah > 0 ? sti->num_blocks : m->total_num_tokens + ta->num_tokens;
+  if (Ah == 0 && cinfo->progressive_mode) {
+    JXL_DASSERT(sti->num_blocks == sti->num_tokens);
+  }
+}
+
+// Tokenizes a DC first scan (Ss == 0, Ah == 0) of a progressive image into
+// tokens, which must have room for sti->num_blocks tokens. The restart
+// positions are stored relative to the start of the scan.
+void TokenizeDCFirstScan(j_compress_ptr cinfo, const jpeg_scan_info* scan_info,
+                         const JBLOCKARRAY* comp_rows, ScanTokenInfo* sti,
+                         Token* tokens) {
+  const bool is_interleaved = (scan_info->comps_in_scan > 1);
+  const int Al = scan_info->Al;
+  const size_t restart_interval = sti->restart_interval;
+  int restarts_to_go = restart_interval;
+  size_t restart_idx = 0;
+  HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
+  coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN] = {0};
+  Token* next_token = tokens;
+  for (size_t mcu_y = 0; mcu_y < sti->MCU_rows_in_scan; ++mcu_y) {
     for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
-      // Possibly emit a restart marker.
       if (restart_interval > 0 && restarts_to_go == 0) {
         restarts_to_go = restart_interval;
         memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] =
-            Ah > 0 ? block_idx : m->total_num_tokens + ta->num_tokens;
+        sti->restarts[restart_idx++] = next_token - tokens;
       }
-      // Encode one MCU
       for (int i = 0; i < scan_info->comps_in_scan; ++i) {
         int comp_idx = scan_info->component_index[i];
         jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
@@ -411,37 +731,115 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
                 block_y >= comp->height_in_blocks) {
               block = kSinkBlock;
             } else {
-              block = &blocks[i][iy][block_x][0];
-            }
-            if (!is_progressive) {
-              HWY_DYNAMIC_DISPATCH(ComputeTokensSequential)
-              (block, last_dc_coeff[i], comp_idx, ac_ctx_offset + i,
-               &m->next_token);
-              last_dc_coeff[i] = block[0];
-            } else {
-              if (Ah == 0) {
-                TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
-                                      &m->next_token);
-              } else {
-                sti->refbits[block_idx] = (block[0] >> Al) & 1;
-              }
+              block = &comp_rows[comp_idx][block_y][block_x][0];
             }
-            ++block_idx;
+            TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
+                                  &next_token);
           }
         }
       }
       --restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
   }
-  JXL_DASSERT(block_idx == sti->num_blocks);
-  sti->num_tokens =
-      Ah > 0 ? sti->num_blocks
-             : m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] =
-      Ah > 0 ? sti->num_blocks : m->total_num_tokens + ta->num_tokens;
-  if (Ah == 0 && cinfo->progressive_mode) {
-    JXL_DASSERT(sti->num_blocks == sti->num_tokens);
+  JXL_DASSERT(static_cast<size_t>(next_token - tokens) == sti->num_blocks);
+  sti->restarts[restart_idx++] = next_token - tokens;
+}
+
+// Tokenizes an AC first scan (Ss > 0, Ah == 0) into tokens, which is resized
+// as needed. The restart positions are stored relative to the start of the
+// scan.
+void TokenizeACFirstScan(j_compress_ptr cinfo, const jpeg_scan_info* scan_info,
+                         int context, const JBLOCKARRAY* comp_rows,
+                         ScanTokenInfo* sti, std::vector<Token>* tokens) {
+  const int comp_idx = scan_info->component_index[0];
+  const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+  const Token kFiller(0, 0, 0);
+  const size_t max_tokens_per_row =
+      1 + comp->width_in_blocks * (scan_info->Se - scan_info->Ss + 1);
+  ACScanState state = {0, static_cast<int>(sti->restart_interval), 0};
+  size_t num_tokens = 0;
+  for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+    tokens->resize(num_tokens + max_tokens_per_row, kFiller);
+    Token* first_token = tokens->data();
+    Token* next_token = TokenizeACProgressiveRow(
+        scan_info, context, comp_rows[comp_idx][by], comp->width_in_blocks,
+        first_token, 0, sti, &state, first_token + num_tokens);
+    num_tokens = next_token - first_token;
+  }
+  if (state.eob_run > 0) {
+    tokens->resize(num_tokens + 1, kFiller);
+    EmitEOBRun(context, &state, tokens->data() + num_tokens);
+    ++num_tokens;
+  }
+  tokens->resize(num_tokens, kFiller);
+  sti->restarts[state.restart_idx++] = num_tokens;
+}
+
+// Tokenizes all the scans of a progressive image that are not refinement
+// scans in parallel on m->runner, one scan per task, into scratch buffers that
+// are then appended to the token arrays in scan order. Only the offsets of the
+// scans in the token arrays differ from TokenizeScan(), so the bitstream does
+// not depend on the runner. The refinement scans are not included, since they
+// share the refinement token and bit buffers, which are allocated based on the
+// statistics of the first scans.
+void TokenizeFirstScansParallel(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<int> scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    if (cinfo->scan_info[i].Ah == 0) {
+      scans.push_back(i);
+    }
+  }
+  // The block rows are looked up on this thread, since the virtual array
+  // access methods may not be thread-safe.
+  JBLOCKARRAY comp_rows[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    comp_rows[c] =
+        Allocate<JBLOCKROW>(cinfo, comp->height_in_blocks, JPOOL_IMAGE);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      comp_rows[c][by] = GetBlockRow(cinfo, c, by)[0];
+    }
+  }
+  std::vector<std::vector<Token>> scan_tokens(scans.size());
+  const auto tokenize_scan = [&](uint32_t task, size_t /*thread*/) {
+    const int scan_index = scans[task];
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+    ScanTokenInfo* sti = &m->scan_token_info[scan_index];
+    std::vector<Token>* tokens = &scan_tokens[task];
+    if (scan_info->Ss == 0) {
+      tokens->resize(sti->num_blocks, Token(0, 0, 0));
+      TokenizeDCFirstScan(cinfo, scan_info, comp_rows, sti, tokens->data());
+    } else {
+      TokenizeACFirstScan(cinfo, scan_info, m->ac_ctx_offset[scan_index],
+                          comp_rows, sti, tokens);
+    }
+    return true;
+  };
+  const auto no_init = [](size_t /*num_threads*/) { return true; };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0, scans.size(), no_init,
+            tokenize_scan, "TokenizeFirstScans");
+  for (size_t t = 0; t < scans.size(); ++t) {
+    ScanTokenInfo* sti = &m->scan_token_info[scans[t]];
+    std::vector<Token>* tokens = &scan_tokens[t];
+    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    if (ta->tokens) {
+      m->total_num_tokens += ta->num_tokens;
+      ++m->cur_token_array;
+      ta = &m->token_arrays[m->cur_token_array];
+    }
+    ta->tokens = Allocate<Token>(cinfo, std::max<size_t>(1, tokens->size()),
+                                 JPOOL_IMAGE);
+    memcpy(ta->tokens, tokens->data(), tokens->size() * sizeof(Token));
+    ta->num_tokens = tokens->size();
+    m->num_tokens = ta->num_tokens;
+    m->next_token = ta->tokens + ta->num_tokens;
+    sti->token_offset = m->total_num_tokens;
+    sti->num_tokens = ta->num_tokens;
+    for (size_t j = 0; j < sti->num_restarts; ++j) {
+      sti->restarts[j] += sti->token_offset;
+    }
+    std::vector<Token>().swap(*tokens);
   }
 }
 
@@ -454,14 +852,21 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
   size_t num_refinement_bits = 0;
   int num_refinement_scans[kMaxComponents][DCTSIZE2] = {};
   int max_num_refinement_scans = 0;
+  if (cinfo->progressive_mode && m->runner != nullptr) {
+    TokenizeFirstScansParallel(cinfo);
+    for (int i = 0; i < cinfo->num_scans; ++i) {
+      processed[i] = cinfo->scan_info[i].Ah == 0;
+    }
+  }
   for (int i = 0; i < cinfo->num_scans; ++i) {
     const jpeg_scan_info* si = &cinfo->scan_info[i];
     ScanTokenInfo* sti = &m->scan_token_info[i];
     if (si->Ss > 0 && si->Ah == 0 && si->Al > 0) {
-      int offset = m->ac_ctx_offset[i];
       int comp_idx = si->component_index[0];
-      TokenizeScan(cinfo, i, offset, sti);
-      processed[i] = 1;
+      if (!processed[i]) {
+        TokenizeScan(cinfo, i, m->ac_ctx_offset[i], sti);
+        processed[i] = 1;
+      }
       max_refinement_tokens += sti->num_future_nonzeros;
       for (int k = si->Ss; k <= si->Se; ++k) {
         num_refinement_scans[comp_idx][k] = si->Al;
@@ -511,52 +916,252 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
   }
 }
 
+// Tokenization state and scratch buffers of one scan of an image whose scans
+// are spooled.
+struct ScanSpool {
+  MCUScanState mcu_state;
+  ACScanState ac_state;
+  RefScanState ref_state;
+  // Number of tokens of the scan that were moved out of the scratch buffers.
+  size_t num_tokens;
+  // Tokens of the current iMCU row.
+  Token* tokens;
+  Token* next_token;
+  // Tokens, refinement bits and EOB run extra bits of the current iMCU row of
+  // an AC refinement scan, following the ones that the next iMCU row can still
+  // modify.
+  RefToken* ref_tokens;
+  uint8_t* refbits;
+  uint16_t* eobruns;
+};
+
+void InitScanSpools(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->scan_spools = Allocate<ScanSpool>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    ScanSpool* sp = &m->scan_spools[i];
+    memset(sp, 0, sizeof(*sp));
+    const int restart_interval = static_cast<int>(sti->restart_interval);
+    sp->mcu_state.restarts_to_go = restart_interval;
+    sp->ac_state.restarts_to_go = restart_interval;
+    size_t num_rows = 1;
+    size_t num_blocks = sti->MCUs_per_row * sti->blocks_in_MCU;
+    if (si->comps_in_scan == 1) {
+      const jpeg_component_info* comp =
+          &cinfo->comp_info[si->component_index[0]];
+      num_rows = comp->v_samp_factor;
+      num_blocks = num_rows * comp->width_in_blocks;
+    }
+    const size_t band_size = si->Se - si->Ss + 1;
+    sti->token_offset = 0;
+    sti->num_tokens = 0;
+    if (si->Ss == 0 && si->Ah > 0) {
+      sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
+    } else if (si->Ss > 0 && si->Ah > 0) {
+      // There is at most one token per coefficient and one EOB run token per
+      // block, and one EOB run token with at most 255 refinement bits can be
+      // carried over from the previous iMCU row.
+      sp->ref_tokens =
+          Allocate<RefToken>(cinfo, 1 + num_blocks * (band_size + 1),
+                             JPOOL_IMAGE);
+      sp->refbits =
+          Allocate<uint8_t>(cinfo, 255 + num_blocks * band_size, JPOOL_IMAGE);
+      sp->eobruns = Allocate<uint16_t>(cinfo, 1 + num_blocks, JPOOL_IMAGE);
+      sp->ref_state.next_token = sp->ref_tokens;
+      sp->ref_state.next_eob_token = sp->ref_tokens;
+      sp->ref_state.next_ref_bit = sp->refbits;
+      sp->ref_state.next_eobrun = sp->eobruns;
+      sp->ref_state.restarts_to_go = restart_interval;
+      sti->ref_token_arrays = Allocate<RefTokenArray>(
+          cinfo, cinfo->total_iMCU_rows, JPOOL_IMAGE);
+      sti->num_ref_token_arrays = 0;
+    } else {
+      // Same bound as in TokenizeACProgressiveScan() for each block row, and
+      // the final EOB run token.
+      sp->tokens = Allocate<Token>(
+          cinfo, num_blocks * band_size + num_rows + 1, JPOOL_IMAGE);
+    }
+  }
+}
+
 namespace {
 
-struct Histogram {
-  int count[kJpegHuffmanAlphabetSize];
-  Histogram() { memset(count, 0, sizeof(count)); }
-};
+// Tokenizes the current iMCU row of a spooled scan into the scratch buffers of
+// its spool. comp_rows[c] are the block rows of component c in the iMCU row.
+void TokenizeSpooledScan(j_compress_ptr cinfo, int scan_index,
+                         const JBLOCKARRAY* comp_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  ScanTokenInfo* sti = &m->scan_token_info[scan_index];
+  ScanSpool* sp = &m->scan_spools[scan_index];
+  const int context = m->ac_ctx_offset[scan_index];
+  const size_t iMCU_y = m->next_iMCU_row;
+  if (scan_info->comps_in_scan > 1) {
+    JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
+    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+      blocks[i] = comp_rows[scan_info->component_index[i]];
+    }
+    sp->next_token =
+        TokenizeMCURow(cinfo, scan_info, context, iMCU_y, blocks, sp->tokens,
+                       sp->num_tokens, sti, &sp->mcu_state, sp->tokens);
+    return;
+  }
+  const int comp_idx = scan_info->component_index[0];
+  const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+  const JDIMENSION by0 = iMCU_y * comp->v_samp_factor;
+  const JDIMENSION by1 =
+      std::min<JDIMENSION>(by0 + comp->v_samp_factor, comp->height_in_blocks);
+  Token* next_token = sp->tokens;
+  for (JDIMENSION by = by0; by < by1; ++by) {
+    JBLOCKARRAY row = comp_rows[comp_idx] + (by - by0);
+    if (scan_info->Ss == 0) {
+      next_token =
+          TokenizeMCURow(cinfo, scan_info, context, by, &row, sp->tokens,
+                         sp->num_tokens, sti, &sp->mcu_state, next_token);
+    } else if (scan_info->Ah == 0) {
+      next_token = TokenizeACProgressiveRow(
+          scan_info, context, row[0], comp->width_in_blocks, sp->tokens,
+          sp->num_tokens, sti, &sp->ac_state, next_token);
+    } else {
+      TokenizeACRefinementRow(scan_info, row[0], comp->width_in_blocks,
+                              sp->ref_tokens, sp->num_tokens, sti,
+                              &sp->ref_state);
+    }
+  }
+  if (scan_info->Ss > 0 && scan_info->Ah == 0 && sp->ac_state.eob_run > 0 &&
+      iMCU_y + 1 == cinfo->total_iMCU_rows) {
+    next_token = EmitEOBRun(context, &sp->ac_state, next_token);
+  }
+  sp->next_token = next_token;
+}
 
-void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
+// Moves the final tokens of the current iMCU row of a spooled scan from the
+// scratch buffers of its spool to their own allocation.
+void AppendSpooledTokens(j_compress_ptr cinfo, int scan_index) {
   jpeg_comp_master* m = cinfo->master;
-  size_t num_token_arrays = m->cur_token_array + 1;
-  for (size_t i = 0; i < num_token_arrays; ++i) {
-    Token* tokens = m->token_arrays[i].tokens;
-    size_t num_tokens = m->token_arrays[i].num_tokens;
-    for (size_t j = 0; j < num_tokens; ++j) {
-      Token t = tokens[j];
-      ++histograms[t.context].count[t.symbol];
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  ScanTokenInfo* sti = &m->scan_token_info[scan_index];
+  ScanSpool* sp = &m->scan_spools[scan_index];
+  const bool is_last = m->next_iMCU_row + 1 == cinfo->total_iMCU_rows;
+  if (scan_info->Ss == 0 && scan_info->Ah > 0) {
+    if (is_last) {
+      sti->num_tokens = sti->num_blocks;
+      sti->restarts[sp->mcu_state.restart_idx++] = sti->num_blocks;
     }
+    return;
   }
-  for (int i = 0; i < cinfo->num_scans; ++i) {
-    const jpeg_scan_info& si = cinfo->scan_info[i];
-    const ScanTokenInfo& sti = m->scan_token_info[i];
-    if (si.Ss > 0 && si.Ah > 0) {
-      int context = m->ac_ctx_offset[i];
-      int* ac_histo = &histograms[context].count[0];
-      for (size_t j = 0; j < sti.num_tokens; ++j) {
-        ++ac_histo[sti.tokens[j].symbol & 253];
+  if (scan_info->Ss == 0 || scan_info->Ah == 0) {
+    size_t num_tokens = sp->next_token - sp->tokens;
+    if (num_tokens > 0) {
+      TokenArray* ta = &m->token_arrays[m->cur_token_array];
+      if (ta->tokens) {
+        m->total_num_tokens += ta->num_tokens;
+        ++m->cur_token_array;
+        ta = &m->token_arrays[m->cur_token_array];
       }
+      ta->tokens = Allocate<Token>(cinfo, num_tokens, JPOOL_IMAGE);
+      memcpy(ta->tokens, sp->tokens, num_tokens * sizeof(Token));
+      ta->num_tokens = num_tokens;
+      ta->scan_index = scan_index;
+      sp->num_tokens += num_tokens;
     }
+    if (is_last) {
+      size_t* restart_idx = scan_info->Ss == 0 ? &sp->mcu_state.restart_idx
+                                               : &sp->ac_state.restart_idx;
+      sti->num_tokens = sp->num_tokens;
+      sti->restarts[(*restart_idx)++] = sp->num_tokens;
+    }
+    return;
+  }
+  // The pending EOB run token of an AC refinement scan can still be extended
+  // by the next iMCU row, so it stays in the scratch buffers together with its
+  // refinement bits and EOB run extra bits.
+  RefScanState* state = &sp->ref_state;
+  const bool pending = !is_last && state->eob_run > 0;
+  const size_t num_pending_tokens = pending ? 1 : 0;
+  const size_t num_pending_bits = pending ? state->eob_refbits : 0;
+  const size_t num_pending_eobruns = pending && state->eob_run > 1 ? 1 : 0;
+  size_t num_tokens = state->next_token - sp->ref_tokens - num_pending_tokens;
+  size_t num_bits = state->next_ref_bit - sp->refbits - num_pending_bits;
+  size_t num_eobruns = state->next_eobrun - sp->eobruns - num_pending_eobruns;
+  if (num_tokens > 0) {
+    RefTokenArray* rta = &sti->ref_token_arrays[sti->num_ref_token_arrays++];
+    rta->tokens = Allocate<RefToken>(cinfo, num_tokens, JPOOL_IMAGE);
+    memcpy(rta->tokens, sp->ref_tokens, num_tokens * sizeof(RefToken));
+    rta->num_tokens = num_tokens;
+    rta->refbits = nullptr;
+    if (num_bits > 0) {
+      rta->refbits = Allocate<uint8_t>(cinfo, num_bits, JPOOL_IMAGE);
+      memcpy(rta->refbits, sp->refbits, num_bits);
+    }
+    rta->eobruns = nullptr;
+    if (num_eobruns > 0) {
+      rta->eobruns = Allocate<uint16_t>(cinfo, num_eobruns, JPOOL_IMAGE);
+      memcpy(rta->eobruns, sp->eobruns, num_eobruns * sizeof(uint16_t));
+    }
+    sp->num_tokens += num_tokens;
+  }
+  memmove(sp->ref_tokens, sp->ref_tokens + num_tokens,
+          num_pending_tokens * sizeof(RefToken));
+  memmove(sp->refbits, sp->refbits + num_bits, num_pending_bits);
+  memmove(sp->eobruns, sp->eobruns + num_eobruns,
+          num_pending_eobruns * sizeof(uint16_t));
+  state->next_token = sp->ref_tokens + num_pending_tokens;
+  state->next_eob_token = sp->ref_tokens;
+  state->next_ref_bit = sp->refbits + num_pending_bits;
+  state->next_eobrun = sp->eobruns + num_pending_eobruns;
+  if (is_last) {
+    sti->num_tokens = sp->num_tokens;
+    sti->restarts[state->restart_idx++] = sp->num_tokens;
   }
 }
 
-struct JpegClusteredHistograms {
-  std::vector<Histogram> histograms;
-  std::vector<uint32_t> histogram_indexes;
-  std::vector<uint32_t> slot_ids;
-};
+}  // namespace
+
+void TokenizeiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  // The block rows are looked up on this thread, since the virtual array
+  // access methods may not be thread-safe.
+  JBLOCKARRAY comp_rows[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    int by0 = m->next_iMCU_row * comp->v_samp_factor;
+    int block_rows_left = comp->height_in_blocks - by0;
+    int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+    comp_rows[c] = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], 0,
+        max_block_rows, FALSE);
+  }
+  if (m->runner != nullptr) {
+    const auto tokenize_scan = [&](uint32_t task, size_t /*thread*/) {
+      TokenizeSpooledScan(cinfo, task, comp_rows);
+      return true;
+    };
+    const auto no_init = [](size_t /*num_threads*/) { return true; };
+    RunOnPool(cinfo, m->runner, m->runner_opaque, 0, cinfo->num_scans, no_init,
+              tokenize_scan, "TokenizeiMCURow");
+  } else {
+    for (int i = 0; i < cinfo->num_scans; ++i) {
+      TokenizeSpooledScan(cinfo, i, comp_rows);
+    }
+  }
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    AppendSpooledTokens(cinfo, i);
+  }
+}
 
 float HistogramCost(const Histogram& histo) {
-  std::vector<uint32_t> counts(kJpegHuffmanAlphabetSize + 1);
-  std::vector<uint8_t> depths(kJpegHuffmanAlphabetSize + 1);
+  uint32_t counts[kJpegHuffmanAlphabetSize + 1];
+  // CreateHuffmanTree() only sets the depths of the used symbols.
+  uint8_t depths[kJpegHuffmanAlphabetSize + 1] = {};
   for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
     counts[i] = histo.count[i];
   }
   counts[kJpegHuffmanAlphabetSize] = 1;
-  CreateHuffmanTree(counts.data(), counts.size(), kJpegHuffmanMaxBitLength,
-                    depths.data());
+  CreateHuffmanTree(counts, kJpegHuffmanAlphabetSize + 1,
+                    kJpegHuffmanMaxBitLength, depths);
   size_t header_bits = (1 + kJpegHuffmanMaxBitLength) * 8;
   size_t data_bits = 0;
   for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
@@ -568,6 +1173,88 @@ float HistogramCost(const Histogram& histo) {
   return header_bits + data_bits;
 }
 
+namespace {
+
+// Number of tokens counted by one task of BuildHistogramsParallel().
+constexpr size_t kTokensPerHistogramTask = 1 << 16;
+
+// Builds per-thread histograms of chunks of the token arrays on m->runner and
+// adds them to histograms.
+void BuildHistogramsParallel(j_compress_ptr cinfo, Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t num_token_arrays = m->cur_token_array + 1;
+  std::vector<std::pair<const Token*, size_t>> chunks;
+  for (size_t i = 0; i < num_token_arrays; ++i) {
+    const Token* tokens = m->token_arrays[i].tokens;
+    size_t num_tokens = m->token_arrays[i].num_tokens;
+    for (size_t j = 0; j < num_tokens; j += kTokensPerHistogramTask) {
+      chunks.emplace_back(tokens + j,
+                          std::min(kTokensPerHistogramTask, num_tokens - j));
+    }
+  }
+  std::vector<std::vector<Histogram>> thread_histograms;
+  const auto init = [&](size_t num_threads) {
+    thread_histograms.resize(num_threads,
+                             std::vector<Histogram>(m->num_contexts));
+    return true;
+  };
+  const auto count_tokens = [&](uint32_t task, size_t thread) {
+    Histogram* histo = thread_histograms[thread].data();
+    const Token* tokens = chunks[task].first;
+    for (size_t j = 0; j < chunks[task].second; ++j) {
+      Token t = tokens[j];
+      ++histo[t.context].count[t.symbol];
+    }
+    return true;
+  };
+  RunOnPool(cinfo, m->runner, m->runner_opaque, 0, chunks.size(), init,
+            count_tokens, "BuildHistograms");
+  for (const auto& histos : thread_histograms) {
+    for (size_t c = 0; c < m->num_contexts; ++c) {
+      for (size_t k = 0; k < kJpegHuffmanAlphabetSize; ++k) {
+        histograms[c].count[k] += histos[c].count[k];
+      }
+    }
+  }
+}
+
+void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t num_token_arrays = m->cur_token_array + 1;
+  if (m->runner != nullptr) {
+    BuildHistogramsParallel(cinfo, histograms);
+  } else {
+    for (size_t i = 0; i < num_token_arrays; ++i) {
+      Token* tokens = m->token_arrays[i].tokens;
+      size_t num_tokens = m->token_arrays[i].num_tokens;
+      for (size_t j = 0; j < num_tokens; ++j) {
+        Token t = tokens[j];
+        ++histograms[t.context].count[t.symbol];
+      }
+    }
+  }
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    if (si.Ss > 0 && si.Ah > 0) {
+      int context = m->ac_ctx_offset[i];
+      int* ac_histo = &histograms[context].count[0];
+      for (size_t a = 0; a < sti.num_ref_token_arrays; ++a) {
+        const RefTokenArray& rta = sti.ref_token_arrays[a];
+        for (size_t j = 0; j < rta.num_tokens; ++j) {
+          ++ac_histo[rta.tokens[j].symbol & 253];
+        }
+      }
+    }
+  }
+}
+
+struct JpegClusteredHistograms {
+  std::vector<Histogram> histograms;
+  std::vector<uint32_t> histogram_indexes;
+  std::vector<uint32_t> slot_ids;
+};
+
 void AddHistograms(const Histogram& a, const Histogram& b, Histogram* c) {
   for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
     c->count[i] = a.count[i] + b.count[i];
@@ -842,5 +1529,84 @@ void InitEntropyCoder(j_compress_ptr cinfo) {
   }
 }
 
+size_t EstimateOutputSize(j_compress_ptr cinfo, const Histogram* histograms,
+                          size_t num_histograms, const JHUFF_TBL* tables,
+                          uint64_t num_refinement_bits) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t num_bytes = m->marker_bytes + FrameAndScanHeadersSize(cinfo);
+  uint64_t num_bits = num_refinement_bits;
+  for (size_t i = 0; i < num_histograms; ++i) {
+    const Histogram& histo = histograms[i];
+    for (int k = 0; k < kJpegHuffmanAlphabetSize; ++k) {
+      num_bits += static_cast<uint64_t>(histo.count[k]) * kNumExtraBits[k];
+    }
+    if (tables == nullptr) {
+      if (!IsEmptyHistogram(histo)) {
+        // Every Huffman code is counted with its own DHT marker, although
+        // some of them may share one.
+        num_bytes += 4;
+        num_bits += static_cast<uint64_t>(HistogramCost(histo));
+      }
+      continue;
+    }
+    const JHUFF_TBL& table = tables[i];
+    if (!table.sent_table) {
+      num_bytes += 4 + 1 + kJpegHuffmanMaxBitLength;
+    }
+    size_t p = 0;
+    for (size_t len = 1; len <= kJpegHuffmanMaxBitLength; ++len) {
+      if (!table.sent_table) num_bytes += table.bits[len];
+      for (int j = 0; j < table.bits[len]; ++j, ++p) {
+        num_bits += static_cast<uint64_t>(histo.count[table.huffval[p]]) * len;
+      }
+    }
+  }
+  size_t num_intervals = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    const size_t num_mcus = sti.MCUs_per_row * sti.MCU_rows_in_scan;
+    num_intervals += sti.restart_interval > 0
+                         ? DivCeil(num_mcus, sti.restart_interval)
+                         : 1;
+  }
+  // Every restart interval is padded to a byte boundary with 3.5 bits on
+  // average, and every byte is 0xFF with a probability of about 1/256, in
+  // which case it is followed by a stuffed zero byte.
+  size_t num_data_bytes = DivCeil(num_bits + 4 * num_intervals, 8);
+  num_bytes += num_data_bytes + num_data_bytes / 256;
+  // Restart markers between the restart intervals of each scan.
+  num_bytes += 2 * (num_intervals - cinfo->num_scans);
+  return num_bytes;
+}
+
+size_t EstimateTokenizedOutputSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<Histogram> histograms(m->num_contexts);
+  BuildHistograms(cinfo, histograms.data());
+  std::vector<Histogram> code_histograms(m->num_huffman_tables);
+  for (size_t c = 0; c < m->num_contexts; ++c) {
+    AddHistograms(code_histograms[m->context_map[c]], histograms[c],
+                  &code_histograms[m->context_map[c]]);
+  }
+  uint64_t num_refinement_bits = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    if (si.Ah > 0 && si.Ss > 0) {
+      for (size_t a = 0; a < sti.num_ref_token_arrays; ++a) {
+        const RefTokenArray& rta = sti.ref_token_arrays[a];
+        for (size_t j = 0; j < rta.num_tokens; ++j) {
+          num_refinement_bits += rta.tokens[j].refbits;
+        }
+      }
+    } else if (si.Ah > 0) {
+      num_refinement_bits += sti.num_tokens;
+    }
+  }
+  return EstimateOutputSize(cinfo, code_histograms.data(),
+                            code_histograms.size(), m->huffman_tables,
+                            num_refinement_bits);
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
@@ -8,11 +8,24 @@
 #define LIB_JPEGLI_ENTROPY_CODING_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
+struct Histogram {
+  int count[kJpegHuffmanAlphabetSize];
+  Histogram() { memset(count, 0, sizeof(count)); }
+};
+
+// Returns the number of bits of the symbols of the histogram coded with an
+// optimal length-limited Huffman code, plus the bits of the code lengths and
+// symbol values in the DHT marker, without the marker and length bytes.
+float HistogramCost(const Histogram& histo);
+
 size_t MaxNumTokensPerMCURow(j_compress_ptr cinfo);
 
 size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
@@ -20,12 +33,36 @@ size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
 
 void TokenizeJpeg(j_compress_ptr cinfo);
 
+// Allocates the tokenization state of the scans of an image whose scans are
+// tokenized one iMCU row at a time while the image is read, instead of by
+// TokenizeJpeg() after the whole image is quantized.
+void InitScanSpools(j_compress_ptr cinfo);
+
+// Tokenizes the coefficients of the current iMCU row for each scan.
+void TokenizeiMCURow(j_compress_ptr cinfo);
+
 void CopyHuffmanTables(j_compress_ptr cinfo);
 
 void OptimizeHuffmanCodes(j_compress_ptr cinfo);
 
 void InitEntropyCoder(j_compress_ptr cinfo);
 
+// Size model shared by jpegli_estimate_output_size() and the target size
+// search. Returns the estimated size of the whole output with the given
+// symbol histograms of the entropy coded data and num_refinement_bits other
+// bits, including the markers that were already written, the headers, the
+// DHT markers, the restart markers and the padding and stuffed zero bytes.
+// If tables is nullptr, every non-empty histogram is coded with its own
+// optimal Huffman code, otherwise histograms[i] is coded with tables[i].
+size_t EstimateOutputSize(j_compress_ptr cinfo, const Histogram* histograms,
+                          size_t num_histograms, const JHUFF_TBL* tables,
+                          uint64_t num_refinement_bits);
+
+// Returns EstimateOutputSize() for the tokens of all scans, coded with the
+// current Huffman codes. Must be called after the image is tokenized and the
+// Huffman codes are final.
+size_t EstimateTokenizedOutputSize(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENTROPY_CODING_H_
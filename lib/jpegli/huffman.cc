@@ -110,6 +110,34 @@ void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
   }
 }
 
+void BuildJpegHuffmanFastACTable(const HuffmanTableEntry* lut,
+                                 HuffmanFastACEntry* fast_lut) {
+  constexpr int kExtraRootBits =
+      kJpegHuffmanFastACBits - kJpegHuffmanRootTableBits;
+  for (int key = 0; key < kJpegHuffmanFastACSize; ++key) {
+    HuffmanFastACEntry* fast = &fast_lut[key];
+    fast->bits = 0;
+    const HuffmanTableEntry& code = lut[key >> kExtraRootBits];
+    if (code.bits == 0 || code.bits > kJpegHuffmanRootTableBits ||
+        code.value >= kJpegHuffmanAlphabetSize) {
+      continue;
+    }
+    int run = code.value >> 4;
+    int size = code.value & 15;
+    int nbits = code.bits + size;
+    if (size == 0 || nbits > kJpegHuffmanFastACBits) {
+      continue;
+    }
+    int extra = (key >> (kJpegHuffmanFastACBits - nbits)) & ((1 << size) - 1);
+    // Same as HuffExtend() in the scan decoder.
+    int coeff = extra >= (1 << (size - 1)) ? extra : extra - (1 << size) + 1;
+    fast->value = coeff;
+    fast->run = run;
+    fast->size = size;
+    fast->bits = nbits;
+  }
+}
+
 // A node of a Huffman tree.
 struct HuffmanTree {
   HuffmanTree(uint32_t count, int16_t left, int16_t right)
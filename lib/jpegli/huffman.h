@@ -37,6 +37,25 @@ struct HuffmanTableEntry {
 void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
                            HuffmanTableEntry* lut);
 
+// Number of bits looked up at once in the fast AC decoding table.
+constexpr int kJpegHuffmanFastACBits = 9;
+constexpr int kJpegHuffmanFastACSize = 1 << kJpegHuffmanFastACBits;
+
+// Decodes an AC symbol together with its extra bits in one table lookup, for
+// the symbols whose code and extra bits fit in kJpegHuffmanFastACBits bits.
+struct HuffmanFastACEntry {
+  int16_t value;  // coefficient value before the point transform
+  uint8_t run;    // number of zero coefficients before this one
+  uint8_t size;   // number of extra bits
+  uint8_t bits;   // total number of bits, or 0 if the slow path must be used
+};
+
+// Builds the fast AC decoding table from the lookup table built by
+// BuildJpegHuffmanTable(). End-of-band and ZRL symbols are left to the slow
+// path.
+void BuildJpegHuffmanFastACTable(const HuffmanTableEntry* lut,
+                                 HuffmanFastACEntry* fast_lut);
+
 // This function will create a Huffman tree.
 //
 // The (data,length) contains the population counts.
@@ -7,8 +7,11 @@
 #include "lib/jpegli/idct.h"
 
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/base/status.h"
@@ -33,8 +36,10 @@ using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::MulHigh;
 using hwy::HWY_NAMESPACE::NegMulAdd;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::Xor;
@@ -202,6 +207,105 @@ void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
   ComputeScaledIDCT(block0, block1, output, output_stride);
 }
 
+// Returns the N x 8 matrix that maps the 8 coefficients of a row or column to
+// the averages of the N groups of 8 / N consecutive samples of its IDCT,
+// followed by its transpose.
+template <size_t N>
+const float* DownsampledIDCTMatrix() {
+  static const std::array<float, 2 * N * 8> kMatrix = [] {
+    constexpr double kPi = 3.14159265358979323846;
+    constexpr size_t kGroupSize = 8 / N;
+    std::array<float, 2 * N * 8> matrix;
+    for (size_t i = 0; i < N; ++i) {
+      for (size_t u = 0; u < 8; ++u) {
+        double sum = 0.0;
+        for (size_t y = i * kGroupSize; y < (i + 1) * kGroupSize; ++y) {
+          sum += std::cos((2 * y + 1) * u * kPi / 16);
+        }
+        const double scale = u == 0 ? 1.0 : std::sqrt(2.0);
+        const float v = static_cast<float>(scale * sum / kGroupSize);
+        matrix[i * 8 + u] = v;
+        matrix[N * 8 + u * N + i] = v;
+      }
+    }
+    return matrix;
+  }();
+  return kMatrix.data();
+}
+
+// Computes the N x N downscaled output of a block, which is the box-filtered
+// 8x8 IDCT of the block, directly from the coefficients with one reduced
+// matrix multiplication in each direction.
+template <size_t N>
+void InverseTransformBlockDownsampled(const int16_t* JXL_RESTRICT qblock,
+                                      const float* JXL_RESTRICT dequant,
+                                      const float* JXL_RESTRICT biases,
+                                      float* JXL_RESTRICT scratch_space,
+                                      float* JXL_RESTRICT output,
+                                      size_t output_stride, size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  DequantBlock(qblock, dequant, biases, block0);
+  const float* JXL_RESTRICT matrix = DownsampledIDCTMatrix<N>();
+  const float* JXL_RESTRICT matrix_t = matrix + N * 8;
+  // Vertical pass, block1 is N x 8.
+  for (size_t i = 0; i < N; ++i) {
+    for (size_t x = 0; x < 8; x += Lanes(d8)) {
+      auto sum = Zero(d8);
+      for (size_t u = 0; u < 8; ++u) {
+        sum = MulAdd(Set(d8, matrix[i * 8 + u]), Load(d8, block0 + u * 8 + x),
+                     sum);
+      }
+      Store(sum, d8, block1 + i * 8 + x);
+    }
+  }
+  // Horizontal pass.
+  const HWY_CAPPED(float, N) dn;
+  for (size_t i = 0; i < N; ++i) {
+    for (size_t x = 0; x < N; x += Lanes(dn)) {
+      auto sum = Zero(dn);
+      for (size_t v = 0; v < 8; ++v) {
+        const auto m = LoadU(dn, matrix_t + v * N + x);
+        sum = MulAdd(Set(dn, block1[i * 8 + v]), m, sum);
+      }
+      StoreU(sum, dn, output + i * output_stride + x);
+    }
+  }
+}
+
+// Only the DC coefficient contributes to a 1x1 output, this computes the same
+// value for it as DequantBlock().
+void InverseTransformBlock1x1(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  const float quant = qblock[0];
+  const float bias = quant < 0 ? -biases[0] : biases[0];
+  *output = quant == 0 ? 0.0f : (quant - bias) * dequant[0];
+}
+
+void InverseTransformBlock2x2(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  InverseTransformBlockDownsampled<2>(qblock, dequant, biases, scratch_space,
+                                      output, output_stride, dctsize);
+}
+
+void InverseTransformBlock4x4(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  InverseTransformBlockDownsampled<4>(qblock, dequant, biases, scratch_space,
+                                      output, output_stride, dctsize);
+}
+
 // Computes the N-point IDCT of in[], and stores the result in out[]. The in[]
 // array is at most 8 values long, values in[8:N-1] are assumed to be 0.
 void Compute1dIDCT(const float* in, float* out, size_t N) {
@@ -630,51 +734,248 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
-  if (dctsize == 1) {
-    *output = *block0;
-  } else if (dctsize == 2 || dctsize == 4) {
-    float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
-    ComputeScaledIDCT(block0, block1, block2, 8);
-    if (dctsize == 4) {
-      for (size_t iy = 0; iy < 4; ++iy) {
-        for (size_t ix = 0; ix < 4; ++ix) {
-          float* block = &block2[16 * iy + 2 * ix];
-          output[iy * output_stride + ix] =
-              0.25f * (block[0] + block[1] + block[8] + block[9]);
-        }
-      }
-    } else {
-      for (size_t iy = 0; iy < 2; ++iy) {
-        for (size_t ix = 0; ix < 2; ++ix) {
-          float* block = &block2[32 * iy + 4 * ix];
-          output[iy * output_stride + ix] =
-              0.0625f *
-              (block[0] + block[1] + block[2] + block[3] + block[8] + block[9] +
-               block[10] + block[11] + block[16] + block[17] + block[18] +
-               block[19] + block[24] + block[25] + block[26] + block[27]);
-        }
+  float dctin[DCTSIZE];
+  float dctout[DCTSIZE * 2];
+  size_t insize = std::min<size_t>(dctsize, DCTSIZE);
+  for (size_t ix = 0; ix < insize; ++ix) {
+    for (size_t iy = 0; iy < insize; ++iy) {
+      dctin[iy] = block0[iy * DCTSIZE + ix];
+    }
+    Compute1dIDCT(dctin, dctout, dctsize);
+    for (size_t iy = 0; iy < dctsize; ++iy) {
+      block1[iy * dctsize + ix] = dctout[iy];
+    }
+  }
+  for (size_t iy = 0; iy < dctsize; ++iy) {
+    Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride, dctsize);
+  }
+}
+
+// Multiplications of int16 lanes by the constants of the AAN IDCT, using
+// (a * b) >> 16 for the fractional parts.
+template <class V>
+V IntMul1414(V v) {
+  const hwy::HWY_NAMESPACE::DFromV<V> d16;
+  return Add(v, MulHigh(v, Set(d16, 27146)));
+}
+template <class V>
+V IntMul1848(V v) {
+  const hwy::HWY_NAMESPACE::DFromV<V> d16;
+  const auto t = MulHigh(v, Set(d16, 27779));
+  return Add(v, Add(t, t));
+}
+template <class V>
+V IntMul1082(V v) {
+  const hwy::HWY_NAMESPACE::DFromV<V> d16;
+  return Add(v, MulHigh(v, Set(d16, 5400)));
+}
+template <class V>
+V IntMul2613(V v) {
+  const hwy::HWY_NAMESPACE::DFromV<V> d16;
+  const auto t = MulHigh(v, Set(d16, 20091));
+  return Add(Add(v, v), Add(t, t));
+}
+
+// One dimensional AAN IDCT (as in libjpeg's jidctfst.c) of the 8 vectors in
+// v[], computed lane-wise, with a gain of sqrt(8) compared to the orthonormal
+// IDCT if the inputs are pre-multiplied with the AAN scale factors.
+template <class V>
+void IntIDCT1D(V* JXL_RESTRICT v) {
+  // Even part.
+  const auto tmp10 = Add(v[0], v[4]);
+  const auto tmp11 = Sub(v[0], v[4]);
+  const auto tmp13 = Add(v[2], v[6]);
+  const auto tmp12 = Sub(IntMul1414(Sub(v[2], v[6])), tmp13);
+  const auto even0 = Add(tmp10, tmp13);
+  const auto even3 = Sub(tmp10, tmp13);
+  const auto even1 = Add(tmp11, tmp12);
+  const auto even2 = Sub(tmp11, tmp12);
+  // Odd part.
+  const auto z13 = Add(v[5], v[3]);
+  const auto z10 = Sub(v[5], v[3]);
+  const auto z11 = Add(v[1], v[7]);
+  const auto z12 = Sub(v[1], v[7]);
+  const auto odd7 = Add(z11, z13);
+  const auto odd11 = IntMul1414(Sub(z11, z13));
+  const auto z5 = IntMul1848(Add(z10, z12));
+  const auto odd10 = Sub(IntMul1082(z12), z5);
+  const auto odd12 = Sub(z5, IntMul2613(z10));
+  const auto odd6 = Sub(odd12, odd7);
+  const auto odd5 = Sub(odd11, odd6);
+  const auto odd4 = Add(odd10, odd5);
+  v[0] = Add(even0, odd7);
+  v[7] = Sub(even0, odd7);
+  v[1] = Add(even1, odd6);
+  v[6] = Sub(even1, odd6);
+  v[2] = Add(even2, odd5);
+  v[5] = Sub(even2, odd5);
+  v[4] = Add(even3, odd4);
+  v[3] = Sub(even3, odd4);
+}
+
+// The dequantization and the conversion of the output to float are done on
+// 32-bit lanes, one half block row at a time on 128-bit vectors.
+using DI32x8 = HWY_CAPPED(int32_t, 8);
+using DI16x8 = Rebind<int16_t, DI32x8>;
+using DF32x8 = Rebind<float, DI32x8>;
+
+// Dequantizes the coefficients of row k of the block with the multipliers
+// computed by ChooseInverseTransform() and stores them as int16 values.
+void IntDequantRow(const int16_t* JXL_RESTRICT qblock,
+                   const int32_t* JXL_RESTRICT dequant, size_t k,
+                   int16_t* JXL_RESTRICT out) {
+  const DI32x8 di32;
+  const DI16x8 di16;
+  const auto round = Set(di32, 1 << (kIntDequantBits - 1));
+  for (size_t x = 0; x < 8; x += Lanes(di32)) {
+    const auto coeffs = PromoteTo(di32, LoadU(di16, qblock + 8 * k + x));
+    const auto mul = LoadU(di32, dequant + 8 * k + x);
+    const auto deq = Add(Mul(coeffs, mul), round);
+    StoreU(DemoteTo(di16, ShiftRight<kIntDequantBits>(deq)), di16, out + x);
+  }
+}
+
+// Converts one row of the output of the two IDCT passes, which is
+// 8 * 2^kIntDequantScaleBits times the centered sample value, to the [-0.5,
+// 0.5] range of the float pipeline.
+void IntOutputRow(const int16_t* JXL_RESTRICT in, float* JXL_RESTRICT out) {
+  const DI32x8 di32;
+  const DI16x8 di16;
+  const DF32x8 df32;
+  const auto scale =
+      Set(df32, 1.0f / (255 * 8 * (1 << kIntDequantScaleBits)));
+  for (size_t x = 0; x < 8; x += Lanes(di32)) {
+    const auto pixels = PromoteTo(di32, LoadU(di16, in + x));
+    StoreU(Mul(ConvertTo(df32, pixels), scale), df32, out + x);
+  }
+}
+
+#if HWY_TARGET != HWY_SCALAR
+
+// Up to four blocks are transformed together, each in its own 128-bit part of
+// the vectors.
+using DI16 = HWY_CAPPED(int16_t, 32);
+
+// Transposes the 8x8 blocks of int16 values that are stored one row per
+// vector in each 128-bit part of v[].
+void TransposeInt8x8Blocks(Vec<DI16>* JXL_RESTRICT v) {
+  const DI16 d16;
+  const hwy::HWY_NAMESPACE::RepartitionToWide<DI16> d32;
+  const hwy::HWY_NAMESPACE::RepartitionToWide<decltype(d32)> d64;
+  const auto a0 = BitCast(d32, InterleaveLower(d16, v[0], v[1]));
+  const auto a1 = BitCast(d32, InterleaveUpper(d16, v[0], v[1]));
+  const auto a2 = BitCast(d32, InterleaveLower(d16, v[2], v[3]));
+  const auto a3 = BitCast(d32, InterleaveUpper(d16, v[2], v[3]));
+  const auto a4 = BitCast(d32, InterleaveLower(d16, v[4], v[5]));
+  const auto a5 = BitCast(d32, InterleaveUpper(d16, v[4], v[5]));
+  const auto a6 = BitCast(d32, InterleaveLower(d16, v[6], v[7]));
+  const auto a7 = BitCast(d32, InterleaveUpper(d16, v[6], v[7]));
+  const auto b0 = BitCast(d64, InterleaveLower(d32, a0, a2));
+  const auto b1 = BitCast(d64, InterleaveUpper(d32, a0, a2));
+  const auto b2 = BitCast(d64, InterleaveLower(d32, a1, a3));
+  const auto b3 = BitCast(d64, InterleaveUpper(d32, a1, a3));
+  const auto b4 = BitCast(d64, InterleaveLower(d32, a4, a6));
+  const auto b5 = BitCast(d64, InterleaveUpper(d32, a4, a6));
+  const auto b6 = BitCast(d64, InterleaveLower(d32, a5, a7));
+  const auto b7 = BitCast(d64, InterleaveUpper(d32, a5, a7));
+  v[0] = BitCast(d16, InterleaveLower(d64, b0, b4));
+  v[1] = BitCast(d16, InterleaveUpper(d64, b0, b4));
+  v[2] = BitCast(d16, InterleaveLower(d64, b1, b5));
+  v[3] = BitCast(d16, InterleaveUpper(d64, b1, b5));
+  v[4] = BitCast(d16, InterleaveLower(d64, b2, b6));
+  v[5] = BitCast(d16, InterleaveUpper(d64, b2, b6));
+  v[6] = BitCast(d16, InterleaveLower(d64, b3, b7));
+  v[7] = BitCast(d16, InterleaveUpper(d64, b3, b7));
+}
+
+// Fixed-point version of InverseTransformBlock8x8() used in the fast decoding
+// mode, for num_blocks consecutive blocks of a block row. The IDCT is done on
+// int16 lanes, with as many blocks per vector as there are 128-bit parts, so
+// that it processes two blocks at a time on AVX2 and four on AVX-512, where
+// the floating point IDCT processes one block row at a time.
+void InverseTransformBlocks8x8Int(const int16_t* JXL_RESTRICT qblocks,
+                                  size_t num_blocks,
+                                  const int32_t* JXL_RESTRICT dequant,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride) {
+  const DI16 d16;
+  const size_t lanes = Lanes(d16);
+  const size_t blocks_per_vector = lanes / 8;
+  HWY_ALIGN int16_t rows[8 * MaxLanes(d16)];
+  Vec<DI16> v[8];
+  for (size_t b0 = 0; b0 < num_blocks; b0 += blocks_per_vector) {
+    const size_t n = std::min(blocks_per_vector, num_blocks - b0);
+    // The last block is repeated in the unused parts of the vectors.
+    for (size_t b = 0; b < blocks_per_vector; ++b) {
+      const int16_t* qblock = qblocks + (b0 + std::min(b, n - 1)) * DCTSIZE2;
+      for (size_t k = 0; k < 8; ++k) {
+        IntDequantRow(qblock, dequant, k, rows + k * lanes + 8 * b);
       }
     }
-  } else {
-    float dctin[DCTSIZE];
-    float dctout[DCTSIZE * 2];
-    size_t insize = std::min<size_t>(dctsize, DCTSIZE);
-    for (size_t ix = 0; ix < insize; ++ix) {
-      for (size_t iy = 0; iy < insize; ++iy) {
-        dctin[iy] = block0[iy * DCTSIZE + ix];
+    for (size_t k = 0; k < 8; ++k) {
+      v[k] = Load(d16, rows + k * lanes);
+    }
+    IntIDCT1D(v);
+    TransposeInt8x8Blocks(v);
+    IntIDCT1D(v);
+    TransposeInt8x8Blocks(v);
+    for (size_t k = 0; k < 8; ++k) {
+      Store(v[k], d16, rows + k * lanes);
+    }
+    for (size_t b = 0; b < n; ++b) {
+      for (size_t y = 0; y < 8; ++y) {
+        IntOutputRow(rows + y * lanes + 8 * b,
+                     output + (b0 + b) * DCTSIZE + y * output_stride);
       }
-      Compute1dIDCT(dctin, dctout, dctsize);
-      for (size_t iy = 0; iy < dctsize; ++iy) {
-        block1[iy * dctsize + ix] = dctout[iy];
+    }
+  }
+}
+
+#else
+
+void TransposeInt8x8(const int16_t* JXL_RESTRICT from,
+                     int16_t* JXL_RESTRICT to) {
+  for (size_t y = 0; y < 8; ++y) {
+    for (size_t x = 0; x < 8; ++x) {
+      to[x * 8 + y] = from[y * 8 + x];
+    }
+  }
+}
+
+void InverseTransformBlocks8x8Int(const int16_t* JXL_RESTRICT qblocks,
+                                  size_t num_blocks,
+                                  const int32_t* JXL_RESTRICT dequant,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride) {
+  const HWY_CAPPED(int16_t, 1) d16;
+  int16_t block0[DCTSIZE2];
+  int16_t block1[DCTSIZE2];
+  Vec<decltype(d16)> v[8];
+  for (size_t b = 0; b < num_blocks; ++b) {
+    for (size_t k = 0; k < 8; ++k) {
+      IntDequantRow(qblocks + b * DCTSIZE2, dequant, k, block0 + 8 * k);
+    }
+    for (size_t pass = 0; pass < 2; ++pass) {
+      for (size_t x = 0; x < 8; ++x) {
+        for (size_t k = 0; k < 8; ++k) {
+          v[k] = LoadU(d16, block0 + 8 * k + x);
+        }
+        IntIDCT1D(v);
+        for (size_t k = 0; k < 8; ++k) {
+          StoreU(v[k], d16, block0 + 8 * k + x);
+        }
       }
+      TransposeInt8x8(block0, block1);
+      memcpy(block0, block1, sizeof(block0));
     }
-    for (size_t iy = 0; iy < dctsize; ++iy) {
-      Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
-                    dctsize);
+    for (size_t y = 0; y < 8; ++y) {
+      IntOutputRow(block0 + 8 * y, output + b * DCTSIZE + y * output_stride);
     }
   }
 }
 
+#endif  // HWY_TARGET != HWY_SCALAR
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -685,6 +986,32 @@ namespace jpegli {
 
 HWY_EXPORT(InverseTransformBlock8x8);
 HWY_EXPORT(InverseTransformBlockGeneric);
+HWY_EXPORT(InverseTransformBlocks8x8Int);
+HWY_EXPORT(InverseTransformBlock1x1);
+HWY_EXPORT(InverseTransformBlock2x2);
+HWY_EXPORT(InverseTransformBlock4x4);
+
+namespace {
+
+// Computes the multipliers of the fixed-point IDCT, which are the quantization
+// steps scaled by the AAN scale factors, and returns false if they do not fit
+// into the 32-bit dequantization.
+bool ComputeIntDequant(const JQUANT_TBL* table, int32_t* dequant) {
+  constexpr double kPi = 3.14159265358979323846;
+  double aan_scales[DCTSIZE];
+  for (size_t k = 0; k < DCTSIZE; ++k) {
+    aan_scales[k] = k == 0 ? 1.0 : std::cos(k * kPi / 16) * std::sqrt(2.0);
+  }
+  const double mul = 1 << (kIntDequantBits + kIntDequantScaleBits);
+  for (size_t k = 0; k < DCTSIZE2; ++k) {
+    double v = table->quantval[k] * aan_scales[k / 8] * aan_scales[k % 8] * mul;
+    if (v >= (1u << 31)) return false;
+    dequant[k] = static_cast<int32_t>(std::lround(v));
+  }
+  return true;
+}
+
+}  // namespace
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
@@ -693,8 +1020,21 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     if (dct_size < 1 || dct_size > 16) {
       return JXL_FAILURE("Compute1dIDCT does not support N=%d", dct_size);
     }
+    m->int_inverse_transform[c] = nullptr;
+    const JQUANT_TBL* table = cinfo->comp_info[c].quant_table;
+    if (m->decode_speed_ > 0 && dct_size == DCTSIZE && table != nullptr &&
+        ComputeIntDequant(table, &m->int_dequant_[c * DCTSIZE2])) {
+      m->int_inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformBlocks8x8Int);
+    }
     if (dct_size == DCTSIZE) {
       m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    } else if (dct_size == 1) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
+    } else if (dct_size == 2) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2);
+    } else if (dct_size == 4) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4);
     } else {
       m->inverse_transform[c] =
           HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
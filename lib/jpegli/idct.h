@@ -12,6 +12,12 @@
 
 namespace jpegli {
 
+// Fixed-point precision of the dequantization multipliers of the fast decoding
+// mode, and the number of extra bits of precision kept in the dequantized
+// coefficients.
+constexpr int kIntDequantBits = 12;
+constexpr int kIntDequantScaleBits = 2;
+
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo);
 
 }  // namespace jpegli
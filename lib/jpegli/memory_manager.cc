@@ -7,16 +7,21 @@
 #include "lib/jpegli/memory_manager.h"
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
-#include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
 #include <vector>
 
+#include "lib/base/sanitizer_definitions.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/error.h"
 
+#if JXL_ADDRESS_SANITIZER
+#include <sanitizer/asan_interface.h>
+#endif
+
 struct jvirt_sarray_control {
   JSAMPARRAY full_buffer;
   size_t numrows;
@@ -33,14 +38,80 @@ namespace jpegli {
 
 namespace {
 
+// Allocations are carved from slabs of this size, except for the ones that
+// are larger than a quarter of it, which get their own memory block.
+constexpr size_t kSlabSize = 1 << 16;
+constexpr size_t kMaxCarvedSize = kSlabSize / 4;
+constexpr size_t kUnalignedPoolAlignment = alignof(std::max_align_t);
+
+struct MemoryBlock {
+  uint8_t* data;
+  size_t size;
+  // Free function and opaque pointer of the allocator of the block.
+  hwy::FreePtr free_func;
+  void* opaque;
+};
+
+struct MemoryPool {
+  // All memory blocks owned by this pool, allocated with the aligned
+  // allocator.
+  std::vector<MemoryBlock> blocks;
+  // Unused part of the current slab.
+  uint8_t* next = nullptr;
+  size_t avail = 0;
+};
+
 struct MemoryManager {
   struct jpeg_memory_mgr pub;
-  std::vector<void*> owned_ptrs[2 * JPOOL_NUMPOOLS];
-  uint64_t pool_memory_usage[2 * JPOOL_NUMPOOLS];
+  MemoryPool pools[JPOOL_NUMPOOLS];
+  uint64_t pool_memory_usage[JPOOL_NUMPOOLS];
   uint64_t total_memory_usage;
   uint64_t peak_memory_usage;
+  // Maximum size of the memory block that is kept for the next image when
+  // the image pool is freed.
+  size_t max_retained_image_memory;
+  // Allocator of the memory blocks, nullptr for the default one.
+  hwy::AllocPtr alloc_func;
+  hwy::FreePtr free_func;
+  void* alloc_opaque;
 };
 
+// The parts of the slabs that are not handed out by Alloc() are poisoned, so
+// that the address sanitizer reports accesses beyond the end of the carved
+// allocations as it would for separately allocated objects.
+void PoisonMemory(const uint8_t* p, size_t size) {
+#if JXL_ADDRESS_SANITIZER
+  ASAN_POISON_MEMORY_REGION(p, size);
+#endif
+}
+
+void UnpoisonMemory(const uint8_t* p, size_t size) {
+#if JXL_ADDRESS_SANITIZER
+  ASAN_UNPOISON_MEMORY_REGION(p, size);
+#endif
+}
+
+uint8_t* AllocateBlock(j_common_ptr cinfo, MemoryPool* pool, size_t size) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  void* p = hwy::AllocateAlignedBytes(size, mem->alloc_func, mem->alloc_opaque);
+  if (p == nullptr) {
+    JPEGLI_ERROR("Out of memory");
+  }
+  pool->blocks.push_back({static_cast<uint8_t*>(p), size, mem->free_func,
+                          mem->alloc_opaque});
+  return static_cast<uint8_t*>(p);
+}
+
+void ReleaseBlocks(MemoryPool* pool) {
+  for (const MemoryBlock& block : pool->blocks) {
+    UnpoisonMemory(block.data, block.size);
+    hwy::FreeAlignedBytes(block.data, block.free_func, block.opaque);
+  }
+  pool->blocks.clear();
+  pool->next = nullptr;
+  pool->avail = 0;
+}
+
 void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= 2 * JPOOL_NUMPOOLS) {
@@ -52,16 +123,27 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
     JPEGLI_ERROR("Total memory usage exceeding %ld",
                  mem->pub.max_memory_to_use);
   }
-  void* p;
-  if (pool_id < JPOOL_NUMPOOLS) {
-    p = malloc(sizeofobject);
+  const size_t alignment =
+      pool_id < JPOOL_NUMPOOLS ? kUnalignedPoolAlignment : HWY_ALIGNMENT;
+  pool_id %= JPOOL_NUMPOOLS;
+  MemoryPool* pool = &mem->pools[pool_id];
+  size_t padding = (alignment - reinterpret_cast<uintptr_t>(pool->next) %
+                                    alignment) %
+                   alignment;
+  uint8_t* p;
+  if (pool->next != nullptr && padding + sizeofobject <= pool->avail) {
+    p = pool->next + padding;
+    pool->next += padding + sizeofobject;
+    pool->avail -= padding + sizeofobject;
+    UnpoisonMemory(p, sizeofobject);
+  } else if (sizeofobject > kMaxCarvedSize) {
+    p = AllocateBlock(cinfo, pool, sizeofobject);
   } else {
-    p = hwy::AllocateAlignedBytes(sizeofobject, nullptr, nullptr);
+    p = AllocateBlock(cinfo, pool, kSlabSize);
+    pool->next = p + sizeofobject;
+    pool->avail = kSlabSize - sizeofobject;
+    PoisonMemory(pool->next, pool->avail);
   }
-  if (p == nullptr) {
-    JPEGLI_ERROR("Out of memory");
-  }
-  mem->owned_ptrs[pool_id].push_back(p);
   mem->pool_memory_usage[pool_id] += sizeofobject;
   mem->total_memory_usage += sizeofobject;
   mem->peak_memory_usage =
@@ -130,32 +212,39 @@ T** AccessVirtualArray(j_common_ptr cinfo, Control* ptr, JDIMENSION start_row,
   return ptr->full_buffer + start_row;
 }
 
-void ClearPool(j_common_ptr cinfo, int pool_id) {
-  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
-  mem->owned_ptrs[pool_id].clear();
-  mem->total_memory_usage -= mem->pool_memory_usage[pool_id];
-  mem->pool_memory_usage[pool_id] = 0;
-}
-
 void FreePool(j_common_ptr cinfo, int pool_id) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
   }
-  for (void* ptr : mem->owned_ptrs[pool_id]) {
-    free(ptr);
+  MemoryPool* pool = &mem->pools[pool_id];
+  mem->total_memory_usage -= mem->pool_memory_usage[pool_id];
+  mem->pool_memory_usage[pool_id] = 0;
+  size_t total_size = 0;
+  for (const MemoryBlock& block : pool->blocks) {
+    total_size += block.size;
+  }
+  if (pool_id != JPOOL_IMAGE || total_size == 0 ||
+      total_size > mem->max_retained_image_memory) {
+    ReleaseBlocks(pool);
+    return;
   }
-  ClearPool(cinfo, pool_id);
-  for (void* ptr : mem->owned_ptrs[JPOOL_NUMPOOLS + pool_id]) {
-    hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
+  // Keep one block that is large enough to hold all the allocations of an
+  // image of similar size, so that the next image can be processed without
+  // any further allocations.
+  if (pool->blocks.size() > 1) {
+    ReleaseBlocks(pool);
+    AllocateBlock(cinfo, pool, total_size);
   }
-  ClearPool(cinfo, JPOOL_NUMPOOLS + pool_id);
+  pool->next = pool->blocks[0].data;
+  pool->avail = pool->blocks[0].size;
+  PoisonMemory(pool->next, pool->avail);
 }
 
 void SelfDestruct(j_common_ptr cinfo) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
-  for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
-    FreePool(cinfo, pool_id);
+  for (MemoryPool& pool : mem->pools) {
+    ReleaseBlocks(&pool);
   }
   delete mem;
   cinfo->mem = nullptr;
@@ -183,8 +272,25 @@ void InitMemoryManager(j_common_ptr cinfo) {
   mem->pub.max_memory_to_use = 0;
   mem->total_memory_usage = 0;
   mem->peak_memory_usage = 0;
+  mem->max_retained_image_memory = 0;
+  mem->alloc_func = nullptr;
+  mem->free_func = nullptr;
+  mem->alloc_opaque = nullptr;
   memset(mem->pool_memory_usage, 0, sizeof(mem->pool_memory_usage));
   cinfo->mem = reinterpret_cast<struct jpeg_memory_mgr*>(mem);
 }
 
+void SetMaxRetainedImageMemory(j_common_ptr cinfo, size_t max_bytes) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->max_retained_image_memory = max_bytes;
+}
+
+void SetBlockAllocator(j_common_ptr cinfo, hwy::AllocPtr alloc_func,
+                       hwy::FreePtr free_func, void* opaque) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->alloc_func = alloc_func;
+  mem->free_func = free_func;
+  mem->alloc_opaque = opaque;
+}
+
 }  // namespace jpegli
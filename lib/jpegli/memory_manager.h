@@ -8,6 +8,7 @@
 #define LIB_JPEGLI_MEMORY_MANAGER_H_
 
 #include <cstdlib>
+#include <hwy/aligned_allocator.h>
 
 #include "lib/jpegli/common.h"
 
@@ -18,6 +19,11 @@ namespace jpegli {
 
 void InitMemoryManager(j_common_ptr cinfo);
 
+void SetMaxRetainedImageMemory(j_common_ptr cinfo, size_t max_bytes);
+
+void SetBlockAllocator(j_common_ptr cinfo, hwy::AllocPtr alloc_func,
+                       hwy::FreePtr free_func, void* opaque);
+
 template <typename T>
 T* Allocate(j_common_ptr cinfo, size_t len, int pool_id = JPOOL_PERMANENT) {
   const size_t size = len * sizeof(T);  // NOLINT
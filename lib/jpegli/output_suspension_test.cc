@@ -187,6 +187,57 @@ TEST_P(OutputSuspensionTestParam, RawData) {
   VerifyOutputImage(input, output, 3.5);
 }
 
+TEST(OutputSuspensionTest, FinishCompressSuspending) {
+  for (size_t bufsize : {1, 16, 16 << 10}) {
+    for (int progressive_level : {0, 2}) {
+      jpeg_compress_struct cinfo = {};
+      TestImage input;
+      input.xsize = 257;
+      input.ysize = 265;
+      GeneratePixels(&input);
+      DestinationManager dest;
+      std::vector<uint8_t> compressed;
+      size_t num_suspensions = 0;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        cinfo.dest = reinterpret_cast<jpeg_destination_mgr*>(&dest);
+        cinfo.image_width = input.xsize;
+        cinfo.image_height = input.ysize;
+        cinfo.input_components = input.components;
+        cinfo.in_color_space = JCS_RGB;
+        jpegli_set_defaults(&cinfo);
+        jpegli_set_progressive_level(&cinfo, progressive_level);
+        cinfo.optimize_coding = TRUE;
+        jpegli_start_compress(&cinfo, TRUE);
+        size_t stride = cinfo.image_width * cinfo.input_components;
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row = &input.pixels[cinfo.next_scanline * stride];
+          jpegli_write_scanlines(&cinfo, &row, 1);
+        }
+        // The whole bitstream is written in jpegli_finish_compress*(), since
+        // the Huffman codes are optimized.
+        dest.EmptyTo(&compressed, bufsize);
+        while (!jpegli_finish_compress_suspending(&cinfo)) {
+          dest.EmptyTo(&compressed);
+          ++num_suspensions;
+        }
+        dest.EmptyTo(&compressed);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      if (bufsize < compressed.size()) {
+        EXPECT_GT(num_suspensions, 0u);
+      }
+      TestImage output;
+      DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed,
+                        &output);
+      VerifyOutputImage(input, output, 2.5);
+    }
+  }
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   const size_t xsize0 = 1920;
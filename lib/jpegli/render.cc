@@ -70,6 +70,9 @@ using DI = HWY_FULL(int32_t);
 constexpr D d;
 constexpr DI di;
 
+// Number of columns rendered together by RenderRowToUint8().
+constexpr size_t kRenderTileSize = 512;
+
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
                       int32_t* JXL_RESTRICT sumabs) {
@@ -231,7 +234,7 @@ void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
       uint8_t* pixel = &scratch_space[num_channels * i];
       if (dither_mode == JDITHER_FS) {
         for (size_t c = 0; c < num_channels; ++c) {
-          float val = rows[c][i] * mul + LimitError(error_row[c][i]);
+          float val = rows[c][xoffset + i] * mul + LimitError(error_row[c][i]);
           pixel[c] = std::round(std::min(255.0f, std::max(0.0f, val)));
         }
       }
@@ -280,6 +283,71 @@ void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
   }
 }
 
+// Color converts, decenters and writes the rendered columns [xbegin, xbegin +
+// xsize) of one row to the 8-bit output, one tile of columns at a time, so
+// that the planes of the tile stay in L1 cache between the stages. Full
+// vectors of pixels are stored directly to the output scanline, only the
+// last few pixels go through the output scratch buffer.
+void RenderRowToUint8(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
+                      size_t xbegin, size_t xsize,
+                      uint8_t* JXL_RESTRICT output) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t num_channels = cinfo->out_color_components;
+  const int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  const size_t out_begin = m->xoffset_;
+  const size_t out_end = m->xoffset_ + cinfo->output_width;
+  const float mul = 255.0f;
+  float* tile_rows[kMaxComponents];
+  // Output pixels before this column are already stored.
+  size_t stored = out_begin;
+  for (size_t x0 = xbegin; x0 < xbegin + xsize; x0 += kRenderTileSize) {
+    const size_t x1 = std::min(x0 + kRenderTileSize, xbegin + xsize);
+    for (int c = 0; c < num_all_components; ++c) {
+      tile_rows[c] = rows[c] + x0;
+    }
+    (*m->color_transform)(tile_rows, x1 - x0);
+    for (size_t c = 0; c < num_channels; ++c) {
+      DecenterRow(tile_rows[c], x1 - x0);
+    }
+    // Store whole groups of 8 pixels, since StoreUnsignedRow() writes full
+    // vectors of pixels.
+    const size_t ready = std::min(x1, out_end);
+    if (ready >= stored + 8) {
+      const size_t len = (ready - stored) & ~size_t{7};
+      StoreUnsignedRow(rows, stored, len, num_channels, mul,
+                       &output[(stored - out_begin) * num_channels]);
+      stored += len;
+    }
+  }
+  if (stored < out_end) {
+    const size_t len = out_end - stored;
+    StoreUnsignedRow(rows, stored, len, num_channels, mul, m->output_scratch_);
+    memcpy(&output[(stored - out_begin) * num_channels], m->output_scratch_,
+           len * num_channels);
+  }
+}
+
+// Computes out[x] = sum_{r,c} weights[5 * r + c] * dc_rows[r][x + c] for x in
+// [begin, end), where dc_rows[r] starts at dc_rows + r * stride. The rows and
+// the output must be readable and writable up to a full vector after end.
+void ComputeSmoothingSums(const int32_t* JXL_RESTRICT dc_rows, size_t stride,
+                          const int32_t* JXL_RESTRICT weights, size_t begin,
+                          size_t end, int32_t* JXL_RESTRICT out) {
+  for (size_t x = begin; x < end; x += Lanes(di)) {
+    Vec<DI> sum = Zero(di);
+    for (int r = 0; r < 5; ++r) {
+      const int32_t* JXL_RESTRICT row = dc_rows + r * stride + x;
+      for (int c = 0; c < 5; ++c) {
+        const int32_t w = weights[5 * r + c];
+        if (w == 0) continue;
+        sum = Add(sum, Mul(Set(di, w), LoadU(di, row + c)));
+      }
+    }
+    StoreU(sum, di, out + x);
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -292,6 +360,8 @@ namespace jpegli {
 HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
+HWY_EXPORT(ComputeSmoothingSums);
+HWY_EXPORT(RenderRowToUint8);
 
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
@@ -310,8 +380,23 @@ void DecenterRow(float* row, size_t xsize) {
   HWY_DYNAMIC_DISPATCH(DecenterRow)(row, xsize);
 }
 
+void RenderRowToUint8(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
+                      size_t xbegin, size_t xsize,
+                      uint8_t* JXL_RESTRICT output) {
+  HWY_DYNAMIC_DISPATCH(RenderRowToUint8)(cinfo, rows, xbegin, xsize, output);
+}
+
+void ComputeSmoothingSums(const int32_t* JXL_RESTRICT dc_rows, size_t stride,
+                          const int32_t* JXL_RESTRICT weights, size_t begin,
+                          size_t end, int32_t* JXL_RESTRICT out) {
+  HWY_DYNAMIC_DISPATCH(ComputeSmoothingSums)
+  (dc_rows, stride, weights, begin, end, out);
+}
+
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
+  // The fixed-point IDCT does not use the biases.
+  if (cinfo->master->int_inverse_transform[ci] != nullptr) return false;
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
           compinfo.v_samp_factor == cinfo->max_v_samp_factor);
 }
@@ -346,6 +431,20 @@ void ComputeOptimalLaplacianBiases(const int num_blocks, const int* nonzeros,
   }
 }
 
+void SetDequantBiasStats(j_decompress_ptr cinfo, int ci, size_t num_blocks,
+                         const int32_t* nonzeros, const int32_t* sumabs) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t k0 = ci * DCTSIZE2;
+  memcpy(&m->nonzeros_[k0], nonzeros, DCTSIZE2 * sizeof(m->nonzeros_[0]));
+  memcpy(&m->sumabs_[k0], sumabs, DCTSIZE2 * sizeof(m->sumabs_[0]));
+  m->num_processed_blocks_[ci] = num_blocks;
+  memset(&m->biases_[k0], 0, DCTSIZE2 * sizeof(m->biases_[0]));
+  if (num_blocks > 0) {
+    ComputeOptimalLaplacianBiases(num_blocks, &m->nonzeros_[k0],
+                                  &m->sumabs_[k0], &m->biases_[k0]);
+  }
+}
+
 constexpr std::array<int, SAVED_COEFS> Q_POS = {0, 1, 8,  16, 9,
                                                 2, 3, 10, 17, 24};
 
@@ -392,162 +491,208 @@ bool do_smoothing(j_decompress_ptr cinfo) {
   return smoothing_useful;
 }
 
-void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
-                   size_t bx, int iy) {
-  const size_t imcu_row = cinfo->output_iMCU_row;
-  int16_t* scratch = cinfo->master->smoothing_scratch_;
-  std::vector<int> Q_VAL(SAVED_COEFS);
-  int* coef_bits;
-
-  std::array<std::array<int, 5>, 5> dc_values;
-  auto& compinfo = cinfo->comp_info[component];
-  const size_t by0 = imcu_row * compinfo.v_samp_factor;
-  const size_t by = by0 + iy;
-
-  int prev_iy = by > 0 ? iy - 1 : 0;
-  int prev_prev_iy = by > 1 ? iy - 2 : prev_iy;
-  int next_iy = by + 1 < compinfo.height_in_blocks ? iy + 1 : iy;
-  int next_next_iy = by + 2 < compinfo.height_in_blocks ? iy + 2 : next_iy;
-
-  const int16_t* cur_row = blocks[iy][bx];
-  const int16_t* prev_row = blocks[prev_iy][bx];
-  const int16_t* prev_prev_row = blocks[prev_prev_iy][bx];
-  const int16_t* next_row = blocks[next_iy][bx];
-  const int16_t* next_next_row = blocks[next_next_iy][bx];
-
-  int prev_block_ind = bx ? -DCTSIZE2 : 0;
-  int prev_prev_block_ind = bx > 1 ? -2 * DCTSIZE2 : prev_block_ind;
-  int next_block_ind = bx + 1 < compinfo.width_in_blocks ? DCTSIZE2 : 0;
-  int next_next_block_ind =
-      bx + 2 < compinfo.width_in_blocks ? DCTSIZE2 * 2 : next_block_ind;
-
-  std::array<const int16_t*, 5> row_ptrs = {prev_prev_row, prev_row, cur_row,
-                                            next_row, next_next_row};
-  std::array<int, 5> block_inds = {prev_prev_block_ind, prev_block_ind, 0,
-                                   next_block_ind, next_next_block_ind};
-
-  memcpy(scratch, cur_row, DCTSIZE2 * sizeof(cur_row[0]));
-
-  for (int r = 0; r < 5; ++r) {
-    for (int c = 0; c < 5; ++c) {
-      dc_values[r][c] = row_ptrs[r][block_inds[c]];
-    }
-  }
+struct SmoothingRow {
+  const int* coef_bits;
+  bool change_dc;
+  int qval[SAVED_COEFS];
+};
+
+// The 5x5 smoothing kernels applied to the DC values of the neighbouring
+// blocks, indexed by [change_dc][coefficient index][row][column]. The kernels
+// of coefficients 2, 5, 8 and 9 are the transposes of the kernels of 1, 3, 7
+// and 6, respectively.
+constexpr int32_t kSmoothingKernels[2][SAVED_COEFS][5][5] = {
+    {
+        // Only some of the AC coefficients are known.
+        {},
+        {{0, 0, 0, 0, 0},
+         {0, 0, 0, 0, 0},
+         {-7, 50, 0, -50, 7},
+         {0, 0, 0, 0, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, -7, 0, 0},
+         {0, 0, 50, 0, 0},
+         {0, 0, 0, 0, 0},
+         {0, 0, -50, 0, 0},
+         {0, 0, 7, 0, 0}},
+        {{0, 0, -1, 0, 0},
+         {0, 0, 13, 0, 0},
+         {0, 0, -24, 0, 0},
+         {0, 0, 13, 0, 0},
+         {0, 0, -1, 0, 0}},
+        {{0, -1, 0, 1, 0},
+         {-1, 10, 0, -10, 1},
+         {0, 0, 0, 0, 0},
+         {1, -10, 0, 10, -1},
+         {0, 1, 0, -1, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 0, 0, 0, 0},
+         {-1, 13, -24, 13, -1},
+         {0, 0, 0, 0, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 0, -1, 0},
+         {0, 2, 0, -2, 0},
+         {0, 1, 0, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, -3, 1, 0},
+         {0, 0, 0, 0, 0},
+         {0, -1, 3, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 0, -1, 0},
+         {0, -3, 0, 3, 0},
+         {0, 1, 0, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 2, 1, 0},
+         {0, 0, 0, 0, 0},
+         {0, -1, -2, -1, 0},
+         {0, 0, 0, 0, 0}},
+    },
+    {
+        // Only the DC coefficient is known.
+        {{-2, -6, -8, -6, -2},
+         {-6, 6, 42, 6, -6},
+         {-8, 42, 152, 42, -8},
+         {-6, 6, 42, 6, -6},
+         {-2, -6, -8, -6, -2}},
+        {{-1, -1, 0, 1, 1},
+         {-3, 13, 0, -13, 3},
+         {-3, 38, 0, -38, 3},
+         {-3, 13, 0, -13, 3},
+         {-1, -1, 0, 1, 1}},
+        {{-1, -3, -3, -3, -1},
+         {-1, 13, 38, 13, -1},
+         {0, 0, 0, 0, 0},
+         {1, -13, -38, -13, 1},
+         {1, 3, 3, 3, 1}},
+        {{0, 0, 1, 0, 0},
+         {0, 2, 7, 2, 0},
+         {0, -5, -14, -5, 0},
+         {0, 2, 7, 2, 0},
+         {0, 0, 1, 0, 0}},
+        {{-1, 0, 0, 0, 1},
+         {0, 9, 0, -9, 0},
+         {0, 0, 0, 0, 0},
+         {0, -9, 0, 9, 0},
+         {1, 0, 0, 0, -1}},
+        {{0, 0, 0, 0, 0},
+         {0, 2, -5, 2, 0},
+         {1, 7, -14, 7, 1},
+         {0, 2, -5, 2, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 0, -1, 0},
+         {0, 2, 0, -2, 0},
+         {0, 1, 0, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, -3, 1, 0},
+         {0, 0, 0, 0, 0},
+         {0, -1, 3, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 0, -1, 0},
+         {0, -3, 0, 3, 0},
+         {0, 1, 0, -1, 0},
+         {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0},
+         {0, 1, 2, 1, 0},
+         {0, 0, 0, 0, 0},
+         {0, -1, -2, -1, 0},
+         {0, 0, 0, 0, 0}},
+    },
+};
+
+// Computes the parameters of the block smoothing that are the same for a whole
+// block row of a component, and the weighted sums of the neighbouring DC
+// values of the blocks in [bx0, bx1) for each coefficient to be predicted.
+void PrepareSmoothingRow(j_decompress_ptr cinfo, JBLOCKARRAY blocks,
+                         int component, int iy, size_t bx0, size_t bx1,
+                         SmoothingRow* row) {
+  jpeg_decomp_master* m = cinfo->master;
+  const auto& compinfo = cinfo->comp_info[component];
+  const size_t by = cinfo->output_iMCU_row * compinfo.v_samp_factor + iy;
+  const size_t width = compinfo.width_in_blocks;
+  const size_t stride = m->smoothing_stride_;
   // Get the correct coef_bits: In case of an incomplete scan, we use the
   // prev coefficients.
   if (cinfo->output_iMCU_row + 1 > cinfo->input_iMCU_row) {
-    coef_bits = cinfo->master->prev_coef_bits_latch[component];
+    row->coef_bits = m->prev_coef_bits_latch[component];
   } else {
-    coef_bits = cinfo->master->coef_bits_latch[component];
+    row->coef_bits = m->coef_bits_latch[component];
   }
-
-  bool change_dc = true;
+  row->change_dc = true;
   for (int i = 1; i < SAVED_COEFS; i++) {
-    if (coef_bits[i] != -1) {
-      change_dc = false;
+    if (row->coef_bits[i] != -1) {
+      row->change_dc = false;
       break;
     }
   }
-
   JQUANT_TBL* quanttbl = cinfo->quant_tbl_ptrs[compinfo.quant_tbl_no];
-  for (size_t i = 0; i < 6; ++i) {
-    Q_VAL[i] = quanttbl->quantval[Q_POS[i]];
+  for (size_t i = 0; i < SAVED_COEFS; ++i) {
+    row->qval[i] = quanttbl->quantval[Q_POS[i]];
   }
-  if (change_dc) {
-    for (size_t i = 6; i < SAVED_COEFS; ++i) {
-      Q_VAL[i] = quanttbl->quantval[Q_POS[i]];
+  // Collect the DC values of the 5 block rows around the current one, with
+  // two blocks of padding on both sides, replicating the edge blocks.
+  for (int r = 0; r < 5; ++r) {
+    const int height = compinfo.height_in_blocks;
+    int dy = std::min(std::max(static_cast<int>(by) + r - 2, 0), height - 1);
+    const JBLOCKROW block_row = blocks[iy + dy - static_cast<int>(by)];
+    int32_t* dc_row = &m->smoothing_dc_rows_[r * stride];
+    for (size_t x = bx0 > 2 ? bx0 - 2 : 0; x < std::min(bx1 + 2, width); ++x) {
+      dc_row[x + 2] = block_row[x][0];
     }
+    for (size_t x = bx0; x < 2; ++x) {
+      dc_row[x] = block_row[0][0];
+    }
+    for (size_t x = width; x < bx1 + 2; ++x) {
+      dc_row[x + 2] = block_row[width - 1][0];
+    }
+  }
+  const int loop_end = row->change_dc ? SAVED_COEFS : 6;
+  for (int i = 0; i < loop_end; ++i) {
+    if (i == 0 ? !row->change_dc : row->coef_bits[i] == 0) continue;
+    ComputeSmoothingSums(m->smoothing_dc_rows_, stride,
+                         &kSmoothingKernels[row->change_dc][i][0][0], bx0, bx1,
+                         &m->smoothing_sums_[i * stride]);
   }
+}
+
+// Writes the smoothed version of the coefficients of block bx to the smoothing
+// scratch block, using the sums computed by PrepareSmoothingRow().
+void PredictSmooth(j_decompress_ptr cinfo, const SmoothingRow& row,
+                   const int16_t* coeffs, size_t bx) {
+  jpeg_decomp_master* m = cinfo->master;
+  int16_t* scratch = m->smoothing_scratch_;
+  memcpy(scratch, coeffs, DCTSIZE2 * sizeof(coeffs[0]));
+  const size_t stride = m->smoothing_stride_;
   auto calculate_dct_value = [&](int coef_index) {
-    int64_t num = 0;
     int pred;
-    int Al;
-    // we use the symmetry of the smoothing matrices by transposing the 5x5 dc
-    // matrix in that case.
-    bool swap_indices = coef_index == 2 || coef_index == 5 || coef_index == 8 ||
-                        coef_index == 9;
-    auto dc = [&](int i, int j) {
-      return swap_indices ? dc_values[j][i] : dc_values[i][j];
-    };
-    JPEGLI_CHECK(coef_index >= 0 && coef_index < 10);
-    Al = coef_bits[coef_index];
-    switch (coef_index) {
-      case 0:
-        // set the DC
-        num = (-2 * dc(0, 0) - 6 * dc(0, 1) - 8 * dc(0, 2) - 6 * dc(0, 3) -
-               2 * dc(0, 4) - 6 * dc(1, 0) + 6 * dc(1, 1) + 42 * dc(1, 2) +
-               6 * dc(1, 3) - 6 * dc(1, 4) - 8 * dc(2, 0) + 42 * dc(2, 1) +
-               152 * dc(2, 2) + 42 * dc(2, 3) - 8 * dc(2, 4) - 6 * dc(3, 0) +
-               6 * dc(3, 1) + 42 * dc(3, 2) + 6 * dc(3, 3) - 6 * dc(3, 4) -
-               2 * dc(4, 0) - 6 * dc(4, 1) - 8 * dc(4, 2) - 6 * dc(4, 3) -
-               2 * dc(4, 4));
-        // special case: for the DC the dequantization is different
-        Al = 0;
-        break;
-      case 1:
-      case 2:
-        // set Q01 or Q10
-        num = (change_dc ? (-dc(0, 0) - dc(0, 1) + dc(0, 3) + dc(0, 4) -
-                            3 * dc(1, 0) + 13 * dc(1, 1) - 13 * dc(1, 3) +
-                            3 * dc(1, 4) - 3 * dc(2, 0) + 38 * dc(2, 1) -
-                            38 * dc(2, 3) + 3 * dc(2, 4) - 3 * dc(3, 0) +
-                            13 * dc(3, 1) - 13 * dc(3, 3) + 3 * dc(3, 4) -
-                            dc(4, 0) - dc(4, 1) + dc(4, 3) + dc(4, 4))
-                         : (-7 * dc(2, 0) + 50 * dc(2, 1) - 50 * dc(2, 3) +
-                            7 * dc(2, 4)));
-        break;
-      case 3:
-      case 5:
-        // set Q02 or Q20
-        num = (change_dc
-                   ? dc(0, 2) + 2 * dc(1, 1) + 7 * dc(1, 2) + 2 * dc(1, 3) -
-                         5 * dc(2, 1) - 14 * dc(2, 2) - 5 * dc(2, 3) +
-                         2 * dc(3, 1) + 7 * dc(3, 2) + 2 * dc(3, 3) + dc(4, 2)
-                   : (-dc(0, 2) + 13 * dc(1, 2) - 24 * dc(2, 2) +
-                      13 * dc(3, 2) - dc(4, 2)));
-        break;
-      case 4:
-        // set Q11
-        num =
-            (change_dc ? -dc(0, 0) + dc(0, 4) + 9 * dc(1, 1) - 9 * dc(1, 3) -
-                             9 * dc(3, 1) + 9 * dc(3, 3) + dc(4, 0) - dc(4, 4)
-                       : (dc(1, 4) + dc(3, 0) - 10 * dc(3, 1) + 10 * dc(3, 3) -
-                          dc(0, 1) - dc(3, 4) + dc(4, 1) - dc(4, 3) + dc(0, 3) -
-                          dc(1, 0) + 10 * dc(1, 1) - 10 * dc(1, 3)));
-        break;
-      case 6:
-      case 9:
-        // set Q03 or Q30
-        num = (dc(1, 1) - dc(1, 3) + 2 * dc(2, 1) - 2 * dc(2, 3) + dc(3, 1) -
-               dc(3, 3));
-        break;
-      case 7:
-      case 8:
-      default:
-        // set Q12 and Q21
-        num = (dc(1, 1) - 3 * dc(1, 2) + dc(1, 3) - dc(3, 1) + 3 * dc(3, 2) -
-               dc(3, 3));
-        break;
-    }
-    num = Q_VAL[0] * num;
+    // Special case: for the DC the dequantization is different.
+    int Al = coef_index == 0 ? 0 : row.coef_bits[coef_index];
+    int64_t num = m->smoothing_sums_[coef_index * stride + bx];
+    num = row.qval[0] * num;
     if (num >= 0) {
-      pred = ((Q_VAL[coef_index] << 7) + num) / (Q_VAL[coef_index] << 8);
+      pred = ((row.qval[coef_index] << 7) + num) / (row.qval[coef_index] << 8);
       if (Al > 0 && pred >= (1 << Al)) pred = (1 << Al) - 1;
     } else {
-      pred = ((Q_VAL[coef_index] << 7) - num) / (Q_VAL[coef_index] << 8);
+      pred = ((row.qval[coef_index] << 7) - num) / (row.qval[coef_index] << 8);
       if (Al > 0 && pred >= (1 << Al)) pred = (1 << Al) - 1;
       pred = -pred;
     }
     return static_cast<int16_t>(pred);
   };
 
-  int loop_end = change_dc ? SAVED_COEFS : 6;
+  int loop_end = row.change_dc ? SAVED_COEFS : 6;
   for (int i = 1; i < loop_end; ++i) {
-    if (coef_bits[i] != 0 && scratch[Q_POS[i]] == 0) {
+    if (row.coef_bits[i] != 0 && scratch[Q_POS[i]] == 0) {
       scratch[Q_POS[i]] = calculate_dct_value(i);
     }
   }
-  if (change_dc) {
+  if (row.change_dc) {
     scratch[0] = calculate_dct_value(0);
   }
 }
@@ -576,9 +721,47 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   ChooseColorTransform(cinfo);
 }
 
+// Returns the [*xbegin, *xend) range of the columns of the full-width output
+// rows that have to be rendered for the cropped output. The range has a margin
+// of one iMCU column on both sides for the horizontal upsampling, and its
+// start is vector-aligned in each downsampled component.
+void GetRenderedColumns(j_decompress_ptr cinfo, size_t* xbegin, size_t* xend) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  const size_t full_width = m->iMCU_cols_ * imcu_width;
+  if (cinfo->raw_data_out) {
+    *xbegin = 0;
+    *xend = full_width;
+    return;
+  }
+  const size_t align =
+      cinfo->max_h_samp_factor * (HWY_ALIGNMENT / sizeof(float));
+  size_t x0 = m->xoffset_ > imcu_width ? m->xoffset_ - imcu_width : 0;
+  size_t x1 = m->xoffset_ + cinfo->output_width + imcu_width;
+  *xbegin = (x0 / align) * align;
+  *xend = std::min(RoundUpTo(x1, align), full_width);
+}
+
+// Returns true if none of the output rows that depend on the given iMCU row
+// will be rendered, because they are skipped by jpegli_skip_scanlines().
+bool IsiMCURowSkipped(j_decompress_ptr cinfo, size_t imcu_row) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  // With context rows, the vertical upsampling of the next iMCU row uses the
+  // last pixel row of this one.
+  return !cinfo->raw_data_out && (imcu_row + 2) * imcu_height <= m->skip_until_;
+}
+
 void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   const size_t imcu_row = cinfo->output_iMCU_row;
+  // The dequantization bias statistics are gathered for all blocks so that
+  // the output does not depend on the skipped and cropped regions, but the
+  // inverse transform is only done on the blocks that will be rendered.
+  const bool skip_idct = IsiMCURowSkipped(cinfo, imcu_row);
+  size_t xbegin;
+  size_t xend;
+  GetRenderedColumns(cinfo, &xbegin, &xend);
   JBLOCKARRAY blocks[kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
     const jpeg_component_info* comp = &cinfo->comp_info[c];
@@ -606,7 +789,8 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
         GatherBlockStats(coeffs, num, &m->nonzeros_[k0], &m->sumabs_[k0]);
         m->num_processed_blocks_[c] += compinfo.width_in_blocks;
       }
-      if (imcu_row % 4 == 3) {
+      if (imcu_row % kDequantBiasUpdateInterval ==
+          kDequantBiasUpdateInterval - 1) {
         // Re-compute optimal biases every few iMCU-rows.
         ComputeOptimalLaplacianBiases(m->num_processed_blocks_[c],
                                       &m->nonzeros_[k0], &m->sumabs_[k0],
@@ -614,26 +798,48 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
       }
     }
     RowBuffer<float>* raw_out = &m->raw_output_[c];
+    const size_t dctsize = m->scaled_dct_size[c];
+    const size_t bx0 = xbegin / m->h_factor[c] / dctsize;
+    const size_t bx1 = skip_idct ? bx0
+                                 : std::min<size_t>(
+                                       DivCeil(xend / m->h_factor[c], dctsize),
+                                       compinfo.width_in_blocks);
     for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
       size_t by = block_row + iy;
       if (by >= compinfo.height_in_blocks) {
         continue;
       }
-      size_t dctsize = m->scaled_dct_size[c];
       int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
       float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
-        if (m->apply_smoothing) {
-          PredictSmooth(cinfo, blocks[c], c, bx, iy);
-          (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        } else {
-          (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
+      SmoothingRow smoothing;
+      if (m->apply_smoothing && bx0 < bx1) {
+        PrepareSmoothingRow(cinfo, blocks[c], c, iy, bx0, bx1, &smoothing);
+      }
+      const auto int_inverse_transform = m->int_inverse_transform[c];
+      if (int_inverse_transform && !m->apply_smoothing) {
+        // The fixed-point transform processes several blocks per vector, so
+        // it is given all the blocks of the row at once.
+        if (bx0 < bx1) {
+          int_inverse_transform(&row_in[bx0 * DCTSIZE2], bx1 - bx0,
+                                &m->int_dequant_[k0], &row_out[bx0 * dctsize],
+                                raw_out->stride());
+        }
+      } else {
+        for (size_t bx = bx0; bx < bx1; ++bx) {
+          const int16_t* JXL_RESTRICT block = &row_in[bx * DCTSIZE2];
+          if (m->apply_smoothing) {
+            PredictSmooth(cinfo, smoothing, block, bx);
+            block = m->smoothing_scratch_;
+          }
+          if (int_inverse_transform) {
+            int_inverse_transform(block, 1, &m->int_dequant_[k0],
+                                  &row_out[bx * dctsize], raw_out->stride());
+          } else {
+            (*m->inverse_transform[c])(block, &m->dequant_[k0],
+                                       &m->biases_[k0], m->idct_scratch_,
+                                       &row_out[bx * dctsize],
+                                       raw_out->stride(), dctsize);
+          }
         }
       }
       if (m->streaming_mode_) {
@@ -671,12 +877,17 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                    JSAMPARRAY scanlines, size_t max_output_rows) {
   jpeg_decomp_master* m = cinfo->master;
   const int vfactor = cinfo->max_v_samp_factor;
-  const int hfactor = cinfo->max_h_samp_factor;
   const size_t context = m->need_context_rows_ ? 1 : 0;
   const size_t imcu_row = cinfo->output_iMCU_row;
   const size_t imcu_height = vfactor * m->min_scaled_dct_size;
-  const size_t imcu_width = hfactor * m->min_scaled_dct_size;
-  const size_t output_width = m->iMCU_cols_ * imcu_width;
+  size_t xbegin;
+  size_t xend;
+  GetRenderedColumns(cinfo, &xbegin, &xend);
+  const size_t xsize = xend - xbegin;
+  // The common case of 8-bit output without color quantization is rendered
+  // by the tiled row pipeline.
+  const bool fused_output = m->output_data_type_ == JPEGLI_TYPE_UINT8 &&
+                            !(cinfo->quantize_colors && m->quant_pass_ == 1);
   if (imcu_row == cinfo->total_iMCU_rows ||
       (imcu_row > context &&
        cinfo->output_scanline < (imcu_row - context) * imcu_height)) {
@@ -689,43 +900,52 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
     size_t yb = (ybegin / vfactor) * vfactor;
     size_t ye = DivCeil(yend, vfactor) * vfactor;
     for (size_t y = yb; y < ye; y += vfactor) {
-      for (int c = 0; c < cinfo->num_components; ++c) {
+      // Line groups that are skipped by jpegli_skip_scanlines() are not
+      // upsampled and color converted.
+      const bool skip_rows = !scanlines && y + vfactor <= m->skip_until_;
+      for (int c = 0; c < cinfo->num_components && !skip_rows; ++c) {
         RowBuffer<float>* raw_out = &m->raw_output_[c];
         RowBuffer<float>* render_out = &m->render_output_[c];
         int line_groups = vfactor / m->v_factor[c];
-        int downsampled_width = output_width / m->h_factor[c];
+        // The downsampled samples are placed at the start of the rendered
+        // column range, so that they can be upsampled in place.
+        size_t xbegin_in = xbegin / m->h_factor[c];
+        int downsampled_width = xsize / m->h_factor[c];
         size_t yc = y / m->v_factor[c];
         for (int dy = 0; dy < line_groups; ++dy) {
           size_t ymid = yc + dy;
-          const float* JXL_RESTRICT row_mid = raw_out->Row(ymid);
+          const float* JXL_RESTRICT row_mid = raw_out->Row(ymid) + xbegin_in;
           if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
             const float* JXL_RESTRICT row_top =
-                ymid == 0 ? row_mid : raw_out->Row(ymid - 1);
-            const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
-                                                    ? row_mid
-                                                    : raw_out->Row(ymid + 1);
+                (ymid == 0 ? raw_out->Row(ymid) : raw_out->Row(ymid - 1)) +
+                xbegin_in;
+            const float* JXL_RESTRICT row_bot =
+                (ymid + 1 == m->raw_height_[c] ? raw_out->Row(ymid)
+                                               : raw_out->Row(ymid + 1)) +
+                xbegin_in;
             Upsample2Vertical(row_top, row_mid, row_bot,
-                              render_out->Row(2 * dy),
-                              render_out->Row(2 * dy + 1), downsampled_width);
+                              render_out->Row(2 * dy) + xbegin,
+                              render_out->Row(2 * dy + 1) + xbegin,
+                              downsampled_width);
           } else {
             for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              memcpy(render_out->Row(m->v_factor[c] * dy + yix), row_mid,
-                     downsampled_width * sizeof(float));
+              memcpy(render_out->Row(m->v_factor[c] * dy + yix) + xbegin,
+                     row_mid, downsampled_width * sizeof(float));
             }
           }
           if (m->h_factor[c] > 1) {
             for (int yix = 0; yix < m->v_factor[c]; ++yix) {
               int row_ix = m->v_factor[c] * dy + yix;
-              float* JXL_RESTRICT row = render_out->Row(row_ix);
+              float* JXL_RESTRICT row = render_out->Row(row_ix) + xbegin;
               float* JXL_RESTRICT tmp = m->upsample_scratch_;
               if (cinfo->do_fancy_upsampling && m->h_factor[c] == 2) {
-                Upsample2Horizontal(row, tmp, output_width);
+                Upsample2Horizontal(row, tmp, xsize);
               } else {
                 // TODO(szabadka) SIMDify this.
-                for (size_t x = 0; x < output_width; ++x) {
+                for (size_t x = 0; x < xsize; ++x) {
                   tmp[x] = row[x / m->h_factor[c]];
                 }
-                memcpy(row, tmp, output_width * sizeof(tmp[0]));
+                memcpy(row, tmp, xsize * sizeof(tmp[0]));
               }
             }
           }
@@ -739,12 +959,21 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
         for (int c = 0; c < num_all_components; ++c) {
           rows[c] = m->render_output_[c].Row(yix);
         }
-        (*m->color_transform)(rows, output_width);
-        for (int c = 0; c < cinfo->out_color_components; ++c) {
-          // Undo the centering of the sample values around zero.
-          DecenterRow(rows[c], output_width);
+        if (scanlines && fused_output) {
+          RenderRowToUint8(cinfo, rows, xbegin, xsize,
+                           scanlines[*num_output_rows]);
+        } else if (!skip_rows) {
+          float* cropped_rows[kMaxComponents];
+          for (int c = 0; c < num_all_components; ++c) {
+            cropped_rows[c] = rows[c] + xbegin;
+          }
+          (*m->color_transform)(cropped_rows, xsize);
+          for (int c = 0; c < cinfo->out_color_components; ++c) {
+            // Undo the centering of the sample values around zero.
+            DecenterRow(cropped_rows[c], xsize);
+          }
         }
-        if (scanlines) {
+        if (scanlines && !fused_output) {
           uint8_t* output = scanlines[*num_output_rows];
           WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
                         cinfo->out_color_components, output);
@@ -8,11 +8,27 @@
 #define LIB_JPEGLI_RENDER_H_
 
 #include <cstddef>
+#include <cstdint>
 
 #include "lib/jpegli/common.h"
 
 namespace jpegli {
 
+// Number of iMCU rows between the updates of the dequantization biases.
+constexpr size_t kDequantBiasUpdateInterval = 4;
+
+bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci);
+
+void GatherBlockStats(const int16_t* coeffs, size_t coeffs_size,
+                      int32_t* nonzeros, int32_t* sumabs);
+
+// Sets the dequantization bias statistics of component ci to the ones gathered
+// over the first num_blocks blocks of the image, and the biases to the ones
+// computed from them. Decoding must continue with the first iMCU row of a
+// bias update interval that follows these blocks.
+void SetDequantBiasStats(j_decompress_ptr cinfo, int ci, size_t num_blocks,
+                         const int32_t* nonzeros, const int32_t* sumabs);
+
 void PrepareForOutput(j_decompress_ptr cinfo);
 
 void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
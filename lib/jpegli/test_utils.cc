@@ -306,6 +306,9 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   if (!jparams.use_adaptive_quantization) {
     os << "NoAQ";
   }
+  if (jparams.effort > 0) {
+    os << "Effort" << jparams.effort;
+  }
   if (jparams.restart_interval > 0) {
     os << "R" << jparams.restart_interval;
   }
@@ -647,6 +650,9 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   } else if (jparams.optimize_coding == 0) {
     cinfo->optimize_coding = FALSE;
   }
+  if (jparams.effort > 0) {
+    jpegli_set_effort(cinfo, jparams.effort);
+  }
   cinfo->raw_data_in = TO_JXL_BOOL(!input.raw_data.empty());
   if (jparams.optimize_coding == 0 && jparams.use_flat_dc_luma_code) {
     JHUFF_TBL* tbl = cinfo->dc_huff_tbl_ptrs[0];
@@ -116,6 +116,14 @@ class JPEGCodec : public ImageCodec {
       psnr_target_ = std::stof(param.substr(4));
       return true;
     }
+    if (param.compare(0, 6, "effort") == 0) {
+      effort_ = strtol(param.substr(6).c_str(), nullptr, 10);
+      return true;
+    }
+    if (param.compare(0, 5, "bamax") == 0) {
+      max_butteraugli_ = std::stof(param.substr(5));
+      return true;
+    }
     if (param[0] == 'p') {
       progressive_id_ = strtol(param.substr(1).c_str(), nullptr, 10);
       return true;
@@ -225,6 +233,12 @@ class JPEGCodec : public ImageCodec {
       if (psnr_target_ > 0) {
         settings.psnr_target = psnr_target_;
       }
+      if (max_butteraugli_ > 0) {
+        settings.butteraugli_target = max_butteraugli_;
+      }
+      if (effort_ > 0) {
+        settings.effort = effort_;
+      }
       if (jpegargs->search_tolerance > 0) {
         settings.search_tolerance = 0.01f * jpegargs->search_tolerance;
       }
@@ -334,6 +348,8 @@ class JPEGCodec : public ImageCodec {
   int progressive_id_ = -1;
   bool fix_codes_ = false;
   float psnr_target_ = 0.0f;
+  float max_butteraugli_ = 0.0f;
+  int effort_ = 0;
   bool enc_quality_set_ = false;
   int libjpeg_quality_ = 0;
   std::string libjpeg_chroma_subsampling_;
@@ -50,6 +50,12 @@ struct Args {
                             "Used for benchmarking, the default is 1.",
                             &num_reps, &ParseUnsigned);
 
+    cmdline->AddOptionValue('\0', "decode_speed", "0|1",
+                            "Sets the decoding speed, 0 (default) is the full "
+                            "precision decoder, 1 uses a faster fixed-point "
+                            "IDCT with slightly lower quality.",
+                            &decode_speed, &ParseUnsigned);
+
     cmdline->AddOptionFlag('\0', "quiet", "Silence output (except for errors).",
                            &quiet, &SetBooleanTrue);
   }
@@ -59,6 +65,7 @@ struct Args {
   bool disable_output = false;
   size_t bitdepth = 8;
   size_t num_reps = 1;
+  size_t decode_speed = 0;
   bool quiet = false;
 };
 
@@ -67,6 +74,10 @@ bool ValidateArgs(const Args& args) {
     fprintf(stderr, "Invalid --bitdepth argument\n");
     return false;
   }
+  if (args.decode_speed > 1) {
+    fprintf(stderr, "Invalid --decode_speed argument\n");
+    return false;
+  }
   return true;
 }
 
@@ -79,6 +90,7 @@ void SetDecompressParams(const Args& args, const std::string& extension,
     params->output_data_type = JXL_TYPE_UINT16;
     params->output_endianness = JXL_BIG_ENDIAN;
   }
+  params->decode_speed = static_cast<int>(args.decode_speed);
   if (extension == ".pgm") {
     params->force_grayscale = true;
   } else if (extension == ".ppm") {
@@ -153,6 +165,7 @@ int DJpegliMain(int argc, const char* argv[]) {
     const double t1 = jxl::Now();
     stats.NotifyElapsed(t1 - t0);
     stats.SetImageSize(ppf.info.xsize, ppf.info.ysize);
+    stats.SetFileSize(jpeg_bytes.size());
   }
 
   if (!args.quiet) {